@@ -25,6 +25,9 @@ rm -rf build/*.o
 # Make an ISO out of the kernel with grub-mkrescue
 cp kernel.bin iso/boot/kernel.bin
 cp grub.cfg iso/boot/grub/grub.cfg
+
+# Pack ramfs/ as the RAM disk GRUB loads next to the kernel (mounted at /ram)
+tar --format=ustar -cf iso/boot/ramdisk.tar -C ramfs .
 grub-mkrescue -o build/NickOS.iso iso
 
 rm -rf *.bin
\ No newline at end of file
@@ -0,0 +1,629 @@
+#pragma once
+
+#include "block.c"
+#include "debug.c"
+#include "idt.c"
+#include "io.c"
+#include "iosched.c"
+#include "pci.c"
+#include "timer.c"
+#include "utils.c"
+#include <stdint.h>
+
+// ===== AHCI (SATA) =====
+// Drives the first SATA disk behind an AHCI controller (QEMU: -device ahci
+// with an ide-hd on its bus). Commands are built in memory: the port has a
+// list of 32 command slots, each pointing to a command table with the
+// command FIS and the scatter-gather list (PRDT). With native command
+// queuing (READ/WRITE FPDMA QUEUED) every slot can be in flight at once and
+// the drive completes them in whatever order suits it; without NCQ one
+// command runs at a time. Paging is off, so buffer addresses are physical.
+//
+// Uses ata_identify_t / ata_parse_identify() and the ATA command numbers
+// from disk.c, which the kernel includes first.
+
+// HBA registers
+#define AHCI_CAP 0x00
+#define AHCI_GHC 0x04
+#define AHCI_IS 0x08
+#define AHCI_PI 0x0C
+
+#define AHCI_CAP_NCQ (1u << 30)
+#define AHCI_GHC_IE (1u << 1)
+#define AHCI_GHC_AE (1u << 31)
+
+// Port registers, relative to the port's block
+#define AHCI_PORT_BASE(n) (0x100 + (n) * 0x80)
+#define AHCI_PxCLB 0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB 0x08
+#define AHCI_PxFBU 0x0C
+#define AHCI_PxIS 0x10
+#define AHCI_PxIE 0x14
+#define AHCI_PxCMD 0x18
+#define AHCI_PxTFD 0x20
+#define AHCI_PxSIG 0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSCTL 0x2C
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34
+#define AHCI_PxCI 0x38
+
+#define AHCI_PxCMD_ST (1u << 0)
+#define AHCI_PxCMD_FRE (1u << 4)
+#define AHCI_PxCMD_FR (1u << 14)
+#define AHCI_PxCMD_CR (1u << 15)
+
+// Completions arrive as a D2H register FIS (non-queued) or a set device
+// bits FIS (NCQ); the rest are errors that stop the port
+#define AHCI_PxIS_DHRS (1u << 0)
+#define AHCI_PxIS_PSS (1u << 1)
+#define AHCI_PxIS_DSS (1u << 2)
+#define AHCI_PxIS_SDBS (1u << 3)
+#define AHCI_PxIS_FATAL 0x78000000u // TFES, HBFS, HBDS, IFS
+
+#define AHCI_PxIE_MASK \
+  (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | AHCI_PxIS_FATAL)
+
+#define AHCI_TFD_BSY 0x80
+#define AHCI_TFD_DRQ 0x08
+#define AHCI_TFD_ERR 0x01
+
+#define AHCI_SSTS_DET_PRESENT 3 // device present, link up
+#define AHCI_SSTS_IPM_ACTIVE 1
+#define AHCI_SIG_ATA 0x00000101
+
+#define AHCI_FIS_H2D 0x27
+#define AHCI_FIS_H2D_CMD 0x80 // command (not control) register update
+
+#define AHCI_SLOTS 32
+#define AHCI_PRDT_MAX 56                     // table = 128 + 56 * 16 = 1 KiB
+#define AHCI_PRD_MAX_BYTES 0x400000          // 4 MiB per PRDT entry
+#define AHCI_MAX_SECTORS (AHCI_PRD_MAX_BYTES / 512)
+#define AHCI_TIMEOUT_MS 500
+
+typedef struct
+{
+  uint16_t flags; // FIS length in dwords, AHCI_CMD_WRITE
+  uint16_t prdtl; // PRDT entries
+  volatile uint32_t prdbc;
+  uint32_t ctba;
+  uint32_t ctbau;
+  uint32_t reserved[4];
+} __attribute__((packed)) ahci_cmd_header_t;
+
+#define AHCI_CMD_FIS_LEN 5 // H2D register FIS: 20 bytes
+#define AHCI_CMD_WRITE (1 << 6)
+
+typedef struct
+{
+  uint32_t dba;
+  uint32_t dbau;
+  uint32_t reserved;
+  uint32_t dbc; // byte count - 1
+} __attribute__((packed)) ahci_prd_t;
+
+typedef struct
+{
+  uint8_t cfis[64];
+  uint8_t acmd[16];
+  uint8_t reserved[48];
+  ahci_prd_t prdt[AHCI_PRDT_MAX];
+} __attribute__((packed)) ahci_cmd_table_t;
+
+static ahci_cmd_header_t ahci_cmd_list[AHCI_SLOTS] __attribute__((aligned(1024)));
+static uint8_t ahci_rx_fis[256] __attribute__((aligned(256)));
+static ahci_cmd_table_t ahci_cmd_tables[AHCI_SLOTS] __attribute__((aligned(128)));
+static uint16_t ahci_identify_buf[256];
+
+typedef struct
+{
+  uint32_t abar; // HBA registers
+  uint32_t regs; // this port's registers
+  int port;
+  uint8_t irq;
+  uint8_t ncq;
+
+  uint32_t slot_mask; // slots we may use
+  uint32_t busy;      // slots holding a command
+
+  // Per slot: the request (or merged chain) and, for requests larger than
+  // one command, how far it got
+  blk_request_t *slot_req[AHCI_SLOTS];
+  uint32_t slot_done[AHCI_SLOTS];
+  uint32_t slot_count[AHCI_SLOTS];
+
+  // Requests waiting for a free slot (FIFO)
+  blk_request_t *head;
+  blk_request_t *tail;
+
+  uint32_t irq_count;
+  blkdev_t *dev;
+} ahci_port_t;
+
+ahci_port_t ahci_port;
+
+static uint32_t ahci_read(ahci_port_t *p, uint32_t reg)
+{
+  return mmio_read32(p->regs + reg);
+}
+
+static void ahci_write(ahci_port_t *p, uint32_t reg, uint32_t value)
+{
+  mmio_write32(p->regs + reg, value);
+}
+
+// Waits until (register & mask) == value. Returns 0, or 1 on timeout.
+static int ahci_wait(uint32_t addr, uint32_t mask, uint32_t value)
+{
+  uint64_t deadline = timer_now() + timer_ms_to_cycles(AHCI_TIMEOUT_MS);
+
+  while ((mmio_read32(addr) & mask) != value)
+  {
+    if (timer_now() > deadline)
+      return 1;
+  }
+  return 0;
+}
+
+// Stops command processing and FIS reception. Clears PxCI and PxSACT.
+static int ahci_port_stop(ahci_port_t *p)
+{
+  ahci_write(p, AHCI_PxCMD, ahci_read(p, AHCI_PxCMD) & ~AHCI_PxCMD_ST);
+  if (ahci_wait(p->regs + AHCI_PxCMD, AHCI_PxCMD_CR, 0))
+    return 1;
+
+  ahci_write(p, AHCI_PxCMD, ahci_read(p, AHCI_PxCMD) & ~AHCI_PxCMD_FRE);
+  return ahci_wait(p->regs + AHCI_PxCMD, AHCI_PxCMD_FR, 0);
+}
+
+static void ahci_port_start(ahci_port_t *p)
+{
+  ahci_wait(p->regs + AHCI_PxCMD, AHCI_PxCMD_CR, 0);
+  ahci_write(p, AHCI_PxCMD, ahci_read(p, AHCI_PxCMD) | AHCI_PxCMD_FRE);
+  ahci_write(p, AHCI_PxCMD, ahci_read(p, AHCI_PxCMD) | AHCI_PxCMD_ST);
+}
+
+// Host-to-device register FIS. NCQ commands carry the sector count in the
+// feature field and the slot (tag) in the count field.
+static void ahci_build_fis(uint8_t *fis, uint8_t command, uint64_t lba,
+                           uint32_t count, int ncq, int slot)
+{
+  memset(fis, 0, 20);
+
+  fis[0] = AHCI_FIS_H2D;
+  fis[1] = AHCI_FIS_H2D_CMD;
+  fis[2] = command;
+  fis[4] = lba & 0xFF;
+  fis[5] = (lba >> 8) & 0xFF;
+  fis[6] = (lba >> 16) & 0xFF;
+  fis[7] = 0x40; // LBA mode
+  fis[8] = (lba >> 24) & 0xFF;
+  fis[9] = (lba >> 32) & 0xFF;
+  fis[10] = (lba >> 40) & 0xFF;
+
+  if (ncq)
+  {
+    fis[3] = count & 0xFF;
+    fis[11] = (count >> 8) & 0xFF;
+    fis[12] = slot << 3;
+  }
+  else
+  {
+    fis[12] = count & 0xFF;
+    fis[13] = (count >> 8) & 0xFF;
+  }
+}
+
+// Appends one PRDT entry. Returns 0 if the buffer can't be described.
+static int ahci_add_prd(ahci_cmd_table_t *t, int *n, const void *buffer,
+                        uint32_t bytes)
+{
+  uint32_t addr = (uint32_t)buffer;
+
+  if ((addr & 1) || bytes == 0 || bytes > AHCI_PRD_MAX_BYTES ||
+      *n == AHCI_PRDT_MAX)
+    return 0;
+
+  t->prdt[*n].dba = addr;
+  t->prdt[*n].dbau = 0;
+  t->prdt[*n].reserved = 0;
+  t->prdt[*n].dbc = bytes - 1;
+  (*n)++;
+  return 1;
+}
+
+static void ahci_set_header(int slot, int write, int prdtl)
+{
+  ahci_cmd_header_t *h = &ahci_cmd_list[slot];
+
+  h->flags = AHCI_CMD_FIS_LEN | (write ? AHCI_CMD_WRITE : 0);
+  h->prdtl = prdtl;
+  h->prdbc = 0;
+  h->ctba = (uint32_t)&ahci_cmd_tables[slot];
+  h->ctbau = 0;
+}
+
+// Builds and starts the next command of the request in `slot`.
+// Returns 0, or 1 if its buffers can't be described to the HBA.
+static int ahci_issue(ahci_port_t *p, int slot)
+{
+  blk_request_t *req = p->slot_req[slot];
+  ahci_cmd_table_t *t = &ahci_cmd_tables[slot];
+  uint64_t lba = req->lba + p->slot_done[slot];
+  uint32_t ss = p->dev->sector_size;
+  uint32_t count;
+  int n = 0;
+
+  if (req->flush)
+  {
+    // Non-data and never queued; the scheduler dispatches a flush only
+    // with nothing else in flight
+    p->slot_count[slot] = 0;
+    ahci_build_fis(t->cfis, ATA_CMD_FLUSH_CACHE_EXT, 0, 0, 0, 0);
+    t->cfis[7] = 0;
+    ahci_set_header(slot, 0, 0);
+
+    io_barrier();
+    ahci_write(p, AHCI_PxCI, 1u << slot);
+    return 0;
+  }
+
+  if (req->merge_next)
+  {
+    // The scheduler keeps chains within max_sectors/max_segments, so
+    // every member fits one PRDT entry
+    count = blk_chain_sectors(req);
+    for (blk_request_t *r = req; r; r = r->merge_next)
+    {
+      if (!ahci_add_prd(t, &n, r->buffer, r->count * ss))
+        return 1;
+    }
+  }
+  else
+  {
+    count = req->count - p->slot_done[slot];
+    if (count > p->dev->max_sectors)
+      count = p->dev->max_sectors;
+
+    uint8_t *buf = (uint8_t *)req->buffer + p->slot_done[slot] * ss;
+    if (!ahci_add_prd(t, &n, buf, count * ss))
+      return 1;
+  }
+
+  p->slot_count[slot] = count;
+
+  uint8_t cmd;
+  if (p->ncq)
+    cmd = req->write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+  else
+    cmd = req->write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+
+  ahci_build_fis(t->cfis, cmd, lba, count, p->ncq, slot);
+  ahci_set_header(slot, req->write, n);
+
+  io_barrier();
+  if (p->ncq)
+    ahci_write(p, AHCI_PxSACT, 1u << slot);
+  ahci_write(p, AHCI_PxCI, 1u << slot);
+  return 0;
+}
+
+// Moves waiting requests into free slots
+static void ahci_start(ahci_port_t *p)
+{
+  while (p->head)
+  {
+    uint32_t free = p->slot_mask & ~p->busy;
+    if (!free)
+      return;
+
+    int slot = __builtin_ctz(free);
+    blk_request_t *req = p->head;
+
+    p->head = req->next;
+    if (!p->head)
+      p->tail = NULL;
+
+    p->busy |= 1u << slot;
+    p->slot_req[slot] = req;
+    p->slot_done[slot] = 0;
+
+    if (ahci_issue(p, slot))
+    {
+      DebugWriteString("AHCI: buffer not usable for DMA\n");
+      p->busy &= ~(1u << slot);
+      p->slot_req[slot] = NULL;
+      blk_complete(p->dev, req, 1);
+    }
+  }
+}
+
+// The command in `slot` finished: continue a large request or complete it
+static void ahci_slot_finish(ahci_port_t *p, int slot, int error)
+{
+  blk_request_t *req = p->slot_req[slot];
+
+  if (!error && !req->merge_next)
+  {
+    p->slot_done[slot] += p->slot_count[slot];
+    if (p->slot_done[slot] < req->count)
+    {
+      if (!ahci_issue(p, slot))
+        return;
+      error = 1;
+    }
+  }
+
+  p->busy &= ~(1u << slot);
+  p->slot_req[slot] = NULL;
+  blk_complete(p->dev, req, error);
+}
+
+// Restarts the port after an error or timeout. Every outstanding command
+// is lost (stopping the port clears PxCI/PxSACT) and fails.
+static void ahci_port_recover(ahci_port_t *p, const char *why)
+{
+  DebugWriteString(why);
+
+  ahci_port_stop(p);
+  ahci_write(p, AHCI_PxSERR, 0xFFFFFFFF);
+  ahci_write(p, AHCI_PxIS, 0xFFFFFFFF);
+
+  if (ahci_read(p, AHCI_PxTFD) & (AHCI_TFD_BSY | AHCI_TFD_DRQ))
+  {
+    // Drive still busy: COMRESET the link
+    uint32_t sctl = ahci_read(p, AHCI_PxSCTL) & ~0xFu;
+    uint64_t until = timer_now() + timer_ms_to_cycles(1);
+
+    ahci_write(p, AHCI_PxSCTL, sctl | 1);
+    while (timer_now() < until)
+      ;
+    ahci_write(p, AHCI_PxSCTL, sctl);
+    ahci_wait(p->regs + AHCI_PxSSTS, 0xF, AHCI_SSTS_DET_PRESENT);
+    ahci_write(p, AHCI_PxSERR, 0xFFFFFFFF);
+  }
+
+  ahci_port_start(p);
+
+  for (int slot = 0; slot < AHCI_SLOTS; slot++)
+  {
+    if (p->busy & (1u << slot))
+    {
+      blk_request_t *req = p->slot_req[slot];
+
+      p->busy &= ~(1u << slot);
+      p->slot_req[slot] = NULL;
+      blk_complete(p->dev, req, 1);
+    }
+  }
+
+  ahci_start(p);
+}
+
+// Completes finished commands. Runs from the IRQ handler and from
+// polling, always with interrupts disabled.
+static void ahci_service(ahci_port_t *p)
+{
+  uint32_t is = ahci_read(p, AHCI_PxIS);
+  ahci_write(p, AHCI_PxIS, is);
+
+  if (is & AHCI_PxIS_FATAL)
+  {
+    ahci_port_recover(p, "AHCI: port error, resetting\n");
+    return;
+  }
+
+  // A slot is done once the HBA took it (CI) and, for NCQ, the drive
+  // reported it complete (SACT)
+  uint32_t pending = ahci_read(p, AHCI_PxSACT) | ahci_read(p, AHCI_PxCI);
+  uint32_t finished = p->busy & ~pending;
+
+  while (finished)
+  {
+    int slot = __builtin_ctz(finished);
+    finished &= finished - 1;
+    ahci_slot_finish(p, slot, 0);
+  }
+
+  ahci_start(p);
+}
+
+static void ahci_irq(int irq)
+{
+  ahci_port_t *p = &ahci_port;
+  uint32_t bit = 1u << p->port;
+
+  // The line may be shared with other PCI devices
+  if (!(mmio_read32(p->abar + AHCI_IS) & bit))
+    return;
+
+  p->irq_count++;
+  ahci_service(p);
+  mmio_write32(p->abar + AHCI_IS, bit);
+}
+
+// Polled command in slot 0, used before the queue is running. `buffer`
+// receives `bytes` of data, or is NULL for a non-data command.
+// Returns 0 on success.
+static int ahci_exec_polled(ahci_port_t *p, uint8_t command, uint8_t feature,
+                            void *buffer, uint32_t bytes)
+{
+  ahci_cmd_table_t *t = &ahci_cmd_tables[0];
+  int n = 0;
+
+  if (buffer)
+    ahci_add_prd(t, &n, buffer, bytes);
+  ahci_build_fis(t->cfis, command, 0, 0, 0, 0);
+  t->cfis[3] = feature;
+  t->cfis[7] = 0;
+  ahci_set_header(0, 0, n);
+
+  ahci_write(p, AHCI_PxIS, 0xFFFFFFFF);
+  io_barrier();
+  ahci_write(p, AHCI_PxCI, 1);
+
+  uint64_t deadline = timer_now() + timer_ms_to_cycles(AHCI_TIMEOUT_MS);
+  while (ahci_read(p, AHCI_PxCI) & 1)
+  {
+    if ((ahci_read(p, AHCI_PxIS) & AHCI_PxIS_FATAL) || timer_now() > deadline)
+      return 1;
+  }
+
+  return (ahci_read(p, AHCI_PxTFD) & AHCI_TFD_ERR) != 0;
+}
+
+static int ahci_identify(ahci_port_t *p, ata_identify_t *id)
+{
+  if (ahci_exec_polled(p, ATA_CMD_IDENTIFY, 0, ahci_identify_buf,
+                       sizeof(ahci_identify_buf)))
+    return 1;
+
+  ata_parse_identify(ahci_identify_buf, id);
+  return 0;
+}
+
+// ===== Block device =====
+static void ahci_blk_submit(blkdev_t *dev, blk_request_t *req)
+{
+  ahci_port_t *p = (ahci_port_t *)dev->priv;
+
+  if (p->tail)
+    p->tail->next = req;
+  else
+    p->head = req;
+  p->tail = req;
+
+  ahci_start(p);
+}
+
+static void ahci_blk_poll(blkdev_t *dev)
+{
+  ahci_service((ahci_port_t *)dev->priv);
+}
+
+static void ahci_blk_abort(blkdev_t *dev)
+{
+  ahci_port_t *p = (ahci_port_t *)dev->priv;
+
+  if (p->busy)
+    ahci_port_recover(p, "AHCI: request timed out, port reset\n");
+}
+
+iosched_t ahci_iosched;
+
+blkdev_t ahci_blkdev = {
+    .name = "sata0",
+    .sector_size = ATA_SECTOR_BYTES,
+    .max_sectors = AHCI_MAX_SECTORS,
+    .max_segments = AHCI_PRDT_MAX,
+    .submit = ahci_blk_submit,
+    .poll = ahci_blk_poll,
+    .abort = ahci_blk_abort,
+    .priv = &ahci_port,
+};
+
+// Finds an AHCI controller with a SATA disk attached and brings up its
+// port. Returns 1 if ahci_blkdev is usable. Needs idt_init().
+int ahci_init(void)
+{
+  pci_device_t pci;
+  ahci_port_t *p = &ahci_port;
+  ata_identify_t id = {0};
+
+  if (!pci_find_class(0x01, 0x06, &pci) || pci.prog_if != 0x01)
+    return 0;
+
+  uint32_t abar = pci_read_bar(&pci, 5);
+  if (!abar)
+    return 0;
+
+  pci_enable_bus_master(&pci);
+  mmio_write32(abar + AHCI_GHC, mmio_read32(abar + AHCI_GHC) | AHCI_GHC_AE);
+
+  uint32_t cap = mmio_read32(abar + AHCI_CAP);
+  uint32_t implemented = mmio_read32(abar + AHCI_PI);
+
+  p->abar = abar;
+  p->port = -1;
+  for (int i = 0; i < 32; i++)
+  {
+    if (!(implemented & (1u << i)))
+      continue;
+
+    uint32_t regs = abar + AHCI_PORT_BASE(i);
+    uint32_t ssts = mmio_read32(regs + AHCI_PxSSTS);
+
+    if ((ssts & 0xF) == AHCI_SSTS_DET_PRESENT &&
+        ((ssts >> 8) & 0xF) == AHCI_SSTS_IPM_ACTIVE &&
+        mmio_read32(regs + AHCI_PxSIG) == AHCI_SIG_ATA)
+    {
+      p->port = i;
+      p->regs = regs;
+      break;
+    }
+  }
+
+  if (p->port < 0 || ahci_port_stop(p))
+    return 0;
+
+  memset(ahci_cmd_list, 0, sizeof(ahci_cmd_list));
+  memset(ahci_rx_fis, 0, sizeof(ahci_rx_fis));
+  memset(ahci_cmd_tables, 0, sizeof(ahci_cmd_tables));
+
+  ahci_write(p, AHCI_PxCLB, (uint32_t)ahci_cmd_list);
+  ahci_write(p, AHCI_PxCLBU, 0);
+  ahci_write(p, AHCI_PxFB, (uint32_t)ahci_rx_fis);
+  ahci_write(p, AHCI_PxFBU, 0);
+  ahci_write(p, AHCI_PxSERR, 0xFFFFFFFF);
+  ahci_write(p, AHCI_PxIS, 0xFFFFFFFF);
+  ahci_port_start(p);
+
+  if (ahci_identify(p, &id))
+  {
+    DebugWriteString("AHCI: IDENTIFY failed\n");
+    return 0;
+  }
+
+  // Queue depth: what both the HBA (CAP.NCS) and the drive can take
+  uint32_t slots = ((cap >> 8) & 0x1F) + 1;
+  p->ncq = (cap & AHCI_CAP_NCQ) && id.ncq;
+  if (!p->ncq)
+    slots = 1;
+  else if (id.queue_depth < slots)
+    slots = id.queue_depth;
+  p->slot_mask = slots == 32 ? 0xFFFFFFFF : (1u << slots) - 1;
+
+  p->dev = &ahci_blkdev;
+  ahci_blkdev.sectors = id.sectors48;
+  if (id.logical_sector_size && id.logical_sector_size <= ATA_MAX_SECTOR_BYTES)
+    ahci_blkdev.sector_size = id.logical_sector_size;
+  ahci_blkdev.phys_sectors = id.physical_sector_size / ahci_blkdev.sector_size;
+  ahci_blkdev.phys_offset = id.phys_offset;
+  ahci_blkdev.max_sectors = AHCI_PRD_MAX_BYTES / ahci_blkdev.sector_size;
+
+  // Volatile write cache on; blk_flush() commits it
+  if (id.write_cache)
+    ahci_blkdev.write_cache =
+        id.write_cache_on || !ahci_exec_polled(p, ATA_CMD_SET_FEATURES,
+                                               ATA_FEATURE_WRITE_CACHE_ON, NULL, 0);
+  iosched_attach(&ahci_blkdev, &ahci_iosched, slots);
+
+  ahci_write(p, AHCI_PxIS, 0xFFFFFFFF);
+  ahci_write(p, AHCI_PxIE, AHCI_PxIE_MASK);
+  if (pci.irq_line > 0 && pci.irq_line < 16 && !irq_install(pci.irq_line, ahci_irq))
+  {
+    p->irq = pci.irq_line;
+    mmio_write32(abar + AHCI_GHC, mmio_read32(abar + AHCI_GHC) | AHCI_GHC_IE);
+  }
+
+  char num[12];
+  DebugWriteString("AHCI: SATA disk on port ");
+  utoa_bare(num, sizeof(num), p->port, 10);
+  DebugWriteString(num);
+  DebugWriteString(p->ncq ? ", NCQ depth " : ", no NCQ, depth ");
+  utoa_bare(num, sizeof(num), slots, 10);
+  DebugWriteString(num);
+  DebugWriteString("\n");
+  return 1;
+}
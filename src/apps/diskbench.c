@@ -0,0 +1,278 @@
+#include "../bcache.c"
+#include "../block.c"
+#include "../debug.c"
+#include "../string.c"
+#include "../term.c"
+#include "../timer.c"
+#include "../utils.c"
+
+// Raw block device benchmark. Requests go straight to blk_read/blk_write
+// (scheduler and driver, no buffer cache), one at a time, so every sample
+// is the latency of a single command at queue depth 1.
+
+#define DISKBENCH_OPS 256
+#define DISKBENCH_MAX_BYTES (128 * 1024)
+#define DISKBENCH_SCRATCH_BYTES (4 * 1024 * 1024)
+
+static const uint32_t diskbench_sizes[] = {4096, 65536, DISKBENCH_MAX_BYTES};
+
+static uint8_t diskbench_buf[DISKBENCH_MAX_BYTES] __attribute__((aligned(4096)));
+static uint32_t diskbench_lat[DISKBENCH_OPS]; // microseconds
+static uint32_t diskbench_seed;
+
+typedef struct
+{
+  const char *name;
+  int write;
+  int random;
+} diskbench_test_t;
+
+static uint32_t diskbench_rand(void)
+{
+  diskbench_seed = diskbench_seed * 1103515245 + 12345;
+  return diskbench_seed >> 1;
+}
+
+static void diskbench_sort(uint32_t *v, int n)
+{
+  for (int i = 1; i < n; i++)
+  {
+    uint32_t x = v[i];
+    int j = i - 1;
+
+    while (j >= 0 && v[j] > x)
+    {
+      v[j + 1] = v[j];
+      j--;
+    }
+    v[j + 1] = x;
+  }
+}
+
+static void diskbench_print_num(uint32_t value, const char *unit)
+{
+  char num[32];
+
+  utoa_bare(num, sizeof(num), value, 10);
+  terminal_writestring(num);
+  terminal_writestring(unit);
+}
+
+// Prints hundredths as "<x>.<yy>"
+static void diskbench_print_fixed(uint32_t hundredths, const char *unit)
+{
+  char num[32];
+
+  utoa_bare(num, sizeof(num), hundredths / 100, 10);
+  terminal_writestring(num);
+  terminal_writestring(hundredths % 100 < 10 ? ".0" : ".");
+  utoa_bare(num, sizeof(num), hundredths % 100, 10);
+  terminal_writestring(num);
+  terminal_writestring(unit);
+}
+
+static void diskbench_debug_num(const char *key, uint32_t value)
+{
+  char num[32];
+
+  DebugWriteString(key);
+  utoa_bare(num, sizeof(num), value, 10);
+  DebugWriteString(num);
+}
+
+// LBA of operation `i`: walks forward through `span` sectors, or picks a
+// random `count`-aligned slot in it
+static uint64_t diskbench_lba(const diskbench_test_t *t, uint64_t base,
+                              uint64_t span, uint32_t count, uint32_t i)
+{
+  uint64_t slots64 = udiv64(span, count);
+  uint32_t slots = slots64 > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)slots64;
+  uint32_t slot = t->random ? diskbench_rand() % slots : i % slots;
+
+  return base + (uint64_t)slot * count;
+}
+
+// Runs one test and reports it. Writes put back what was read from the
+// same sectors just before, so the scratch range keeps its contents.
+// Returns 1 on a device error.
+static int diskbench_run(blkdev_t *dev, const diskbench_test_t *t,
+                         uint32_t bytes, uint64_t base, uint64_t span)
+{
+  uint32_t count = bytes / dev->sector_size;
+  uint64_t total = 0;
+
+  for (uint32_t i = 0; i < DISKBENCH_OPS; i++)
+  {
+    uint64_t lba = diskbench_lba(t, base, span, count, i);
+
+    if (t->write && blk_read(dev, lba, count, diskbench_buf))
+      return 1;
+
+    uint64_t start = timer_now();
+    int err = t->write ? blk_write(dev, lba, count, diskbench_buf)
+                       : blk_read(dev, lba, count, diskbench_buf);
+    uint64_t cycles = timer_now() - start;
+
+    if (err)
+      return 1;
+
+    total += cycles;
+    diskbench_lat[i] = (uint32_t)timer_cycles_to_us(cycles);
+  }
+
+  uint64_t us = timer_cycles_to_us(total);
+  if (us == 0)
+    us = 1;
+
+  uint64_t moved = (uint64_t)bytes * DISKBENCH_OPS;
+  uint32_t rate = (uint32_t)udiv64(moved * 100, (uint32_t)us); // MB/s * 100
+  uint32_t iops = (uint32_t)udiv64((uint64_t)DISKBENCH_OPS * 1000000, (uint32_t)us);
+
+  diskbench_sort(diskbench_lat, DISKBENCH_OPS);
+  uint32_t p50 = diskbench_lat[DISKBENCH_OPS / 2];
+  uint32_t p99 = diskbench_lat[DISKBENCH_OPS * 99 / 100];
+  uint32_t max = diskbench_lat[DISKBENCH_OPS - 1];
+
+  terminal_writestring(t->name);
+  terminal_writestring(" ");
+  diskbench_print_num(bytes / 1024, " KiB: ");
+  diskbench_print_fixed(rate, " MB/s, ");
+  diskbench_print_num(iops, " IOPS, p50 ");
+  diskbench_print_num(p50, " us, p99 ");
+  diskbench_print_num(p99, " us, max ");
+  diskbench_print_num(max, " us\n");
+
+  // One line per test for scripts reading QEMU's debugcon
+  DebugWriteString("diskbench dev=");
+  DebugWriteString(dev->name);
+  DebugWriteString(" test=");
+  DebugWriteString(t->name);
+  diskbench_debug_num(" bytes=", bytes);
+  diskbench_debug_num(" ops=", DISKBENCH_OPS);
+  diskbench_debug_num(" us=", (uint32_t)us);
+  diskbench_debug_num(" kbps=", (uint32_t)udiv64(moved * 1000, (uint32_t)us));
+  diskbench_debug_num(" iops=", iops);
+  diskbench_debug_num(" p50_us=", p50);
+  diskbench_debug_num(" p99_us=", p99);
+  diskbench_debug_num(" max_us=", max);
+  DebugWriteString("\n");
+
+  return 0;
+}
+
+static uint64_t diskbench_parse(const char *s, int *ok)
+{
+  uint64_t v = 0;
+
+  *ok = *s != 0;
+  for (; *s; s++)
+  {
+    if (*s < '0' || *s > '9')
+    {
+      *ok = 0;
+      return 0;
+    }
+    v = v * 10 + (uint32_t)(*s - '0');
+  }
+
+  return v;
+}
+
+// diskbench [device] [write <lba>]
+// Sequential and random reads on `device` (the file system disk by
+// default); with "write", also sequential and random writes inside
+// DISKBENCH_SCRATCH_BYTES starting at <lba>.
+void execute_diskbench(blkdev_t *disk, int argc, char **argv)
+{
+  blkdev_t *devices[] = {&ata_blkdev, ahci_port.dev ? &ahci_blkdev : NULL,
+                         virtio_blk.dev ? &virtio_blkdev : NULL};
+  blkdev_t *dev = disk;
+  uint64_t scratch = 0;
+  int write = 0;
+  int arg = 1;
+
+  if (arg < argc && strcmp(argv[arg], "write") != 0)
+  {
+    dev = NULL;
+    for (uint32_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++)
+    {
+      if (devices[i] && strcmp(devices[i]->name, argv[arg]) == 0)
+        dev = devices[i];
+    }
+    if (!dev)
+    {
+      terminal_writestring("No such device\n");
+      return;
+    }
+    arg++;
+  }
+
+  if (arg < argc)
+  {
+    int ok = 0;
+
+    if (strcmp(argv[arg], "write") == 0 && arg + 1 < argc)
+      scratch = diskbench_parse(argv[arg + 1], &ok);
+    if (!ok)
+    {
+      terminal_writestring("Usage: diskbench [device] [write <lba>]\n");
+      return;
+    }
+    write = 1;
+  }
+
+  if (dev->sectors == 0 || dev->sector_size > 4096)
+  {
+    terminal_writestring("Device not usable\n");
+    return;
+  }
+
+  uint64_t scratch_span = DISKBENCH_SCRATCH_BYTES / dev->sector_size;
+  if (write && scratch + scratch_span > dev->sectors)
+  {
+    terminal_writestring("Scratch range is past the end of the disk\n");
+    return;
+  }
+
+  // Cached changes go out first, so the benchmark neither races them nor
+  // reads stale sectors
+  bcache_sync();
+  diskbench_seed = (uint32_t)timer_now();
+
+  static const diskbench_test_t tests[] = {
+      {"seqread", 0, 0},
+      {"randread", 0, 1},
+      {"seqwrite", 1, 0},
+      {"randwrite", 1, 1},
+  };
+
+  terminal_writestring("Benchmarking ");
+  terminal_writestring(dev->name);
+  terminal_writestring(write ? " (reads and writes)\n" : " (reads)\n");
+
+  for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+  {
+    const diskbench_test_t *t = &tests[i];
+
+    if (t->write && !write)
+      continue;
+
+    uint64_t base = t->write ? scratch : 0;
+    uint64_t span = t->write ? scratch_span : dev->sectors;
+
+    for (uint32_t j = 0; j < sizeof(diskbench_sizes) / sizeof(diskbench_sizes[0]); j++)
+    {
+      if (diskbench_sizes[j] / dev->sector_size > span)
+        continue;
+
+      if (diskbench_run(dev, t, diskbench_sizes[j], base, span))
+      {
+        terminal_writestring("I/O error\n");
+        return;
+      }
+    }
+  }
+
+  if (write)
+    bcache_invalidate(dev, scratch, (uint32_t)scratch_span);
+}
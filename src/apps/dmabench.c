@@ -0,0 +1,80 @@
+#include "../term.c"
+#include "../timer.c"
+#include "../utils.c"
+
+#define DMABENCH_BYTES (4 * 1024 * 1024)
+#define DMABENCH_CHUNK_BYTES (64 * 1024) // per command
+
+static uint8_t dmabench_buf[DMABENCH_CHUNK_BYTES];
+
+// Prints "<x>.<yy> MB/s" for `bytes` moved in `us` microseconds
+static void dmabench_print_rate(uint32_t bytes, uint64_t us)
+{
+  char num[32];
+
+  if (us == 0)
+    us = 1;
+
+  // hundredths of MB/s
+  uint32_t rate = (uint32_t)udiv64((uint64_t)bytes * 100, (uint32_t)us);
+  uint32_t whole = rate / 100;
+  uint32_t frac = rate % 100;
+
+  utoa_bare(num, sizeof(num), whole, 10);
+  terminal_writestring(num);
+  terminal_writestring(frac < 10 ? ".0" : ".");
+  utoa_bare(num, sizeof(num), frac, 10);
+  terminal_writestring(num);
+  terminal_writestring(" MB/s (");
+  utoa_bare(num, sizeof(num), (uint32_t)udiv64(us, 1000), 10);
+  terminal_writestring(num);
+  terminal_writestring(" ms)\n");
+}
+
+// Returns elapsed microseconds, or 0 if a read failed
+static uint64_t dmabench_run(int (*read)(uint64_t, uint32_t, void *),
+                             uint32_t sectors)
+{
+  uint32_t chunk = sizeof(dmabench_buf) / ata_sector_size;
+  uint64_t start = timer_now();
+
+  for (uint32_t lba = 0; lba < sectors; lba += chunk)
+  {
+    uint32_t n = sectors - lba < chunk ? sectors - lba : chunk;
+    if (read(lba, n, dmabench_buf))
+      return 0;
+  }
+
+  return timer_cycles_to_us(timer_now() - start);
+}
+
+// Sequential read of the first 4 MiB of the disk, PIO vs bus-master DMA
+void execute_dmabench()
+{
+  ata_identify_t id = {0};
+  ata_identify(&id);
+
+  uint32_t sectors = DMABENCH_BYTES / ata_sector_size;
+  if (id.sectors && id.sectors < sectors)
+    sectors = id.sectors;
+
+  terminal_writestring("PIO: ");
+  uint64_t us = dmabench_run(ata_pio_read_sectors, sectors);
+  if (us)
+    dmabench_print_rate(sectors * ata_sector_size, us);
+  else
+    terminal_writestring("read error\n");
+
+  terminal_writestring("DMA: ");
+  if (!ata_dma_enabled)
+  {
+    terminal_writestring("not available\n");
+    return;
+  }
+
+  us = dmabench_run(ata_dma_read_sectors, sectors);
+  if (us)
+    dmabench_print_rate(sectors * ata_sector_size, us);
+  else
+    terminal_writestring("read error\n");
+}
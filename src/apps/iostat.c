@@ -0,0 +1,91 @@
+#include "../bcache.c"
+#include "../iosched.c"
+#include "../term.c"
+#include "../timer.c"
+#include "../utils.c"
+
+static void iostat_line(const char *label, uint32_t value, const char *unit)
+{
+  char num[32];
+
+  terminal_writestring(label);
+  utoa_bare(num, sizeof(num), value, 10);
+  terminal_writestring(num);
+  terminal_writestring(unit);
+  terminal_writestring("\n");
+}
+
+static void iostat_device(blkdev_t *dev)
+{
+  iosched_t *s = dev->sched;
+  char num[32];
+
+  terminal_writestring(dev->name);
+  terminal_writestring(":\n");
+  if (!s)
+  {
+    terminal_writestring("  no scheduler\n");
+    return;
+  }
+
+  iostat_line("  submitted:   ", s->submitted, "");
+  iostat_line("  dispatched:  ", s->dispatched, "");
+  iostat_line("  merged:      ", s->merges, "");
+  iostat_line("  forwarded:   ", s->forwarded, "");
+
+  // Average depth in hundredths
+  uint32_t depth = s->submitted ? (uint32_t)udiv64(s->depth_sum * 100, s->submitted) : 0;
+  terminal_writestring("  avg depth:   ");
+  utoa_bare(num, sizeof(num), depth / 100, 10);
+  terminal_writestring(num);
+  terminal_writestring(depth % 100 < 10 ? ".0" : ".");
+  utoa_bare(num, sizeof(num), depth % 100, 10);
+  terminal_writestring(num);
+  terminal_writestring("\n");
+
+  uint64_t avg = s->latency_count ? udiv64(s->latency_sum, s->latency_count) : 0;
+  iostat_line("  avg latency: ", (uint32_t)timer_cycles_to_us(avg), " us");
+  iostat_line("  max latency: ", (uint32_t)timer_cycles_to_us(s->latency_max), " us");
+}
+
+static void iostat_cache(void)
+{
+  terminal_writestring("block cache:\n");
+  iostat_line("  hits:        ", bcache.hits, "");
+  iostat_line("  misses:      ", bcache.misses, "");
+  iostat_line("  evictions:   ", bcache.evictions, "");
+  iostat_line("  dirty:       ", bcache.dirty, " sectors");
+  iostat_line("  written:     ", bcache.written, " sectors");
+  iostat_line("  flushes:     ", bcache.flushes, "");
+  iostat_line("  read ahead:  ", bcache.prefetched, " sectors");
+  iostat_line("  discarded:   ", bcache.discarded, " sectors");
+  iostat_line("  cached:      ", bcache.entries, " sectors");
+  iostat_line("  memory:      ", bcache.used / 1024, " KiB");
+  iostat_line("  budget:      ", bcache.budget / 1024, " KiB");
+}
+
+static void iostat_fat32(void)
+{
+  terminal_writestring("FAT32:\n");
+  iostat_line("  FAT lookups: ", fat32_stats.fat_lookups, "");
+  iostat_line("  FAT reads:   ", fat32_stats.fat_reads, "");
+  iostat_line("  dentry hits: ", fat32_stats.dentry_hits, "");
+  iostat_line("  dir scans:   ", fat32_stats.dir_scans, "");
+}
+
+// Shows the I/O scheduler counters of every block device and the block
+// cache hit rate
+void execute_iostat()
+{
+  iostat_device(&ata_blkdev);
+  if (ahci_port.dev)
+    iostat_device(&ahci_blkdev);
+  if (virtio_blk.dev)
+  {
+    iostat_device(&virtio_blkdev);
+    iostat_line("  notifies:    ", virtio_blk.notifies, "");
+    iostat_line("  interrupts:  ", virtio_blk.irq_count, "");
+  }
+  iostat_cache();
+  iostat_fat32();
+}
@@ -0,0 +1,148 @@
+#include "../debug.c"
+#include "../lz4.c"
+#include "../ramfs.c"
+#include "../string.c"
+#include "../term.c"
+#include "../timer.c"
+#include "../utils.c"
+
+// Effective read throughput of files as cat sees them: each file is read
+// to the end in LZ4_IN_CHUNK pieces, decompressing LZ4 frames on the fly.
+// Run it on a raw file and its .lz4 version to compare the two.
+
+static uint8_t lz4bench_buf[LZ4_IN_CHUNK];
+
+typedef struct
+{
+  lz4_read_fn read;
+  void *ctx;
+  iso_file_t iso;
+  fat32_file_t fat;
+  ramfs_file_t ram;
+} lz4bench_file_t;
+
+// /cdrom/..., /home/... or /ram/...; returns 1 when the file was opened
+static int lz4bench_open(const char *path, lz4bench_file_t *f)
+{
+  if (memcmp(path, "/cdrom/", 7) == 0 && iso_open(path + 6, &f->iso))
+  {
+    f->read = iso_lz4_read;
+    f->ctx = &f->iso;
+    return 1;
+  }
+  if (memcmp(path, "/home/", 6) == 0 && fat32_open(path + 5, &f->fat))
+  {
+    f->read = fat32_lz4_read;
+    f->ctx = &f->fat;
+    return 1;
+  }
+  if (memcmp(path, "/ram/", 5) == 0 &&
+      ramfs_open(path + 4, &f->ram.data, &f->ram.size))
+  {
+    f->ram.pos = 0;
+    f->read = ramfs_read;
+    f->ctx = &f->ram;
+    return 1;
+  }
+  return 0;
+}
+
+static void lz4bench_num(uint32_t value, const char *unit)
+{
+  char num[32];
+
+  utoa_bare(num, sizeof(num), value, 10);
+  terminal_writestring(num);
+  terminal_writestring(unit);
+}
+
+static void lz4bench_debug_num(const char *key, uint32_t value)
+{
+  char num[32];
+
+  DebugWriteString(key);
+  utoa_bare(num, sizeof(num), value, 10);
+  DebugWriteString(num);
+}
+
+static void lz4bench_run(const char *path)
+{
+  static lz4bench_file_t file;
+
+  if (!lz4bench_open(path, &file))
+  {
+    terminal_writestring(path);
+    terminal_writestring(": not found\n");
+    return;
+  }
+
+  uint64_t start = timer_now();
+  uint32_t stored = 0;
+  uint32_t bytes = 0;
+  int32_t n = file.read(file.ctx, lz4bench_buf, sizeof(lz4bench_buf));
+  int lz4 = n > 0 && lz4_is_frame(lz4bench_buf, (uint32_t)n);
+
+  if (lz4)
+  {
+    if (lz4_open(&lz4_stream, file.read, file.ctx, lz4bench_buf, (uint32_t)n))
+      n = -1;
+    while (n > 0)
+    {
+      n = lz4_read(&lz4_stream, lz4bench_buf, sizeof(lz4bench_buf));
+      if (n > 0)
+        bytes += (uint32_t)n;
+    }
+    stored = lz4_stream.in_total;
+  }
+  else
+  {
+    while (n > 0)
+    {
+      bytes += (uint32_t)n;
+      n = file.read(file.ctx, lz4bench_buf, sizeof(lz4bench_buf));
+    }
+    stored = bytes;
+  }
+
+  uint64_t us = timer_cycles_to_us(timer_now() - start);
+  if (us == 0)
+    us = 1;
+
+  if (n < 0)
+  {
+    terminal_writestring(path);
+    terminal_writestring(": read error\n");
+    return;
+  }
+
+  uint32_t kbps = (uint32_t)udiv64((uint64_t)bytes * 1000, (uint32_t)us);
+
+  terminal_writestring(path);
+  terminal_writestring(lz4 ? " (lz4): " : " (raw): ");
+  lz4bench_num(stored / 1024, " KiB stored, ");
+  lz4bench_num(bytes / 1024, " KiB read in ");
+  lz4bench_num((uint32_t)udiv64(us, 1000), " ms, ");
+  lz4bench_num(kbps / 1000, " MB/s\n");
+
+  DebugWriteString("lz4bench path=");
+  DebugWriteString(path);
+  DebugWriteString(lz4 ? " format=lz4" : " format=raw");
+  lz4bench_debug_num(" stored=", stored);
+  lz4bench_debug_num(" bytes=", bytes);
+  lz4bench_debug_num(" us=", (uint32_t)us);
+  lz4bench_debug_num(" kbps=", kbps);
+  DebugWriteString("\n");
+}
+
+// lz4bench <path>...
+void execute_lz4bench(int argc, char **argv)
+{
+  if (argc < 2)
+  {
+    terminal_writestring("Usage: lz4bench <path>...\n");
+    return;
+  }
+
+  for (int i = 1; i < argc; i++)
+    lz4bench_run(argv[i]);
+}
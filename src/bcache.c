@@ -0,0 +1,947 @@
+#pragma once
+
+#include "block.c"
+#include "debug.c"
+#include "iosched.c"
+#include "memory.c"
+#include "timer.c"
+#include "utils.c"
+#include <stddef.h>
+#include <stdint.h>
+
+// ===== Block buffer cache =====
+// One entry per device sector, keyed by (device, LBA). Lookups go through a
+// hash table; entries are also kept on an LRU list and the least recently
+// used ones are evicted once the cache grows past its memory budget.
+//
+// In write-back mode (the default) writes only update the cache and mark
+// the sectors dirty. Dirty sectors are written out together, sorted by LBA
+// so the I/O scheduler can merge neighbours: by bcache_sync() (the `sync`
+// command, poweroff/reboot), when they have been dirty for
+// BCACHE_FLUSH_AGE_MS (checked from the keyboard idle loop) and before a
+// dirty entry would be evicted. Repeated writes to the same FAT or
+// directory sector thus cost one disk write.
+//
+// Long runs of missing sectors (file data streamed in big chunks) are read
+// straight into the caller's buffer and not kept, so one large read doesn't
+// push all the metadata out of the cache.
+//
+// On disks whose physical blocks hold several logical sectors (512e,
+// 4Kn with larger blocks), a dirtied sector pulls the rest of its physical
+// block into the cache and is written back together with it, so the drive
+// always gets whole, aligned blocks and never has to read-modify-write.
+//
+// bcache_sync() ends with a cache flush (blk_flush) of every device written
+// through the cache since the last sync, so after it returns the data is
+// on stable media even with the drive's write cache on.
+//
+// Freed space is reported with bcache_discard(). Ranges are queued,
+// coalesced with their neighbours and sent as batched discard requests by
+// bcache_sync(), after the dirty metadata that freed them is on disk.
+// Writing to a queued range takes it out of the queue again.
+//
+// bcache_prefetch() starts reads into the cache without waiting for them
+// (read-ahead). Such entries are visible right away; a lookup that finds
+// one still in flight waits for it.
+
+#define BCACHE_BUCKETS 256
+#define BCACHE_DEFAULT_BUDGET (256 * 1024) // bytes of heap, headers included
+#define BCACHE_MAX_FILL (32 * 1024)        // largest miss run that is cached
+#define BCACHE_FLUSH_AGE_MS 5000            // how long data may stay dirty
+#define BCACHE_FLUSH_BATCH 64               // write-back requests in flight
+#define BCACHE_PREFETCH_MAX 128             // prefetch requests in flight
+#define BCACHE_PHYS_MAX (32 * 1024)         // largest physical block handled
+#define BCACHE_DISCARD_MAX 128              // queued discard ranges
+#define BCACHE_DEVICES 4                    // devices flushed by a sync
+
+typedef struct bcache_entry bcache_entry_t;
+
+struct bcache_entry
+{
+  blkdev_t *dev;
+  uint64_t lba;
+  uint32_t size; // bytes of data (the device's sector size)
+  uint8_t dirty;         // newer than the disk
+  uint8_t failed;        // prefetch error, data is garbage
+  blk_request_t *pending; // prefetch still reading into `data`
+
+  bcache_entry_t *hash_next;
+  bcache_entry_t *lru_prev; // towards most recently used
+  bcache_entry_t *lru_next; // towards least recently used
+
+  uint8_t data[];
+};
+
+typedef struct
+{
+  bcache_entry_t *buckets[BCACHE_BUCKETS];
+  bcache_entry_t *mru;
+  bcache_entry_t *lru;
+
+  uint32_t budget;
+  uint32_t used; // bytes, headers included
+  uint32_t entries;
+
+  uint8_t write_back;
+  uint32_t dirty;       // dirty entries
+  uint32_t dirty_since; // timer_ticks when the oldest became dirty
+
+  uint32_t hits;
+  uint32_t misses;
+  uint32_t evictions;
+  uint32_t flushes;
+  uint32_t written;    // sectors written back
+  uint32_t prefetched; // sectors read ahead
+  uint32_t discarded;  // sectors discarded
+
+  // Devices written since the last sync
+  blkdev_t *written_devs[BCACHE_DEVICES];
+  uint32_t written_dev_count;
+
+  // Discards waiting for the next sync, sorted by LBA, never adjacent
+  blkdev_t *discard_dev;
+  blk_range_t discards[BCACHE_DISCARD_MAX];
+  uint32_t discard_count;
+} bcache_t;
+
+bcache_t bcache = {.budget = BCACHE_DEFAULT_BUDGET, .write_back = 1};
+
+int bcache_sync(void);
+static int bcache_flush_dirty(void);
+static int bcache_flush_devices(void);
+static void bcache_discard_cancel(blkdev_t *dev, uint64_t lba, uint32_t count);
+
+static uint32_t bcache_hash(const blkdev_t *dev, uint64_t lba)
+{
+  uint32_t h = (uint32_t)lba ^ (uint32_t)(lba >> 32) ^ ((uint32_t)dev >> 4);
+  return (h * 2654435761u) >> 24; // 8 bits -> BCACHE_BUCKETS
+}
+
+static uint32_t bcache_entry_bytes(uint32_t size)
+{
+  return sizeof(bcache_entry_t) + size;
+}
+
+static void bcache_lru_unlink(bcache_entry_t *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    bcache.mru = e->lru_next;
+
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    bcache.lru = e->lru_prev;
+}
+
+static void bcache_lru_push(bcache_entry_t *e)
+{
+  e->lru_prev = NULL;
+  e->lru_next = bcache.mru;
+  if (bcache.mru)
+    bcache.mru->lru_prev = e;
+  bcache.mru = e;
+  if (!bcache.lru)
+    bcache.lru = e;
+}
+
+static void bcache_hash_unlink(bcache_entry_t *e)
+{
+  bcache_entry_t **link = &bcache.buckets[bcache_hash(e->dev, e->lba)];
+
+  while (*link && *link != e)
+    link = &(*link)->hash_next;
+  if (*link)
+    *link = e->hash_next;
+}
+
+// Takes an entry out of the cache without freeing it
+static void bcache_remove(bcache_entry_t *e)
+{
+  bcache_hash_unlink(e);
+  bcache_lru_unlink(e);
+  bcache.used -= bcache_entry_bytes(e->size);
+  bcache.entries--;
+
+  if (e->dirty)
+  {
+    e->dirty = 0;
+    bcache.dirty--;
+  }
+}
+
+static void bcache_mark_dirty(bcache_entry_t *e)
+{
+  if (e->dirty)
+    return;
+
+  if (!bcache.dirty)
+    bcache.dirty_since = timer_ticks;
+  e->dirty = 1;
+  bcache.dirty++;
+}
+
+static bcache_entry_t *bcache_find(blkdev_t *dev, uint64_t lba)
+{
+  bcache_entry_t *e = bcache.buckets[bcache_hash(dev, lba)];
+
+  while (e && (e->dev != dev || e->lba != lba))
+    e = e->hash_next;
+  return e;
+}
+
+// Waits for a prefetch into `e`, if one is running. The completion
+// callback clears `pending` from interrupt context, so read it once.
+static void bcache_settle(bcache_entry_t *e)
+{
+  blk_request_t *req = e->pending;
+
+  if (req)
+    blk_wait(e->dev, req);
+}
+
+// Finds a cached sector and marks it most recently used
+static bcache_entry_t *bcache_lookup(blkdev_t *dev, uint64_t lba)
+{
+  bcache_entry_t *e = bcache_find(dev, lba);
+  if (!e)
+    return NULL;
+
+  bcache_settle(e);
+  if (e->failed)
+  {
+    bcache_remove(e);
+    free(e);
+    return NULL;
+  }
+
+  bcache_lru_unlink(e);
+  bcache_lru_push(e);
+  return e;
+}
+
+// Drops the least recently used entry (written back first if dirty) and
+// returns it for reuse or freeing
+static bcache_entry_t *bcache_evict_lru(void)
+{
+  // Write everything back in one sorted pass rather than one sector
+  // per eviction. Only a write-back: no discards or cache flushes here.
+  if (bcache.lru->dirty)
+    bcache_flush_dirty();
+
+  bcache_entry_t *victim = bcache.lru;
+
+  bcache_settle(victim);
+  bcache_remove(victim);
+  bcache.evictions++;
+  return victim;
+}
+
+// Returns an unused entry for a sector of `size` bytes. Evicts from the
+// LRU end until the budget allows it; an evicted entry of the right size
+// is reused as is, which keeps the heap from fragmenting.
+static bcache_entry_t *bcache_alloc(uint32_t size)
+{
+  uint32_t bytes = bcache_entry_bytes(size);
+
+  if (bytes > bcache.budget)
+    return NULL;
+
+  while (bcache.lru && bcache.used + bytes > bcache.budget)
+  {
+    bcache_entry_t *victim = bcache_evict_lru();
+
+    if (victim->size == size)
+      return victim;
+    free(victim);
+  }
+
+  return malloc(bytes);
+}
+
+// Adds an entry for one sector, contents not filled in. Returns NULL if
+// there is no memory for it.
+static bcache_entry_t *bcache_new(blkdev_t *dev, uint64_t lba)
+{
+  bcache_entry_t *e = bcache_alloc(dev->sector_size);
+  if (!e)
+    return NULL;
+
+  e->dev = dev;
+  e->lba = lba;
+  e->size = dev->sector_size;
+  e->dirty = 0;
+  e->failed = 0;
+  e->pending = NULL;
+
+  uint32_t b = bcache_hash(dev, lba);
+  e->hash_next = bcache.buckets[b];
+  bcache.buckets[b] = e;
+  bcache_lru_push(e);
+
+  bcache.used += bcache_entry_bytes(e->size);
+  bcache.entries++;
+  return e;
+}
+
+// Caches a copy of one sector
+static bcache_entry_t *bcache_insert(blkdev_t *dev, uint64_t lba,
+                                     const void *data)
+{
+  bcache_entry_t *e = bcache_new(dev, lba);
+
+  if (e)
+    memcpy(e->data, data, e->size);
+  return e;
+}
+
+// Updates the cached copies of `count` sectors after they were written to
+// the disk. Short runs are added to the cache, long ones only refresh what
+// is there.
+static void bcache_store(blkdev_t *dev, uint64_t lba, uint32_t count,
+                         const void *data)
+{
+  uint32_t ss = dev->sector_size;
+  int fill = count * ss <= BCACHE_MAX_FILL;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const uint8_t *src = (const uint8_t *)data + i * ss;
+    bcache_entry_t *e = bcache_lookup(dev, lba + i);
+
+    if (e)
+    {
+      memcpy(e->data, src, ss);
+      if (e->dirty)
+      {
+        e->dirty = 0;
+        bcache.dirty--;
+      }
+    }
+    else if (fill)
+      bcache_insert(dev, lba + i, src);
+  }
+}
+
+// Drops cached copies of `count` sectors
+void bcache_invalidate(blkdev_t *dev, uint64_t lba, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++)
+  {
+    bcache_entry_t *e = bcache_lookup(dev, lba + i);
+    if (e)
+    {
+      bcache_remove(e);
+      free(e);
+    }
+  }
+}
+
+// Reads `count` sectors, from the cache where possible. Consecutive
+// misses are fetched from the device with one request.
+int bcache_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer)
+{
+  uint32_t ss = dev->sector_size;
+  uint8_t *buf = (uint8_t *)buffer;
+  uint32_t i = 0;
+
+  while (i < count)
+  {
+    bcache_entry_t *e = bcache_lookup(dev, lba + i);
+    if (e)
+    {
+      memcpy(buf + i * ss, e->data, ss);
+      bcache.hits++;
+      i++;
+      continue;
+    }
+
+    uint32_t run = 1;
+    while (i + run < count && !bcache_lookup(dev, lba + i + run))
+      run++;
+
+    bcache.misses += run;
+    if (blk_read(dev, lba + i, run, buf + i * ss))
+      return 1;
+
+    if (run * ss <= BCACHE_MAX_FILL)
+    {
+      for (uint32_t j = 0; j < run; j++)
+        bcache_insert(dev, lba + i + j, buf + (i + j) * ss);
+    }
+
+    i += run;
+  }
+
+  return 0;
+}
+
+static uint8_t bcache_phys_buf[BCACHE_PHYS_MAX];
+
+// Caches the sectors in [from, to) and marks them dirty, so they go out
+// with the dirty sectors of the same physical block
+static void bcache_dirty_range(blkdev_t *dev, uint64_t from, uint64_t to)
+{
+  if (to > dev->sectors)
+    to = dev->sectors;
+  if (from >= to)
+    return;
+
+  uint32_t n = (uint32_t)(to - from);
+  if (bcache_read(dev, from, n, bcache_phys_buf))
+    return;
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    bcache_entry_t *e = bcache_lookup(dev, from + i);
+    if (e)
+      bcache_mark_dirty(e);
+  }
+}
+
+// Completes the physical blocks that [lba, lba + count) covers only in
+// part: the first one before lba, the last one after the end
+static void bcache_dirty_phys(blkdev_t *dev, uint64_t lba, uint32_t count)
+{
+  uint32_t p = blk_phys_sectors(dev);
+
+  if (p == 1 || p * dev->sector_size > BCACHE_PHYS_MAX)
+    return;
+
+  uint64_t head = blk_phys_start(dev, lba);
+  uint64_t tail = blk_phys_start(dev, lba + count - 1) + p;
+
+  bcache_dirty_range(dev, head, lba);
+  bcache_dirty_range(dev, lba + count, tail);
+}
+
+// Write-back: only the cache is updated. Sectors that can't be cached go
+// to the disk directly.
+static int bcache_write_back(blkdev_t *dev, uint64_t lba, uint32_t count,
+                             const void *buffer)
+{
+  uint32_t ss = dev->sector_size;
+  int status = 0;
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    const uint8_t *src = (const uint8_t *)buffer + i * ss;
+    bcache_entry_t *e = bcache_lookup(dev, lba + i);
+
+    if (e)
+      memcpy(e->data, src, ss);
+    else
+      e = bcache_insert(dev, lba + i, src);
+
+    if (e)
+      bcache_mark_dirty(e);
+    else if (blk_write(dev, lba + i, 1, src))
+      status = 1;
+  }
+
+  bcache_dirty_phys(dev, lba, count);
+  return status;
+}
+
+// Writes straight to the disk, keeping cached copies current
+static int bcache_write_through(blkdev_t *dev, uint64_t lba, uint32_t count,
+                                const void *buffer)
+{
+  if (blk_write(dev, lba, count, buffer))
+  {
+    bcache_invalidate(dev, lba, count);
+    return 1;
+  }
+
+  bcache_store(dev, lba, count, buffer);
+  return 0;
+}
+
+// Remembers that `dev` needs a cache flush at the next sync
+static void bcache_note_write(blkdev_t *dev)
+{
+  for (uint32_t i = 0; i < bcache.written_dev_count; i++)
+  {
+    if (bcache.written_devs[i] == dev)
+      return;
+  }
+
+  // Table full: the listed devices get their flush now
+  if (bcache.written_dev_count == BCACHE_DEVICES)
+  {
+    bcache_flush_dirty();
+    bcache_flush_devices();
+  }
+  bcache.written_devs[bcache.written_dev_count++] = dev;
+}
+
+int bcache_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer)
+{
+  uint32_t ss = dev->sector_size;
+  const uint8_t *buf = (const uint8_t *)buffer;
+
+  bcache_note_write(dev);
+
+  // The sectors are in use again
+  bcache_discard_cancel(dev, lba, count);
+
+  // Large writes (file data) aren't worth holding back
+  if (bcache.write_back && count * ss <= BCACHE_MAX_FILL)
+    return bcache_write_back(dev, lba, count, buffer);
+
+  uint32_t p = blk_phys_sectors(dev);
+  if (p == 1 || p * ss > BCACHE_PHYS_MAX)
+    return bcache_write_through(dev, lba, count, buffer);
+
+  // Only the aligned middle goes out directly; partial blocks at either
+  // end are completed in the cache and written back as whole blocks
+  uint64_t end = lba + count;
+  uint64_t first = blk_phys_start(dev, lba);
+  uint64_t last = blk_phys_start(dev, end);
+  int status = 0;
+
+  if (first < lba)
+    first += p;
+  if (first >= last)
+  {
+    status = bcache_write_back(dev, lba, count, buffer);
+  }
+  else
+  {
+    if (lba < first)
+      status |= bcache_write_back(dev, lba, (uint32_t)(first - lba), buf);
+    status |= bcache_write_through(dev, first, (uint32_t)(last - first),
+                                   buf + (uint32_t)(first - lba) * ss);
+    if (last < end)
+      status |= bcache_write_back(dev, last, (uint32_t)(end - last),
+                                  buf + (uint32_t)(last - lba) * ss);
+  }
+
+  if (!bcache.write_back)
+    status |= bcache_sync();
+  return status;
+}
+
+static blk_request_t bcache_flush_reqs[BCACHE_FLUSH_BATCH];
+
+// Writes back `n` dirty entries, sorted by device and LBA. Each batch is
+// queued with the device plugged so the scheduler merges neighbouring
+// sectors into one command.
+static int bcache_write_entries(bcache_entry_t **list, uint32_t n)
+{
+  int status = 0;
+  uint32_t i = 0;
+
+  while (i < n)
+  {
+    blkdev_t *dev = list[i]->dev;
+    uint32_t k = 0;
+
+    while (i + k < n && k < BCACHE_FLUSH_BATCH && list[i + k]->dev == dev)
+      k++;
+
+    // A full batch stops at a physical block boundary, so no block is
+    // split between two batches
+    if (i + k < n && list[i + k]->dev == dev)
+    {
+      uint32_t whole = k;
+      while (whole > 1 && blk_phys_start(dev, list[i + whole]->lba) ==
+                              blk_phys_start(dev, list[i + whole - 1]->lba))
+        whole--;
+      if (whole > 1)
+        k = whole;
+    }
+
+    blk_plug(dev);
+    for (uint32_t j = 0; j < k; j++)
+    {
+      blk_request_t *req = &bcache_flush_reqs[j];
+
+      memset(req, 0, sizeof(*req));
+      req->lba = list[i + j]->lba;
+      req->count = 1;
+      req->buffer = list[i + j]->data;
+      req->write = 1;
+      blk_submit(dev, req);
+    }
+    blk_unplug(dev);
+
+    for (uint32_t j = 0; j < k; j++)
+    {
+      bcache_entry_t *e = list[i + j];
+
+      // A failed sector is dropped rather than retried forever
+      if (blk_wait(dev, &bcache_flush_reqs[j]))
+      {
+        DebugWriteString("bcache: write-back failed\n");
+        status = 1;
+      }
+
+      e->dirty = 0;
+      bcache.dirty--;
+      bcache.written++;
+    }
+
+    i += k;
+  }
+
+  return status;
+}
+
+// Writes every dirty sector to its device
+static int bcache_flush_dirty(void)
+{
+  if (!bcache.dirty)
+    return 0;
+
+  bcache.flushes++;
+
+  bcache_entry_t **list = malloc(bcache.dirty * sizeof(*list));
+  if (!list)
+  {
+    // No memory for sorting, write them in cache order
+    int status = 0;
+    for (bcache_entry_t *e = bcache.mru; e; e = e->lru_next)
+    {
+      if (e->dirty && bcache_write_entries(&e, 1))
+        status = 1;
+    }
+    return status;
+  }
+
+  uint32_t n = 0;
+  for (bcache_entry_t *e = bcache.mru; e; e = e->lru_next)
+  {
+    if (e->dirty)
+      list[n++] = e;
+  }
+
+  // Insertion sort; the list is at most a few hundred entries
+  for (uint32_t i = 1; i < n; i++)
+  {
+    bcache_entry_t *e = list[i];
+    uint32_t j = i;
+
+    while (j > 0 && (list[j - 1]->dev > e->dev ||
+                     (list[j - 1]->dev == e->dev && list[j - 1]->lba > e->lba)))
+    {
+      list[j] = list[j - 1];
+      j--;
+    }
+    list[j] = e;
+  }
+
+  int status = bcache_write_entries(list, n);
+  free(list);
+  return status;
+}
+
+// ===== Discard =====
+static void bcache_discard_remove(uint32_t i)
+{
+  bcache.discard_count--;
+  for (; i < bcache.discard_count; i++)
+    bcache.discards[i] = bcache.discards[i + 1];
+}
+
+// Takes [lba, lba + count) out of the queued discards. A range that can't
+// be split for lack of slots is shortened instead; not discarding is
+// always safe.
+static void bcache_discard_cancel(blkdev_t *dev, uint64_t lba, uint32_t count)
+{
+  uint64_t end = lba + count;
+
+  if (dev != bcache.discard_dev)
+    return;
+
+  for (uint32_t i = 0; i < bcache.discard_count;)
+  {
+    blk_range_t *r = &bcache.discards[i];
+    uint64_t r_end = r->lba + r->count;
+
+    if (r_end <= lba || end <= r->lba)
+    {
+      i++;
+      continue;
+    }
+
+    if (lba <= r->lba && r_end <= end)
+    {
+      bcache_discard_remove(i);
+      continue;
+    }
+
+    if (r->lba < lba && end < r_end &&
+        bcache.discard_count < BCACHE_DISCARD_MAX)
+    {
+      // Split around the written part
+      for (uint32_t j = bcache.discard_count; j > i + 1; j--)
+        bcache.discards[j] = bcache.discards[j - 1];
+      bcache.discards[i + 1].lba = end;
+      bcache.discards[i + 1].count = (uint32_t)(r_end - end);
+      bcache.discard_count++;
+    }
+
+    if (r->lba < lba)
+    {
+      r->count = (uint32_t)(lba - r->lba);
+    }
+    else
+    {
+      r->count = (uint32_t)(r_end - end);
+      r->lba = end;
+    }
+    i++;
+  }
+}
+
+static blk_range_t bcache_discard_batch[BCACHE_DISCARD_MAX];
+
+// Sends the queued discards, as many ranges per request as the device
+// takes. Ranges longer than the device allows are split.
+static int bcache_send_discards(void)
+{
+  blkdev_t *dev = bcache.discard_dev;
+  uint32_t max_ranges = dev ? dev->max_discard_ranges : 0;
+  uint32_t max_sectors = dev ? dev->max_discard_sectors : 0;
+  uint32_t i = 0;
+  uint64_t done = 0; // sectors of discards[i] already batched
+  int status = 0;
+
+  if (max_ranges > BCACHE_DISCARD_MAX)
+    max_ranges = BCACHE_DISCARD_MAX;
+
+  while (max_ranges && max_sectors && i < bcache.discard_count)
+  {
+    uint32_t n = 0;
+    uint64_t first = bcache.discards[i].lba + done;
+    uint64_t end = first;
+
+    while (n < max_ranges && i < bcache.discard_count)
+    {
+      blk_range_t *r = &bcache.discards[i];
+      uint64_t left = r->count - done;
+      uint32_t chunk = left > max_sectors ? max_sectors : (uint32_t)left;
+
+      // The request's count has to hold the whole span
+      if (r->lba + done + chunk - first > 0xFFFFFFFF)
+        break;
+
+      bcache_discard_batch[n].lba = r->lba + done;
+      bcache_discard_batch[n].count = chunk;
+      end = r->lba + done + chunk;
+      n++;
+
+      done += chunk;
+      if (done == r->count)
+      {
+        i++;
+        done = 0;
+      }
+    }
+
+    blk_request_t req = {0};
+    req.lba = first;
+    req.count = (uint32_t)(end - first);
+    req.buffer = bcache_discard_batch;
+    req.nr_ranges = n;
+    req.write = 1;
+
+    blk_submit(dev, &req);
+    if (blk_wait(dev, &req))
+    {
+      DebugWriteString("bcache: discard failed\n");
+      status = 1;
+    }
+
+    for (uint32_t j = 0; j < n; j++)
+      bcache.discarded += bcache_discard_batch[j].count;
+  }
+
+  bcache.discard_count = 0;
+  bcache.discard_dev = NULL;
+  return status;
+}
+
+// Queues `count` sectors that no longer hold data for discarding. Cached
+// copies are dropped right away, dirty or not.
+void bcache_discard(blkdev_t *dev, uint64_t lba, uint32_t count)
+{
+  if (!dev->max_discard_ranges || count == 0)
+    return;
+
+  bcache_invalidate(dev, lba, count);
+
+  if (bcache.discard_dev && bcache.discard_dev != dev)
+    bcache_sync();
+  bcache.discard_dev = dev;
+
+  // Position by LBA
+  uint32_t i = 0;
+  while (i < bcache.discard_count && bcache.discards[i].lba < lba)
+    i++;
+
+  blk_range_t *prev = i > 0 ? &bcache.discards[i - 1] : NULL;
+  blk_range_t *next = i < bcache.discard_count ? &bcache.discards[i] : NULL;
+
+  // Coalesce with the ranges on either side
+  if (prev && prev->lba + prev->count == lba &&
+      (uint64_t)prev->count + count <= 0xFFFFFFFF)
+  {
+    prev->count += count;
+    if (next && prev->lba + prev->count == next->lba &&
+        (uint64_t)prev->count + next->count <= 0xFFFFFFFF)
+    {
+      prev->count += next->count;
+      bcache_discard_remove(i);
+    }
+    return;
+  }
+
+  if (next && lba + count == next->lba &&
+      (uint64_t)next->count + count <= 0xFFFFFFFF)
+  {
+    next->lba = lba;
+    next->count += count;
+    return;
+  }
+
+  if (bcache.discard_count == BCACHE_DISCARD_MAX)
+  {
+    bcache_sync();
+    bcache.discard_dev = dev;
+    i = 0;
+  }
+
+  for (uint32_t j = bcache.discard_count; j > i; j--)
+    bcache.discards[j] = bcache.discards[j - 1];
+  bcache.discards[i].lba = lba;
+  bcache.discards[i].count = count;
+  bcache.discard_count++;
+}
+
+// Flushes the write cache of every device written since the last flush
+static int bcache_flush_devices(void)
+{
+  int status = 0;
+
+  for (uint32_t i = 0; i < bcache.written_dev_count; i++)
+  {
+    if (blk_flush(bcache.written_devs[i]))
+    {
+      DebugWriteString("bcache: cache flush failed\n");
+      status = 1;
+    }
+  }
+  bcache.written_dev_count = 0;
+
+  return status;
+}
+
+// Writes every dirty sector to its device, flushes the discard device's
+// write cache, sends the discards that were waiting for that and flushes
+// the devices' write caches. Returns 0 on
+// success.
+int bcache_sync(void)
+{
+  int status = bcache_flush_dirty();
+
+  // The metadata that freed the ranges must be on the media, not just in
+  // the drive's write cache, before the drive may drop their data
+  if (bcache.discard_count)
+  {
+    if (blk_flush(bcache.discard_dev))
+    {
+      // Discards are only hints: drop them rather than risk the data
+      DebugWriteString("bcache: cache flush failed\n");
+      bcache.discard_count = 0;
+      bcache.discard_dev = NULL;
+      status = 1;
+    }
+    else
+    {
+      status |= bcache_send_discards();
+    }
+  }
+
+  return status | bcache_flush_devices();
+}
+
+// Background flush, called while the system waits for input
+void bcache_idle(void)
+{
+  if (bcache.dirty &&
+      timer_ticks - bcache.dirty_since >= BCACHE_FLUSH_AGE_MS * TIMER_HZ / 1000)
+    bcache_sync();
+}
+
+// Changes the memory budget, evicting whatever no longer fits
+void bcache_set_budget(uint32_t bytes)
+{
+  bcache.budget = bytes;
+
+  if (bcache.used > bcache.budget)
+    bcache_flush_dirty();
+
+  while (bcache.lru && bcache.used > bcache.budget)
+    free(bcache_evict_lru());
+}
+
+static blk_request_t bcache_prefetch_reqs[BCACHE_PREFETCH_MAX];
+
+// Interrupt context: the sector has arrived (or failed)
+static void bcache_prefetch_done(blk_request_t *req)
+{
+  bcache_entry_t *e = (bcache_entry_t *)req->private;
+
+  if (req->status)
+    e->failed = 1;
+  e->pending = NULL;
+  req->private = NULL; // slot free again
+}
+
+// Starts reading `count` sectors into the cache and returns without
+// waiting. Sectors already cached are skipped. The device queue is plugged
+// meanwhile, so the scheduler turns the run into as few commands as
+// possible. Stops early when requests or memory run out.
+void bcache_prefetch(blkdev_t *dev, uint64_t lba, uint32_t count)
+{
+  uint32_t slot = 0;
+
+  // Never let read-ahead push out more than a quarter of the cache
+  uint32_t limit = bcache.budget / 4 / bcache_entry_bytes(dev->sector_size);
+  if (count > limit)
+    count = limit;
+
+  blk_plug(dev);
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    if (bcache_find(dev, lba + i))
+      continue;
+
+    while (slot < BCACHE_PREFETCH_MAX && bcache_prefetch_reqs[slot].private)
+      slot++;
+    if (slot == BCACHE_PREFETCH_MAX)
+      break;
+
+    bcache_entry_t *e = bcache_new(dev, lba + i);
+    if (!e)
+      break;
+
+    blk_request_t *req = &bcache_prefetch_reqs[slot];
+    memset(req, 0, sizeof(*req));
+    req->lba = lba + i;
+    req->count = 1;
+    req->buffer = e->data;
+    req->callback = bcache_prefetch_done;
+    req->private = e;
+
+    e->pending = req;
+    bcache.prefetched++;
+    blk_submit(dev, req);
+  }
+
+  blk_unplug(dev);
+}
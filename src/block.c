@@ -0,0 +1,273 @@
+#pragma once
+
+#include "idt.c"
+#include "timer.c"
+#include <stddef.h>
+#include <stdint.h>
+
+// ===== Block request layer =====
+// Filesystems talk to disks through blkdev_t. A request is queued on the
+// device with blk_submit() and completes asynchronously (normally from the
+// device's IRQ handler); the caller then either blocks in blk_wait() or gets
+// `callback` invoked on completion. Devices with an I/O scheduler attached
+// (iosched.c) get their requests sorted and merged before the driver sees
+// them.
+
+typedef struct blk_request blk_request_t;
+typedef struct blkdev blkdev_t;
+
+// One LBA range of a discard request
+typedef struct
+{
+  uint64_t lba;
+  uint32_t count;
+} blk_range_t;
+
+struct iosched;
+void iosched_submit(struct iosched *sched, blk_request_t *req);
+void iosched_completed(struct iosched *sched, blk_request_t *req);
+void iosched_unplug(struct iosched *sched);
+
+struct blk_request
+{
+  uint64_t lba;
+  uint32_t count; // sectors
+  void *buffer;
+  uint8_t write;
+
+  // Discard: `buffer` holds nr_ranges blk_range_t whose data the device
+  // may drop. lba/count span all of them and `write` is set, so the
+  // scheduler orders it like a write of the whole span. 0 for reads and
+  // writes.
+  uint32_t nr_ranges;
+
+  // Cache flush barrier: no data, lba and count 0. Completes once every
+  // write the device finished before it is on stable media.
+  uint8_t flush;
+
+  volatile uint8_t done;
+  int status; // 0 on success
+
+  // Runs in interrupt context right after `done` is set. May be NULL.
+  void (*callback)(blk_request_t *req);
+  void *private;
+
+  blk_request_t *next; // queue link, owned by the scheduler/driver
+
+  // Requests the scheduler merged behind this one. They cover the sectors
+  // directly after it, same direction, and the driver moves the whole
+  // chain with one command.
+  blk_request_t *merge_next;
+
+  uint64_t queued_at; // TSC at submit
+  uint64_t deadline;  // TSC by which the scheduler must dispatch it
+};
+
+struct blkdev
+{
+  const char *name;
+  uint32_t sector_size; // logical: the unit of `lba` and `count`
+  uint64_t sectors;
+
+  // Physical geometry: the drive writes whole blocks of phys_sectors
+  // logical sectors, the first one starting at LBA phys_offset. A write
+  // that covers a block only in part makes the drive read-modify-write
+  // it internally. 512e disks report 8 and usually 0; 0 means 1.
+  uint32_t phys_sectors;
+  uint32_t phys_offset;
+
+  uint32_t max_sectors;  // largest merged chain one command can carry
+  uint32_t max_segments; // most requests in one chain, 0 = no limit
+
+  // Discard (TRIM) limits: ranges per request, sectors per range. 0 when
+  // the device can't discard.
+  uint32_t max_discard_ranges;
+  uint32_t max_discard_sectors;
+
+  // The device has a volatile write cache: completed writes survive power
+  // loss only after a flush. `unflushed` is set by every write.
+  uint8_t write_cache;
+  uint8_t unflushed;
+
+  struct iosched *sched; // NULL: requests go straight to the driver
+
+  // Queues `req`; called with interrupts disabled
+  void (*submit)(blkdev_t *dev, blk_request_t *req);
+  // Checks the hardware and completes whatever is finished, exactly like
+  // the IRQ handler would; called with interrupts disabled
+  void (*poll)(blkdev_t *dev);
+  // Fails the request the device is working on and resets it
+  void (*abort)(blkdev_t *dev);
+  // Optional: tells the device about everything submitted since the last
+  // call, so drivers can ring one doorbell per batch; called with
+  // interrupts disabled
+  void (*kick)(blkdev_t *dev);
+
+  void *priv;
+};
+
+// Adaptive completion: requests of at most BLK_POLL_SECTORS sectors are
+// polled for up to BLK_POLL_US before the caller goes to sleep on the IRQ.
+// A single-sector PIO read is ready long before an interrupt round trip.
+#define BLK_POLL_SECTORS 8
+#define BLK_POLL_US 100
+#define BLK_TIMEOUT_MS 5000
+
+void blk_submit(blkdev_t *dev, blk_request_t *req)
+{
+  req->done = 0;
+  req->status = 0;
+  req->next = NULL;
+  req->merge_next = NULL;
+  req->queued_at = timer_now();
+
+  if (req->write)
+    dev->unflushed = 1;
+
+  if (dev->sched)
+  {
+    iosched_submit(dev->sched, req);
+    return;
+  }
+
+  irq_flags_t flags = irq_save();
+  dev->submit(dev, req);
+  if (dev->kick)
+    dev->kick(dev);
+  irq_restore(flags);
+}
+
+// Drivers call this (with interrupts disabled) when a request they were
+// handed finishes. Every request merged behind `req` completes with it.
+void blk_complete(blkdev_t *dev, blk_request_t *req, int status)
+{
+  blk_request_t *head = req;
+
+  while (req)
+  {
+    // The callback may recycle the request, read the link first
+    blk_request_t *next = req->merge_next;
+
+    req->merge_next = NULL;
+    req->status = status;
+    req->done = 1;
+    if (req->callback)
+      req->callback(req);
+
+    req = next;
+  }
+
+  if (dev && dev->sched)
+    iosched_completed(dev->sched, head);
+}
+
+// Logical sectors per physical block, at least 1
+static uint32_t blk_phys_sectors(const blkdev_t *dev)
+{
+  return dev->phys_sectors ? dev->phys_sectors : 1;
+}
+
+// First LBA of the physical block holding `lba`. phys_sectors is a power
+// of two (IDENTIFY and virtio report it as an exponent).
+static uint64_t blk_phys_start(const blkdev_t *dev, uint64_t lba)
+{
+  uint32_t p = blk_phys_sectors(dev);
+  uint32_t into = (uint32_t)(lba + p - dev->phys_offset % p) & (p - 1);
+
+  return lba < into ? 0 : lba - into;
+}
+
+// Total sectors of a merge chain
+static uint32_t blk_chain_sectors(const blk_request_t *req)
+{
+  uint32_t total = 0;
+
+  for (; req; req = req->merge_next)
+    total += req->count;
+  return total;
+}
+
+static void blk_poll_once(blkdev_t *dev)
+{
+  irq_flags_t flags = irq_save();
+  dev->poll(dev);
+  irq_restore(flags);
+}
+
+// Blocks until `req` completes and returns its status.
+int blk_wait(blkdev_t *dev, blk_request_t *req)
+{
+  uint64_t start = timer_now();
+
+  // Somebody is waiting now, nothing gains from holding requests back
+  if (!req->done && dev->sched)
+    iosched_unplug(dev->sched);
+
+  if (req->count <= BLK_POLL_SECTORS)
+  {
+    uint64_t until = start + timer_us_to_cycles(BLK_POLL_US);
+    while (!req->done && timer_now() < until)
+      blk_poll_once(dev);
+  }
+
+  uint64_t deadline = start + timer_ms_to_cycles(BLK_TIMEOUT_MS);
+
+  while (!req->done)
+  {
+    if (timer_now() > deadline)
+    {
+      // Fail whatever the device is stuck on. If that wasn't our request
+      // (it may still be queued behind it), keep waiting for it.
+      irq_flags_t flags = irq_save();
+      if (!req->done)
+        dev->abort(dev);
+      irq_restore(flags);
+      deadline = timer_now() + timer_ms_to_cycles(BLK_TIMEOUT_MS);
+      continue;
+    }
+
+    if (!irqs_ready)
+    {
+      blk_poll_once(dev);
+      continue;
+    }
+
+    // Sleep until the device (or the timer tick) interrupts us
+    irq_disable();
+    if (!req->done)
+      irq_enable_and_wait();
+    else
+      irq_enable();
+
+    // Woken by the tick: a device without a usable IRQ line still gets
+    // checked a hundred times a second
+    if (!req->done)
+      blk_poll_once(dev);
+  }
+
+  return req->status;
+}
+
+int blk_read(blkdev_t *dev, uint64_t lba, uint32_t count, void *buffer)
+{
+  blk_request_t req = {0};
+  req.lba = lba;
+  req.count = count;
+  req.buffer = buffer;
+  req.write = 0;
+
+  blk_submit(dev, &req);
+  return blk_wait(dev, &req);
+}
+
+int blk_write(blkdev_t *dev, uint64_t lba, uint32_t count, const void *buffer)
+{
+  blk_request_t req = {0};
+  req.lba = lba;
+  req.count = count;
+  req.buffer = (void *)buffer;
+  req.write = 1;
+
+  blk_submit(dev, &req);
+  return blk_wait(dev, &req);
+}
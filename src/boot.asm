@@ -19,7 +19,7 @@ align 4
 
 ; The multiboot standard does not define the value of the stack pointer register
 ; (esp) and it is up to the kernel to provide a stack. This allocates room for a
-; small stack by creating a symbol at the bottom of it, then allocating 16384
+; small stack by creating a symbol at the bottom of it, then allocating 65536
 ; bytes for it, and finally creating a symbol at the top. The stack grows
 ; downwards on x86. The stack is in its own section so it can be marked nobits,
 ; which means the kernel file is smaller because it does not contain an
@@ -30,7 +30,7 @@ align 4
 section .bss
 align 16
 stack_bottom:
-resb 16384 ; 16 KiB is reserved for stack
+resb 65536 ; 64 KiB is reserved for stack (shared with IRQ handlers)
 stack_top:
 
 ; The linker script specifies _start as the entry point to the kernel and the
@@ -73,7 +73,14 @@ _start:
 	; stack since (pushed 0 bytes so far) and the alignment is thus
 	; preserved and the call is well defined.
         ; note, that if you are building on Windows, C functions may have "_" prefix in assembly: _kernel_main
+	;
+	; kernel_main(magic, info) gets the multiboot magic from EAX and the
+	; address of the multiboot information structure from EBX. 8 bytes of
+	; padding keep the stack 16-byte aligned after the two pushes.
 	extern kernel_main
+	sub esp, 8
+	push ebx
+	push eax
 	call kernel_main
 
 	; If the system has nothing more to do, put the computer into an
@@ -90,3 +97,45 @@ _start:
 .hang:	hlt
 	jmp .hang
 .end:
+
+; IRQ entry points. idt.c installs these at vectors 0x20-0x2F after
+; remapping the PICs. Each stub saves the general purpose registers, calls
+; irq_dispatch(irq) in C (which runs the handler and sends the EOI) and
+; returns with iret. The C ABI expects the direction flag to be clear.
+extern irq_dispatch
+
+%macro IRQ_STUB 1
+irq_stub_%1:
+	pushad
+	cld
+	push dword %1
+	call irq_dispatch
+	add esp, 4
+	popad
+	iretd
+%endmacro
+
+IRQ_STUB 0
+IRQ_STUB 1
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+section .rodata
+global irq_stub_table
+irq_stub_table:
+	dd irq_stub_0, irq_stub_1, irq_stub_2, irq_stub_3
+	dd irq_stub_4, irq_stub_5, irq_stub_6, irq_stub_7
+	dd irq_stub_8, irq_stub_9, irq_stub_10, irq_stub_11
+	dd irq_stub_12, irq_stub_13, irq_stub_14, irq_stub_15
@@ -1,5 +1,11 @@
+#include "bcache.c"
+#include "block.c"
 #include "debug.c"
+#include "idt.c"
 #include "io.c"
+#include "iosched.c"
+#include "pci.c"
+#include "timer.c"
 #include <stdint.h>
 
 // ===== ATA ports =====
@@ -23,11 +29,68 @@
 #define ATA2_DRIVE 0x176
 #define ATA2_COMMAND 0x177
 #define ATA2_STATUS 0x177
+#define ATA2_ALTSTATUS 0x376
+
+// Register offsets from a channel's command block base
+#define ATA_REG_DATA 0
+#define ATA_REG_ERROR 1
+#define ATA_REG_FEATURES 1 // written: same port as ERROR
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA_LOW 3
+#define ATA_REG_LBA_MID 4
+#define ATA_REG_LBA_HIGH 5
+#define ATA_REG_DRIVE 6
+#define ATA_REG_COMMAND 7
+#define ATA_REG_STATUS 7
+
+// Device control register bits
+#define ATA_CTRL_NIEN 0x02
+#define ATA_CTRL_SRST 0x04
 
 // ===== ATA commands =====
 #define ATA_CMD_READ_SECTORS 0x20
+#define ATA_CMD_READ_SECTORS_EXT 0x24
+#define ATA_CMD_READ_DMA_EXT 0x25
 #define ATA_CMD_WRITE_SECTORS 0x30
+#define ATA_CMD_WRITE_SECTORS_EXT 0x34
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_READ_MULTIPLE_EXT 0x29
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_SET_MULTIPLE_MODE 0xC6
+#define ATA_CMD_READ_DMA 0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
 #define ATA_CMD_IDENTIFY 0xEC
+#define ATA_CMD_DATA_SET_MANAGEMENT 0x06
+#define ATA_CMD_SET_FEATURES 0xEF
+#define ATA_CMD_FLUSH_CACHE 0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+
+// SET FEATURES subcommands (feature register)
+#define ATA_FEATURE_WRITE_CACHE_ON 0x02
+
+// DATA SET MANAGEMENT: the TRIM function takes 512-byte blocks of 8-byte
+// LBA range entries (LBA in bits 47:0, sector count in bits 63:48)
+#define ATA_DSM_TRIM 0x01
+#define ATA_DSM_RANGES 64 // entries in one block; one block per command
+#define ATA_DSM_MAX_SECTORS 0xFFFF
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+// SECCOUNT is 8 bits wide (0 means 256 sectors), 16 bits wide for the EXT
+// commands (0 means 65536)
+#define ATA_MAX_SECTORS 256
+#define ATA_MAX_SECTORS_EXT 65536
+#define ATA_SECTOR_BYTES 512 // logical sector size unless IDENTIFY says more
+#define ATA_MAX_SECTOR_BYTES 4096
+
+// Largest DRQ block asked for with SET MULTIPLE MODE. Bigger blocks save
+// little once a block is 8 KiB and make each interrupt hold the CPU longer.
+#define ATA_MULTIPLE_MAX 16
+
+// First LBA that needs 48-bit addressing
+#define ATA_LBA28_LIMIT 0x10000000ULL
 
 // ===== Status bits =====
 #define ATA_SR_BSY 0x80
@@ -37,70 +100,98 @@
 #define ATA_SR_ERR 0x01
 
 // ===== Wait helpers =====
-static void ata_wait_ready(void)
-{
-  uint8_t s;
+// All polling loops give up after ATA_TIMEOUT_MS so a missing or hung drive
+// can't freeze the kernel.
+#define ATA_TIMEOUT_MS 3000
 
-  while ((s = inb(ATA_STATUS)) & ATA_SR_BSY)
-  {
-  }
+static uint64_t ata_deadline(void)
+{
+  if (!tsc_khz)
+    return ~0ULL; // timer not calibrated yet
+  return timer_now() + timer_ms_to_cycles(ATA_TIMEOUT_MS);
 }
 
-// ===== Wait helpers =====
-static void atapi_wait_ready(void)
+// Returns 0 once BSY is clear, 1 on timeout
+static int ata_wait_ready_port(uint16_t status_port)
 {
-  uint8_t s;
+  uint64_t deadline = ata_deadline();
 
-  while ((s = inb(ATA2_STATUS)) & ATA_SR_BSY)
+  while (inb(status_port) & ATA_SR_BSY)
   {
+    if (timer_now() > deadline)
+      return 1;
   }
+
+  return 0;
 }
 
-static void ata_wait_drq(void)
+// Returns 0 once DRQ is set, 1 if the drive reported ERR or DF instead or
+// never got ready
+static int ata_wait_drq_port(uint16_t status_port)
 {
+  uint64_t deadline = ata_deadline();
   uint8_t s;
 
   do
   {
-    s = inb(ATA_STATUS);
+    s = inb(status_port);
     if (s & ATA_SR_ERR)
     {
-      break;
+      return 1;
     }
     if (s & ATA_SR_DF)
     {
-      break;
+      return 1;
+    }
+    if (timer_now() > deadline)
+    {
+      return 1;
     }
   } while ((s & ATA_SR_BSY) || !(s & ATA_SR_DRQ));
+
+  return 0;
 }
 
-static void atapi_wait_drq(void)
+// ~400 ns: lets the status register settle after a command or data block
+static void ata_delay400(uint16_t altstatus_port)
 {
-  uint8_t s;
-
-  do
-  {
-    s = inb(ATA2_STATUS);
-    if (s & ATA_SR_ERR)
-    {
-      break;
-    }
-    if (s & ATA_SR_DF)
-    {
-      break;
-    }
-  } while ((s & ATA_SR_BSY) || !(s & ATA_SR_DRQ));
+  inb(altstatus_port);
+  inb(altstatus_port);
+  inb(altstatus_port);
+  inb(altstatus_port);
 }
 
+static int ata_wait_ready(void) { return ata_wait_ready_port(ATA_STATUS); }
+
+static int atapi_wait_ready(void) { return ata_wait_ready_port(ATA2_STATUS); }
+
+static int ata_wait_drq(void) { return ata_wait_drq_port(ATA_STATUS); }
+
+static int atapi_wait_drq(void) { return ata_wait_drq_port(ATA2_STATUS); }
+
 // ===== IDENTIFY DEVICE =====
 typedef struct
 {
   char model[41];
-  uint32_t sectors;
-  uint16_t logical_sector_size;
-  uint16_t physical_sector_size;
+  uint32_t sectors;   // LBA28 addressable (words 60-61)
+  uint64_t sectors48; // LBA48 addressable (words 100-103)
+  uint8_t lba48;      // word 83 bit 10
+  uint32_t logical_sector_size;  // bytes (words 106, 117-118)
+  uint32_t physical_sector_size; // bytes (word 106 bits 3:0)
+  uint32_t phys_offset;          // first LBA on a physical boundary (word 209)
+  uint8_t dma; // word 49 bit 8
+  uint8_t ncq; // word 76 bit 8 (SATA native command queuing)
+  uint8_t queue_depth; // word 75, commands the drive can queue
+  uint8_t multiple_max; // word 47, largest READ/WRITE MULTIPLE block
+  uint8_t multiple;     // word 59, block size currently set (0 = off)
+  uint8_t trim;         // word 169 bit 0, DATA SET MANAGEMENT TRIM
+  uint8_t write_cache;  // word 82 bit 5, volatile write cache supported
+  uint8_t write_cache_on; // word 85 bit 5
+  uint16_t dsm_blocks;  // word 105, range blocks one DSM command takes
 } ata_identify_t;
 
+void ata_parse_identify(const uint16_t *data, ata_identify_t *info);
+
 void ata_identify(ata_identify_t *info)
 {
   ata_wait_ready();
@@ -122,27 +213,36 @@ void ata_identify(ata_identify_t *info)
   for (int i = 0; i < 256; i++)
     data[i] = inw(ATA_DATA);
 
-  // Słowo 106 - logiczny rozmiar sektora, w bajtach, jeśli bit 15=0
+  ata_parse_identify(data, info);
+}
+
+// Decodes the 256 IDENTIFY DEVICE words (shared with the AHCI driver)
+void ata_parse_identify(const uint16_t *data, ata_identify_t *info)
+{
+  // Sector geometry. Word 106 is valid when bits 15:14 are 01: bit 12
+  // says words 117-118 hold the logical sector size in words, bit 13 that
+  // bits 3:0 give log2 of logical sectors per physical sector.
   uint16_t word106 = data[106];
+  uint32_t per_phys = 1;
 
-  // Sprawdzenie bitu 15 - jeśli jest 0, to słowo zawiera rozmiar logicznego
-  // sektora
-  if (!(word106 & 0x8000))
+  info->logical_sector_size = ATA_SECTOR_BYTES;
+  if ((word106 & 0xC000) == 0x4000)
   {
-    info->logical_sector_size = word106;
+    if (word106 & 0x1000)
+    {
+      uint32_t words = ((uint32_t)data[118] << 16) | data[117];
+      if (words >= 256)
+        info->logical_sector_size = words * 2;
+    }
+    if (word106 & 0x2000)
+      per_phys = 1u << (word106 & 0x0F);
   }
+  info->physical_sector_size = info->logical_sector_size * per_phys;
 
-  // Słowa 117 i 118 (ATA8) - rozmiary logiczny i fizyczny
-  // 117 - logiczny, 118 - fizyczny (w bajtach)
-  uint16_t word117 = data[117];
-  uint16_t word118 = data[118];
-
-  // Jeśli te słowa są różne od 0 i różne od 0xFFFF, to można ich użyć
-  if (word117 != 0 && word117 != 0xFFFF)
-    info->logical_sector_size = word117;
-
-  if (word118 != 0 && word118 != 0xFFFF)
-    info->physical_sector_size = word118;
+  // Word 209 bits 13:0: where LBA 0 sits inside its physical sector
+  info->phys_offset = 0;
+  if (per_phys > 1 && (data[209] & 0xC000) == 0x4000)
+    info->phys_offset = (per_phys - (data[209] & 0x3FFF) % per_phys) % per_phys;
 
   // Model string (words 27–46)
   for (int i = 0; i < 20; i++)
@@ -152,202 +252,1154 @@ void ata_identify(ata_identify_t *info)
   }
   info->model[40] = 0;
 
+  info->dma = (data[49] >> 8) & 1;
+
+  // Multiple mode: sectors per DRQ block, supported and currently set
+  info->multiple_max = data[47] & 0xFF;
+  if (data[59] & 0x100)
+    info->multiple = data[59] & 0xFF;
+
   // Total number of 28-bit addressable sectors (words 60–61)
   info->sectors = ((uint32_t)data[61] << 16) | data[60];
+
+  // 48-bit feature set supported (word 83 bit 10) and its capacity
+  info->lba48 = (data[83] >> 10) & 1;
+  if (info->lba48)
+  {
+    info->sectors48 = ((uint64_t)data[103] << 48) | ((uint64_t)data[102] << 32) |
+                      ((uint64_t)data[101] << 16) | data[100];
+  }
+  else
+  {
+    info->sectors48 = info->sectors;
+  }
+
+  // Serial ATA capabilities; 0 and 0xFFFF mean the word isn't implemented
+  if (data[76] != 0 && data[76] != 0xFFFF)
+  {
+    info->ncq = (data[76] >> 8) & 1;
+    info->queue_depth = (data[75] & 0x1F) + 1;
+  }
+
+  // Volatile write cache
+  if (data[82] != 0xFFFF)
+  {
+    info->write_cache = (data[82] >> 5) & 1;
+    info->write_cache_on = (data[85] >> 5) & 1;
+  }
+
+  // TRIM; word 105 must allow at least one block of range entries
+  if (data[169] != 0xFFFF)
+    info->trim = data[169] & 1;
+  info->dsm_blocks = data[105] == 0xFFFF ? 0 : data[105];
+  if (!info->dsm_blocks)
+    info->trim = 0;
 }
 
-// ===== READ SECTOR =====
-void ata_read_sector(uint32_t lba, uint16_t *buffer)
+// ===== Command setup =====
+// Largest transfer one command can carry on this drive
+static uint32_t ata_max_command_sectors(int lba48)
 {
-  ata_wait_ready();
+  return lba48 ? ATA_MAX_SECTORS_EXT : ATA_MAX_SECTORS;
+}
 
-  outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
-  outb(ATA_SECCOUNT, 1);
-  outb(ATA_LBA_LOW, (uint8_t)(lba & 0xFF));
-  outb(ATA_LBA_MID, (uint8_t)((lba >> 8) & 0xFF));
-  outb(ATA_LBA_HIGH, (uint8_t)((lba >> 16) & 0xFF));
-  outb(ATA_COMMAND, ATA_CMD_READ_SECTORS);
+// Programs the task file of the channel at `io` for a transfer of `count`
+// sectors. The 48-bit (EXT) layout is used only when the drive supports it
+// and the transfer needs it: an address past 28 bits or more than 256
+// sectors. Returns 1 for EXT, 0 for LBA28, -1 if the drive can't address it.
+static int ata_setup_lba(uint16_t io, uint64_t lba, uint32_t count, int lba48)
+{
+  int ext = count > ATA_MAX_SECTORS || lba + count > ATA_LBA28_LIMIT;
 
-  ata_wait_drq();
+  if (ext && !lba48)
+    return -1;
 
-  for (int i = 0; i < 256; i++)
-    buffer[i] = inw(ATA_DATA);
+  if (ext)
+  {
+    // High-order bytes first; each register is a two-deep FIFO
+    outb(io + ATA_REG_DRIVE, 0x40);
+    outb(io + ATA_REG_SECCOUNT, (uint8_t)(count >> 8)); // 65536 -> 0
+    outb(io + ATA_REG_LBA_LOW, (uint8_t)(lba >> 24));
+    outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 32));
+    outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 40));
+    outb(io + ATA_REG_SECCOUNT, (uint8_t)count);
+    outb(io + ATA_REG_LBA_LOW, (uint8_t)lba);
+    outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+    outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 16));
+    return 1;
+  }
+
+  outb(io + ATA_REG_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
+  outb(io + ATA_REG_SECCOUNT, (uint8_t)count); // 256 -> 0
+  outb(io + ATA_REG_LBA_LOW, (uint8_t)lba);
+  outb(io + ATA_REG_LBA_MID, (uint8_t)(lba >> 8));
+  outb(io + ATA_REG_LBA_HIGH, (uint8_t)(lba >> 16));
+  return 0;
 }
 
-// ===== WRITE SECTOR =====
-void ata_write_sector(uint32_t lba, const uint16_t *buffer)
+// `multiple` is the DRQ block size set with SET MULTIPLE MODE, 0 to move
+// one sector per DRQ
+static uint8_t ata_rw_command(int write, int dma, int ext, int multiple)
 {
-  ata_wait_ready();
+  if (dma)
+  {
+    if (write)
+      return ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+    return ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+  }
 
-  outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));
-  outb(ATA_SECCOUNT, 1);
-  outb(ATA_LBA_LOW, (uint8_t)(lba & 0xFF));
-  outb(ATA_LBA_MID, (uint8_t)((lba >> 8) & 0xFF));
-  outb(ATA_LBA_HIGH, (uint8_t)((lba >> 16) & 0xFF));
-  outb(ATA_COMMAND, ATA_CMD_WRITE_SECTORS);
+  if (multiple)
+  {
+    if (write)
+      return ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+    return ext ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+  }
 
-  ata_wait_drq();
+  if (write)
+    return ext ? ATA_CMD_WRITE_SECTORS_EXT : ATA_CMD_WRITE_SECTORS;
+  return ext ? ATA_CMD_READ_SECTORS_EXT : ATA_CMD_READ_SECTORS;
+}
 
-  for (int i = 0; i < 256; i++)
-    outw(ATA_DATA, buffer[i]);
+// Set by ata_init() from IDENTIFY
+int ata_lba48;
+int ata_multiple; // sectors per DRQ block, 0 when multiple mode is off
+uint32_t ata_sector_size = ATA_SECTOR_BYTES;
+
+// Polled non-data command on the master drive of the channel at `io`, for
+// setup before the request queue runs. Returns 0 on success.
+static int ata_nodata_command(uint16_t io, uint8_t command, uint8_t feature,
+                              uint8_t count)
+{
+  if (ata_wait_ready_port(io + ATA_REG_STATUS))
+    return 1;
+
+  outb(io + ATA_REG_DRIVE, 0xE0);
+  outb(io + ATA_REG_FEATURES, feature);
+  outb(io + ATA_REG_SECCOUNT, count);
+  outb(io + ATA_REG_COMMAND, command);
+
+  if (ata_wait_ready_port(io + ATA_REG_STATUS))
+    return 1;
+
+  // Reading status also acknowledges the completion interrupt
+  return (inb(io + ATA_REG_STATUS) & (ATA_SR_ERR | ATA_SR_DF)) != 0;
+}
+
+// Picks the largest power-of-two block the drive allows, up to
+// ATA_MULTIPLE_MAX, and sets it with SET MULTIPLE MODE on the master drive
+// of the channel at `io`. Returns the block size, 0 if the drive refused
+// or doesn't support multiple mode.
+static int ata_set_multiple(uint16_t io, uint8_t multiple_max)
+{
+  int block = 0;
+
+  for (int n = ATA_MULTIPLE_MAX; n >= 2; n >>= 1)
+  {
+    if (n <= multiple_max)
+    {
+      block = n;
+      break;
+    }
+  }
+
+  if (!block ||
+      ata_nodata_command(io, ATA_CMD_SET_MULTIPLE_MODE, 0, (uint8_t)block))
+    return 0;
+
+  return block;
+}
+
+// Turns on the drive's volatile write cache. Writes then complete once the
+// drive has the data rather than once it is on the medium; blk_flush()
+// commits them. Returns 1 if the cache is on.
+static int ata_enable_write_cache(uint16_t io, const ata_identify_t *id)
+{
+  if (!id->write_cache)
+    return 0;
+  if (id->write_cache_on)
+    return 1;
+
+  return !ata_nodata_command(io, ATA_CMD_SET_FEATURES,
+                             ATA_FEATURE_WRITE_CACHE_ON, 0);
+}
+
+// Sectors in the next DRQ block when `left` sectors of the command remain
+static uint32_t ata_drq_block(int multiple, uint32_t left)
+{
+  if (!multiple)
+    return 1;
+  return left < (uint32_t)multiple ? left : (uint32_t)multiple;
+}
+
+// ===== READ SECTORS (PIO) =====
+// Reads `count` consecutive sectors starting at `lba`. One command covers
+// up to 256 sectors (65536 with the EXT variants). With multiple mode on,
+// READ MULTIPLE raises DRQ once per block of ata_multiple sectors instead
+// of once per sector; each block is pulled with a single rep insw.
+// Returns 0 on success, 1 on drive error.
+int ata_pio_read_sectors(uint64_t lba, uint32_t count, void *buffer)
+{
+  uint16_t *p = (uint16_t *)buffer;
+  uint32_t words = ata_sector_size / 2;
+  uint32_t max = ata_max_command_sectors(ata_lba48);
+
+  while (count > 0)
+  {
+    uint32_t chunk = count > max ? max : count;
+
+    if (ata_wait_ready())
+      return 1;
+    int ext = ata_setup_lba(ATA_DATA, lba, chunk, ata_lba48);
+    if (ext < 0)
+      return 1;
+    outb(ATA_COMMAND, ata_rw_command(0, 0, ext, ata_multiple));
+
+    for (uint32_t i = 0; i < chunk;)
+    {
+      uint32_t block = ata_drq_block(ata_multiple, chunk - i);
+
+      if (ata_wait_drq())
+        return 1;
+
+      insw(ATA_DATA, p, block * words);
+      p += block * words;
+      i += block;
+    }
+
+    lba += chunk;
+    count -= chunk;
+  }
+
+  return 0;
+}
+
+// ===== WRITE SECTORS (PIO) =====
+// Writes `count` consecutive sectors starting at `lba`, up to 256 (65536
+// with EXT) per command, feeding each DRQ block (one sector, or a multiple
+// mode block) with rep outsw.
+// Returns 0 on success, 1 on drive error.
+int ata_pio_write_sectors(uint64_t lba, uint32_t count, const void *buffer)
+{
+  const uint16_t *p = (const uint16_t *)buffer;
+  uint32_t words = ata_sector_size / 2;
+  uint32_t max = ata_max_command_sectors(ata_lba48);
+
+  while (count > 0)
+  {
+    uint32_t chunk = count > max ? max : count;
+
+    if (ata_wait_ready())
+      return 1;
+    int ext = ata_setup_lba(ATA_DATA, lba, chunk, ata_lba48);
+    if (ext < 0)
+      return 1;
+    outb(ATA_COMMAND, ata_rw_command(1, 0, ext, ata_multiple));
+
+    for (uint32_t i = 0; i < chunk;)
+    {
+      uint32_t block = ata_drq_block(ata_multiple, chunk - i);
+
+      if (ata_wait_drq())
+        return 1;
+
+      outsw(ATA_DATA, p, block * words);
+      p += block * words;
+      i += block;
+    }
+
+    // Wait for write complete
+    if (ata_wait_ready())
+      return 1;
+
+    lba += chunk;
+    count -= chunk;
+  }
+
+  return 0;
+}
+
+// ===== Bus-master DMA (PIIX IDE) =====
+// Register offsets from a channel's bus-master block (BAR4 of the IDE
+// controller for the primary channel, BAR4 + 8 for the secondary)
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS 0x02
+#define ATA_BM_PRDT 0x04
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ 0x08 // device -> memory
+
+#define ATA_BM_SR_ACTIVE 0x01
+#define ATA_BM_SR_ERR 0x02
+#define ATA_BM_SR_IRQ 0x04
+
+// Physical Region Descriptor: one contiguous buffer region that must not
+// cross a 64 KiB boundary. A byte count of 0 means 64 KiB.
+typedef struct
+{
+  uint32_t addr;
+  uint16_t bytes;
+  uint16_t flags;
+} __attribute__((packed)) ata_prd_t;
+
+#define ATA_PRD_EOT 0x8000
+#define ATA_PRD_MAX 512
+
+// Largest DMA command whose buffer always fits the PRD table, whatever its
+// alignment: every entry but one covers a full 64 KiB
+#define ATA_DMA_MAX_BYTES ((ATA_PRD_MAX - 1) * 0x10000)
+
+// One table per channel. A table must be dword aligned and must not cross
+// 64 KiB either.
+static ata_prd_t ata_prdt[2][ATA_PRD_MAX] __attribute__((aligned(4096)));
+
+// TRIM range block sent by DMA, one per channel
+static uint64_t ata_dsm_block[2][ATA_DSM_RANGES] __attribute__((aligned(512)));
+
+uint16_t ata_bm_base;
+int ata_dma_enabled;
+
+// ===== Channels =====
+typedef struct
+{
+  uint16_t io;   // command block base
+  uint16_t ctrl; // device control / alternate status
+  uint16_t bm;   // bus-master block, 0 when DMA is not available
+  uint8_t irq;
+  ata_prd_t *prdt;
+  uint64_t *dsm; // TRIM range entries
+
+  // Pending requests (FIFO) and the one the drive is working on
+  blk_request_t *head;
+  blk_request_t *tail;
+  blk_request_t *active;
+
+  // Progress of the active request. Requests larger than one command are
+  // split into several commands; a merged chain (see block.c) always goes
+  // out as a single command.
+  uint32_t xfer_done;      // sectors completed by earlier commands
+  uint32_t xfer_count;     // sectors in the command in flight
+  uint32_t xfer_left;      // PIO sectors still to move for this command
+  uint8_t *xfer_buf;       // where the next PIO sector goes
+  blk_request_t *xfer_seg; // chain member xfer_buf points into
+  uint32_t xfer_seg_left;  // PIO sectors left in xfer_seg
+  uint8_t xfer_dma;
+  uint8_t issue_deferred; // drive was busy, ata_channel_service issues later
+
+  uint8_t lba48;    // drive on this channel supports 48-bit commands
+  uint8_t multiple; // sectors per PIO DRQ block, 0 = single-sector commands
+  uint32_t sector_size; // logical sector size of the drive, bytes
+
+  uint32_t irq_count;
+
+  blkdev_t *dev; // block device completions are reported to, if any
+} ata_channel_t;
+
+ata_channel_t ata_channels[2] = {
+    {.io = 0x1F0, .ctrl = 0x3F6, .irq = 14, .prdt = ata_prdt[0],
+     .dsm = ata_dsm_block[0], .sector_size = ATA_SECTOR_BYTES},
+    {.io = 0x170, .ctrl = 0x376, .irq = 15, .prdt = ata_prdt[1],
+     .dsm = ata_dsm_block[1], .sector_size = ATA_SECTOR_BYTES},
+};
+
+// Finds the IDE controller on PCI and enables bus mastering.
+// Returns 1 if DMA can be used on the primary channel.
+int ata_dma_init(void)
+{
+  pci_device_t ide;
+  ata_identify_t id = {0};
+
+  if (!pci_find_class(0x01, 0x01, &ide))
+    return 0;
+
+  uint32_t bar4 = pci_read32(&ide, PCI_BAR0 + 4 * 4);
+  if (!(bar4 & 1) || (bar4 & 0xFFFC) == 0)
+    return 0; // bus master block must be in I/O space
+
+  ata_identify(&id);
+  if (!id.dma)
+    return 0;
+
+  pci_enable_bus_master(&ide);
+
+  ata_bm_base = bar4 & 0xFFFC;
+  ata_dma_enabled = 1;
+
+  ata_channels[0].bm = ata_bm_base;
+  ata_channels[1].bm = ata_bm_base + 8;
+
+  DebugWriteString("ATA: bus-master DMA enabled\n");
+  return 1;
+}
+
+// Appends PRD entries for `bytes` at `buffer` after the first `*n`.
+// Returns 0 when the buffer can't be described (odd address or too many
+// regions).
+static int ata_dma_add_prd(ata_prd_t *prdt, int *n, const void *buffer,
+                           uint32_t bytes)
+{
+  uint32_t addr = (uint32_t)buffer;
+
+  if (addr & 1)
+    return 0;
+
+  while (bytes > 0)
+  {
+    if (*n == ATA_PRD_MAX)
+      return 0;
+
+    uint32_t chunk = 0x10000 - (addr & 0xFFFF);
+    if (chunk > bytes)
+      chunk = bytes;
+
+    prdt[*n].addr = addr;
+    prdt[*n].bytes = (uint16_t)chunk; // 64 KiB -> 0
+    prdt[*n].flags = 0;
+
+    addr += chunk;
+    bytes -= chunk;
+    (*n)++;
+  }
+
+  return 1;
+}
+
+// Fills the PRD table for `bytes` at `buffer`
+static int ata_dma_build_prdt(ata_prd_t *prdt, const void *buffer,
+                              uint32_t bytes)
+{
+  int n = 0;
+
+  if (!ata_dma_add_prd(prdt, &n, buffer, bytes) || n == 0)
+    return 0;
+
+  prdt[n - 1].flags = ATA_PRD_EOT;
+  return 1;
+}
+
+// Fills the PRD table with every buffer of a merged request chain, so the
+// whole chain moves as one scatter-gather transfer
+static int ata_dma_build_prdt_chain(ata_prd_t *prdt, const blk_request_t *req,
+                                    uint32_t sector_size)
+{
+  int n = 0;
+
+  for (; req; req = req->merge_next)
+  {
+    if (!ata_dma_add_prd(prdt, &n, req->buffer, req->count * sector_size))
+      return 0;
+  }
+
+  if (n == 0)
+    return 0;
+
+  prdt[n - 1].flags = ATA_PRD_EOT;
+  return 1;
+}
+
+// Polled single-command DMA on the primary channel. Only used while the
+// channel's request queue is idle (benchmarks).
+static int ata_dma_transfer(uint64_t lba, uint32_t count, void *buffer,
+                            int write)
+{
+  ata_prd_t *prdt = ata_channels[0].prdt;
+
+  if (!ata_dma_build_prdt(prdt, buffer, count * ata_sector_size))
+    return -1;
+
+  if (ata_wait_ready())
+    return 1;
+
+  // Stop engine, point it at the table, clear stale ERR/IRQ bits
+  outb(ata_bm_base + ATA_BM_COMMAND, 0);
+  outl(ata_bm_base + ATA_BM_PRDT, (uint32_t)prdt);
+  outb(ata_bm_base + ATA_BM_STATUS,
+       inb(ata_bm_base + ATA_BM_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+
+  uint8_t dir = write ? 0 : ATA_BM_CMD_READ;
+  outb(ata_bm_base + ATA_BM_COMMAND, dir);
+
+  int ext = ata_setup_lba(ATA_DATA, lba, count, ata_lba48);
+  if (ext < 0)
+    return 1;
+  io_barrier();
+  outb(ATA_COMMAND, ata_rw_command(write, 1, ext, 0));
+  outb(ata_bm_base + ATA_BM_COMMAND, dir | ATA_BM_CMD_START);
+
+  // The CPU only waits here; the controller moves the data
+  uint64_t deadline = ata_deadline();
+  uint8_t bms;
+  do
+  {
+    bms = inb(ata_bm_base + ATA_BM_STATUS);
+    if (timer_now() > deadline)
+    {
+      bms |= ATA_BM_SR_ERR;
+      break;
+    }
+  } while (!(bms & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR)) && (bms & ATA_BM_SR_ACTIVE));
+
+  outb(ata_bm_base + ATA_BM_COMMAND, 0);
+  outb(ata_bm_base + ATA_BM_STATUS, bms | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
 
-  // Wait for write complete
   ata_wait_ready();
+  uint8_t status = inb(ATA_STATUS); // also acknowledges INTRQ
+  io_barrier();
+
+  if ((bms & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)))
+    return 1;
+  return 0;
 }
 
-// void atapi_read_sector(uint32_t lba, uint16_t *buffer)
-// {
-//     terminal_writestring("A");
+// ===== READ/WRITE SECTORS (DMA) =====
+// Same contract as the PIO variants. Returns -1 if the buffer can't be used
+// for DMA, so the caller can fall back to PIO.
+static uint32_t ata_dma_max_sectors(void)
+{
+  uint32_t max = ata_max_command_sectors(ata_lba48);
+  uint32_t dma = ATA_DMA_MAX_BYTES / ata_sector_size;
+  return max > dma ? dma : max;
+}
 
-//     // 1. Czekaj aż BSY=0
-//     ata_wait_ready();
-//     terminal_writestring("B");
+int ata_dma_read_sectors(uint64_t lba, uint32_t count, void *buffer)
+{
+  uint8_t *p = (uint8_t *)buffer;
+  uint32_t max = ata_dma_max_sectors();
 
-//     // 2. Wybierz dysk SLAVE z LBA = 1 (0xB0)
-//     outb(ATA_DRIVE, 0xB0);
-//     terminal_writestring("C");
+  while (count > 0)
+  {
+    uint32_t chunk = count > max ? max : count;
+    int r = ata_dma_transfer(lba, chunk, p, 0);
+    if (r)
+      return r;
+
+    p += chunk * ata_sector_size;
+    lba += chunk;
+    count -= chunk;
+  }
 
-//     ata_wait_ready();
+  return 0;
+}
 
-//     // 3. Ustaw transfer size – 2048 bajtów (ATAPI sektor)
-//     outb(0x1F2, 0);       // Sector count (low)
-//     outb(0x1F3, 2048 & 0xFF);   // LBA low  = low byte transfer size
-//     outb(0x1F4, 2048 >> 8);     // LBA mid  = high byte transfer size
-//     outb(0x1F5, 0);             // LBA high = always 0
-//     terminal_writestring("D");
+int ata_dma_write_sectors(uint64_t lba, uint32_t count, const void *buffer)
+{
+  const uint8_t *p = (const uint8_t *)buffer;
+  uint32_t max = ata_dma_max_sectors();
 
-//     // 4. Komenda PACKET
-//     outb(ATA_COMMAND, 0xA0);
-//     terminal_writestring("E");
+  while (count > 0)
+  {
+    uint32_t chunk = count > max ? max : count;
+    int r = ata_dma_transfer(lba, chunk, (void *)p, 1);
+    if (r)
+      return r;
+
+    p += chunk * ata_sector_size;
+    lba += chunk;
+    count -= chunk;
+  }
 
-//     // 5. Czekaj na DRQ
-//     ata_wait_drq();
-//     terminal_writestring("F");
+  return 0;
+}
 
-//     // 6. Przygotuj pakiet Read(10)
-//     uint16_t packet[6] = {0};
+// ===== Request queue =====
+// Each channel runs one command at a time. The IRQ handler (or a poll from
+// blk_wait) moves PIO data blocks, finishes DMA transfers, completes the
+// request and starts the next queued one.
 
-//     packet[0] = 0x2800;                // Opcode READ(10)
-//     packet[1] = (lba >> 16) & 0xFFFF;  //
-//     packet[2] = lba & 0xFFFF;          //
-//     packet[3] = 0;                     // reserved
-//     packet[4] = 0x0100;                // 1 sektor (big endian!)
-//     packet[5] = 0;                     // control byte
+static void ata_channel_start(ata_channel_t *ch);
 
-//     terminal_writestring("G");
+static void ata_channel_finish(ata_channel_t *ch, int error)
+{
+  blk_request_t *req = ch->active;
 
-//     // 7. Wyślij pakiet (12 bajtów = 6 słów)
-//     for (int i = 0; i < 6; i++)
-//         outw(ATA_DATA, packet[i]);
-//     terminal_writestring("H");
+  ch->active = NULL;
+  blk_complete(ch->dev, req, error);
 
-//     // 8. Czekaj na dane
-//     ata_wait_drq();
-//     terminal_writestring("I");
+  ata_channel_start(ch);
+}
 
-//     // 9. Odczytaj 2048 bajtów danych
-//     for (int i = 0; i < 1024; i++)
-//         buffer[i] = inw(ATA_DATA);
-//     terminal_writestring("J");
+// Moves the PIO cursor past one sector, stepping into the next request of
+// a merged chain when the current one is full
+static void ata_channel_pio_advance(ata_channel_t *ch)
+{
+  ch->xfer_buf += ch->sector_size;
+  ch->xfer_left--;
 
-//     // 10. GOTOWE
-// }
+  if (--ch->xfer_seg_left == 0 && ch->xfer_seg->merge_next)
+  {
+    ch->xfer_seg = ch->xfer_seg->merge_next;
+    ch->xfer_buf = (uint8_t *)ch->xfer_seg->buffer;
+    ch->xfer_seg_left = ch->xfer_seg->count;
+  }
+}
 
-void atapi_read_sector(uint32_t lba, uint16_t *buffer)
+// Moves one DRQ block: a single sector, or up to ch->multiple sectors in
+// multiple mode. The drive streams the whole block through the data port,
+// so it may span several requests of a merged chain.
+static void ata_channel_pio_block(ata_channel_t *ch, int write)
 {
+  uint32_t block = ata_drq_block(ch->multiple, ch->xfer_left);
 
-  // 1. Select Primary Slave device (CD-ROM)
-  outb(0x176, 0xA0); // Slave, LBA = 1
+  while (block--)
+  {
+    if (write)
+      outsw(ch->io + ATA_REG_DATA, ch->xfer_buf, ch->sector_size / 2);
+    else
+      insw(ch->io + ATA_REG_DATA, ch->xfer_buf, ch->sector_size / 2);
 
-  atapi_wait_ready(); // wait for BSY=0 and DRQ=0
+    ata_channel_pio_advance(ch);
+  }
+}
 
-  // 2. Set transfer size = 2048 bytes (typowy rozmiar sektora CD-ROM)
-  outb(0x172, 0);           // sector count = 0
-  outb(0x173, 2048 & 0xFF); // transfer size low byte
-  outb(0x174, 2048 >> 8);   // transfer size high byte
-  outb(0x175, 0);           // always 0
+// Starts the bus-master engine around `command`; the task file is already
+// set up and the PRD table filled
+static void ata_channel_dma_go(ata_channel_t *ch, int write, uint8_t command)
+{
+  uint8_t dir = write ? 0 : ATA_BM_CMD_READ;
 
-  // 3. Send PACKET command (0xA0)
-  outb(0x177, 0xA0);
+  outb(ch->bm + ATA_BM_COMMAND, 0);
+  outl(ch->bm + ATA_BM_PRDT, (uint32_t)ch->prdt);
+  outb(ch->bm + ATA_BM_STATUS,
+       inb(ch->bm + ATA_BM_STATUS) | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+  outb(ch->bm + ATA_BM_COMMAND, dir);
 
-  atapi_wait_drq(); // wait for DRQ set (ready for packet)
+  io_barrier();
+  outb(ch->io + ATA_REG_COMMAND, command);
+  outb(ch->bm + ATA_BM_COMMAND, dir | ATA_BM_CMD_START);
+}
 
-  // 4. Prepare the READ(10) packet command
-  uint8_t packet[12] = {0};
-  packet[0] = 0x28; // READ(10)
-  packet[1] = 0;    // flags
-  packet[2] = (lba >> 24) & 0xFF;
-  packet[3] = (lba >> 16) & 0xFF;
-  packet[4] = (lba >> 8) & 0xFF;
-  packet[5] = lba & 0xFF;
-  packet[6] = 0; // reserved
-  packet[7] = 0; // transfer length MSB
-  packet[8] = 1; // transfer length LSB = 1 sektor
-  packet[9] = 0; // control
-  packet[10] = 0;
-  packet[11] = 0;
+// The issue path runs from the IRQ handler, so it checks BSY once instead
+// of waiting for it. Returns 1 if the drive is busy; the command is then
+// sent by ata_channel_service() once BSY clears (or the request times out).
+static int ata_channel_busy(ata_channel_t *ch)
+{
+  ch->issue_deferred = (inb(ch->io + ATA_REG_STATUS) & ATA_SR_BSY) != 0;
+  return ch->issue_deferred;
+}
+
+// Sends a discard request as one DATA SET MANAGEMENT (TRIM) command. The
+// range entries travel to the drive like DMA write data.
+static void ata_channel_issue_trim(ata_channel_t *ch)
+{
+  blk_request_t *req = ch->active;
+  const blk_range_t *ranges = (const blk_range_t *)req->buffer;
+
+  memset(ch->dsm, 0, sizeof(ata_dsm_block[0]));
+  for (uint32_t i = 0; i < req->nr_ranges && i < ATA_DSM_RANGES; i++)
+    ch->dsm[i] = (ranges[i].lba & 0xFFFFFFFFFFFFULL) |
+                 ((uint64_t)ranges[i].count << 48);
+
+  // The whole span completes with this one command
+  ch->xfer_dma = 1;
+  ch->xfer_count = req->count;
+  ch->xfer_left = 0;
+
+  if (!ata_dma_build_prdt(ch->prdt, ch->dsm, sizeof(ata_dsm_block[0])))
+  {
+    ata_channel_finish(ch, 1);
+    return;
+  }
+  if (ata_channel_busy(ch))
+    return;
+
+  // 48-bit register layout: high bytes first
+  outb(ch->io + ATA_REG_DRIVE, 0x40);
+  outb(ch->io + ATA_REG_FEATURES, 0);
+  outb(ch->io + ATA_REG_FEATURES, ATA_DSM_TRIM);
+  outb(ch->io + ATA_REG_SECCOUNT, 0);
+  outb(ch->io + ATA_REG_SECCOUNT, 1); // range blocks
+  for (int i = 0; i < 2; i++)
+  {
+    outb(ch->io + ATA_REG_LBA_LOW, 0);
+    outb(ch->io + ATA_REG_LBA_MID, 0);
+    outb(ch->io + ATA_REG_LBA_HIGH, 0);
+  }
+
+  ata_channel_dma_go(ch, 1, ATA_CMD_DATA_SET_MANAGEMENT);
+}
+
+// Sends a cache flush: a non-data command whose completion interrupt
+// ends the request
+static void ata_channel_issue_flush(ata_channel_t *ch)
+{
+  ch->xfer_count = 0;
+  ch->xfer_left = 0;
+
+  if (ata_channel_busy(ch))
+    return;
+
+  outb(ch->io + ATA_REG_DRIVE, 0xE0);
+  outb(ch->io + ATA_REG_COMMAND,
+       ch->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+}
+
+// Sends the next command of the active request
+static void ata_channel_issue(ata_channel_t *ch)
+{
+  blk_request_t *req = ch->active;
+  uint64_t lba = req->lba + ch->xfer_done;
+  uint32_t count;
+
+  ch->xfer_seg = req;
+  ch->xfer_dma = 0;
+  ch->issue_deferred = 0;
+
+  if (req->nr_ranges)
+  {
+    ata_channel_issue_trim(ch);
+    return;
+  }
+
+  if (req->flush)
+  {
+    ata_channel_issue_flush(ch);
+    return;
+  }
+
+  if (req->merge_next)
+  {
+    // The scheduler keeps chains within dev->max_sectors
+    count = blk_chain_sectors(req);
+    ch->xfer_buf = (uint8_t *)req->buffer;
+    ch->xfer_seg_left = req->count;
 
-  // wysyłaj po 2 bajty (word) od najmłodszego do najstarszego
-  for (int i = 0; i < 6; i++)
+    if (ch->bm && ata_dma_build_prdt_chain(ch->prdt, req, ch->sector_size))
+      ch->xfer_dma = 1;
+  }
+  else
   {
-    uint16_t word = packet[2 * i] | (packet[2 * i + 1] << 8);
-    outw(0x170, word);
+    uint32_t max = ata_max_command_sectors(ch->lba48);
+
+    count = req->count - ch->xfer_done;
+    if (count > max)
+      count = max;
+
+    ch->xfer_buf = (uint8_t *)req->buffer + ch->xfer_done * ch->sector_size;
+    if (ch->bm)
+    {
+      uint32_t dma_max = ATA_DMA_MAX_BYTES / ch->sector_size;
+      uint32_t dma_count = count > dma_max ? dma_max : count;
+      if (ata_dma_build_prdt(ch->prdt, ch->xfer_buf,
+                             dma_count * ch->sector_size))
+      {
+        ch->xfer_dma = 1;
+        count = dma_count;
+      }
+    }
+    ch->xfer_seg_left = count;
   }
 
-  atapi_wait_drq(); // wait for DRQ set (data ready)
+  ch->xfer_count = count;
+  ch->xfer_left = count;
+
+  if (ata_channel_busy(ch))
+    return;
 
-  // 6. Read 2048 bytes = 1024 words from data port
-  for (int i = 0; i < 1024; i++)
+  int ext = ata_setup_lba(ch->io, lba, count, ch->lba48);
+  if (ext < 0)
   {
-    buffer[i] = inw(0x170);
+    ata_channel_finish(ch, 1);
+    return;
+  }
+
+  if (ch->xfer_dma)
+  {
+    ata_channel_dma_go(ch, req->write, ata_rw_command(req->write, 1, ext, 0));
+    return;
+  }
+
+  outb(ch->io + ATA_REG_COMMAND,
+       ata_rw_command(req->write, 0, ext, ch->multiple));
+
+  if (req->write)
+  {
+    // The first block is sent without waiting for an interrupt
+    if (ata_wait_drq_port(ch->io + ATA_REG_STATUS))
+    {
+      ata_channel_finish(ch, 1);
+      return;
+    }
+
+    ata_channel_pio_block(ch, 1);
+    ata_delay400(ch->ctrl);
   }
 }
 
-uint32_t atapi_get_disc_size()
+static void ata_channel_command_done(ata_channel_t *ch, int error)
 {
-  uint8_t packet[12] = {0};
-  packet[0] = 0x25; // READ CAPACITY (10)
+  ch->xfer_done += ch->xfer_count;
+
+  if (!error && !ch->active->merge_next && ch->xfer_done < ch->active->count)
+    ata_channel_issue(ch);
+  else
+    ata_channel_finish(ch, error);
+}
 
-  // 1. select secondary ATAPI (usually slave)
-  outb(0x176, 0xA0); // 0xA0 = device 0, 0xB0 = device 1
-  atapi_wait_ready();
+static void ata_channel_start(ata_channel_t *ch)
+{
+  if (ch->active || !ch->head)
+    return;
+
+  ch->active = ch->head;
+  ch->head = ch->head->next;
+  if (!ch->head)
+    ch->tail = NULL;
 
-  // 2. Transfer 8 bytes (READ CAPACITY always returns 8)
-  outb(0x172, 0); // sector count = 0
-  outb(0x173, 8); // LBA low = size
-  outb(0x174, 0);
-  outb(0x175, 0);
+  ch->xfer_done = 0;
+  ata_channel_issue(ch);
+}
 
-  // 3. Send PACKET command 0xA0
-  outb(0x177, 0xA0);
-  atapi_wait_drq();
+// Advances the active request if the drive is ready. Runs from the IRQ
+// handler and from polling, always with interrupts disabled.
+static void ata_channel_service(ata_channel_t *ch)
+{
+  blk_request_t *req = ch->active;
 
-  // 4. Send packet (6 words, big-endian inside words)
-  for (int i = 0; i < 6; i++)
+  if (!req)
   {
-    uint16_t w = ((uint16_t)packet[i * 2] << 8) | packet[i * 2 + 1];
-    outw(0x170, w);
+    inb(ch->io + ATA_REG_STATUS); // acknowledge stray interrupt
+    return;
   }
 
-  atapi_wait_drq();
+  if (ch->issue_deferred)
+  {
+    if (!(inb(ch->io + ATA_REG_STATUS) & ATA_SR_BSY))
+      ata_channel_issue(ch);
+    return;
+  }
 
-  // 5. Read 4 words = 8 bytes
-  uint8_t buf[8];
-  for (int i = 0; i < 4; i++)
+  if (ch->xfer_dma)
   {
-    uint16_t w = inw(0x170);
-    buf[i * 2] = (w >> 8) & 0xFF;
-    buf[i * 2 + 1] = (w) & 0xFF;
+    uint8_t bms = inb(ch->bm + ATA_BM_STATUS);
+    if (!(bms & (ATA_BM_SR_IRQ | ATA_BM_SR_ERR)) && (bms & ATA_BM_SR_ACTIVE))
+      return; // still transferring
+
+    outb(ch->bm + ATA_BM_COMMAND, 0);
+    outb(ch->bm + ATA_BM_STATUS, bms | ATA_BM_SR_ERR | ATA_BM_SR_IRQ);
+
+    uint8_t status = inb(ch->io + ATA_REG_STATUS);
+    io_barrier();
+
+    ata_channel_command_done(
+        ch, (bms & ATA_BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF)));
+    return;
+  }
+
+  uint8_t status = inb(ch->io + ATA_REG_STATUS);
+  if (status & ATA_SR_BSY)
+    return;
+
+  if (status & (ATA_SR_ERR | ATA_SR_DF))
+  {
+    ata_channel_command_done(ch, 1);
+    return;
   }
 
-  // Unpack: bytes 0–3 = max LBA (big endian)
+  // Write: the interrupt after the last block means the command finished
+  if (ch->xfer_left == 0)
+  {
+    ata_channel_command_done(ch, 0);
+    return;
+  }
+
+  if (!(status & ATA_SR_DRQ))
+    return;
+
+  ata_channel_pio_block(ch, req->write);
+  ata_delay400(ch->ctrl);
+
+  if (!req->write && ch->xfer_left == 0)
+    ata_channel_command_done(ch, 0);
+}
+
+// Fails the active request and resets both drives on the channel
+static void ata_channel_abort(ata_channel_t *ch)
+{
+  if (!ch->active)
+    return;
+
+  if (ch->bm)
+    outb(ch->bm + ATA_BM_COMMAND, 0);
+
+  ch->issue_deferred = 0;
+  outb(ch->ctrl, ATA_CTRL_SRST);
+  ata_delay400(ch->ctrl);
+  outb(ch->ctrl, 0);
+  ata_wait_ready_port(ch->io + ATA_REG_STATUS);
+
+  DebugWriteString("ATA: request timed out, channel reset\n");
+  ata_channel_finish(ch, 1);
+}
+
+static void ata_irq(int irq)
+{
+  ata_channel_t *ch = &ata_channels[irq == 14 ? 0 : 1];
+
+  ch->irq_count++;
+  ata_channel_service(ch);
+}
+
+// ===== Block device (primary master) =====
+static void ata_blk_submit(blkdev_t *dev, blk_request_t *req)
+{
+  ata_channel_t *ch = (ata_channel_t *)dev->priv;
+
+  if (ch->tail)
+    ch->tail->next = req;
+  else
+    ch->head = req;
+  ch->tail = req;
+
+  ata_channel_start(ch);
+}
+
+static void ata_blk_poll(blkdev_t *dev)
+{
+  ata_channel_service((ata_channel_t *)dev->priv);
+}
+
+static void ata_blk_abort(blkdev_t *dev)
+{
+  ata_channel_abort((ata_channel_t *)dev->priv);
+}
+
+iosched_t ata_iosched;
+
+blkdev_t ata_blkdev = {
+    .name = "ata0",
+    .sector_size = ATA_SECTOR_BYTES,
+    .max_sectors = ATA_MAX_SECTORS,
+    .submit = ata_blk_submit,
+    .poll = ata_blk_poll,
+    .abort = ata_blk_abort,
+    .priv = &ata_channels[0],
+};
+
+// Enables drive interrupts on both channels and hooks IRQ14/IRQ15.
+// Needs idt_init() and should run after ata_dma_init().
+void ata_init(void)
+{
+  ata_identify_t id = {0};
+
+  ata_identify(&id);
+  ata_lba48 = id.lba48;
+  ata_channels[0].lba48 = id.lba48;
+  ata_blkdev.sectors = id.sectors48;
+
+  // 4Kn drives transfer 4 KiB per logical sector; 512e ones report the
+  // physical size only so writes can be aligned to it
+  if (id.logical_sector_size && id.logical_sector_size <= ATA_MAX_SECTOR_BYTES)
+  {
+    ata_sector_size = id.logical_sector_size;
+    ata_channels[0].sector_size = ata_sector_size;
+    ata_blkdev.sector_size = ata_sector_size;
+  }
+  ata_blkdev.phys_sectors = id.physical_sector_size / ata_sector_size;
+  ata_blkdev.phys_offset = id.phys_offset;
+
+  ata_blkdev.write_cache = ata_enable_write_cache(ATA_DATA, &id);
+
+  // TRIM goes out as a DMA transfer, so it needs the bus master
+  if (id.trim && id.lba48 && ata_channels[0].bm)
+  {
+    ata_blkdev.max_discard_ranges = ATA_DSM_RANGES;
+    ata_blkdev.max_discard_sectors = ATA_DSM_MAX_SECTORS;
+  }
+
+  // PIO transfers raise one interrupt per block instead of per sector
+  ata_multiple = ata_set_multiple(ATA_DATA, id.multiple_max);
+  ata_channels[0].multiple = ata_multiple;
+
+  // One command carries a merged chain; with LBA48 that is bounded by the
+  // PRD table rather than the sector count register
+  ata_blkdev.max_sectors =
+      id.lba48 ? ATA_DMA_MAX_BYTES / ata_sector_size : ATA_MAX_SECTORS;
+  ata_channels[0].dev = &ata_blkdev;
+  iosched_attach(&ata_blkdev, &ata_iosched, 1);
+
+  for (int i = 0; i < 2; i++)
+  {
+    outb(ata_channels[i].ctrl, 0); // nIEN = 0
+    irq_install(ata_channels[i].irq, ata_irq);
+  }
+}
+
+// ===== READ/WRITE SECTORS =====
+// Synchronous helpers on top of the buffer cache and the request queue.
+// The channel picks DMA when the controller supports it and the buffer
+// allows it, PIO otherwise.
+int ata_read_sectors(uint64_t lba, uint32_t count, void *buffer)
+{
+  return bcache_read(&ata_blkdev, lba, count, buffer);
+}
+
+int ata_write_sectors(uint64_t lba, uint32_t count, const void *buffer)
+{
+  return bcache_write(&ata_blkdev, lba, count, buffer);
+}
+
+// ===== READ SECTOR =====
+void ata_read_sector(uint64_t lba, uint16_t *buffer)
+{
+  ata_read_sectors(lba, 1, buffer);
+}
+
+// ===== WRITE SECTOR =====
+void ata_write_sector(uint64_t lba, const uint16_t *buffer)
+{
+  ata_write_sectors(lba, 1, buffer);
+}
+
+// ===== ATAPI (secondary master, polled PIO) =====
+#define ATAPI_CMD_PACKET 0xA0
+#define ATAPI_READ_12 0xA8
+#define ATAPI_READ_CAPACITY 0x25
+#define ATAPI_SECTOR_BYTES 2048
+#define ATAPI_MAX_SECTORS 64     // per READ(12) packet (128 KiB)
+#define ATAPI_BYTE_LIMIT 0xF800 // per DRQ block: 31 whole sectors, even
+
+// Sends a 12-byte packet and reads up to `bytes` of data in. The drive
+// splits the transfer into DRQ blocks and puts each block's length in
+// LBA mid/high; every block is moved with one rep insw, and anything past
+// `bytes` is drained. Returns the number of bytes stored, or -1 on error
+// or timeout.
+static int32_t atapi_packet_transfer(const uint8_t *packet, uint8_t *dst,
+                                     uint32_t bytes)
+{
+  uint32_t limit = bytes < ATAPI_BYTE_LIMIT ? bytes : ATAPI_BYTE_LIMIT;
+  uint32_t done = 0;
+
+  outb(ATA2_DRIVE, 0xA0);
+  ata_delay400(ATA2_ALTSTATUS);
+
+  if (atapi_wait_ready())
+    return -1;
+
+  outb(ATA2_ERROR, 0); // features: PIO data transfer
+  outb(ATA2_LBA1, (uint8_t)limit);
+  outb(ATA2_LBA2, (uint8_t)(limit >> 8));
+  outb(ATA2_COMMAND, ATAPI_CMD_PACKET);
+  ata_delay400(ATA2_ALTSTATUS);
+
+  if (atapi_wait_drq())
+    return -1;
+
+  outsw(ATA2_DATA, packet, 6);
+
+  for (;;)
+  {
+    ata_delay400(ATA2_ALTSTATUS);
+    if (atapi_wait_ready())
+      return -1;
+
+    uint8_t s = inb(ATA2_STATUS);
+    if (s & (ATA_SR_ERR | ATA_SR_DF))
+      return -1;
+    if (!(s & ATA_SR_DRQ))
+      return (int32_t)done; // command complete
+
+    uint32_t block = inb(ATA2_LBA1) | ((uint32_t)inb(ATA2_LBA2) << 8);
+    uint32_t take = block;
+    if (take > bytes - done)
+      take = bytes - done;
+    take &= ~1u;
+
+    insw(ATA2_DATA, dst + done, take / 2);
+    for (uint32_t i = take; i < block; i += 2)
+      inw(ATA2_DATA);
+
+    done += take;
+  }
+}
+
+// Interrupts stay masked on the secondary channel while a packet command
+// is polled, so IRQ 15 doesn't acknowledge DRQ blocks behind our back
+static int32_t atapi_packet_in(const uint8_t *packet, void *buffer,
+                               uint32_t bytes)
+{
+  outb(ATA2_ALTSTATUS, ATA_CTRL_NIEN);
+  int32_t result = atapi_packet_transfer(packet, (uint8_t *)buffer, bytes);
+  outb(ATA2_ALTSTATUS, 0);
+
+  return result;
+}
+
+// Reads `count` 2048-byte sectors with as few READ(12) packets as
+// ATAPI_MAX_SECTORS allows. Returns 0 on success, 1 on error.
+int atapi_read_sectors(uint32_t lba, uint32_t count, void *buffer)
+{
+  uint8_t *dst = (uint8_t *)buffer;
+
+  while (count)
+  {
+    uint32_t n = count < ATAPI_MAX_SECTORS ? count : ATAPI_MAX_SECTORS;
+    uint32_t bytes = n * ATAPI_SECTOR_BYTES;
+    uint8_t packet[12] = {0};
+
+    packet[0] = ATAPI_READ_12;
+    packet[2] = (uint8_t)(lba >> 24);
+    packet[3] = (uint8_t)(lba >> 16);
+    packet[4] = (uint8_t)(lba >> 8);
+    packet[5] = (uint8_t)lba;
+    packet[6] = (uint8_t)(n >> 24); // transfer length, big endian
+    packet[7] = (uint8_t)(n >> 16);
+    packet[8] = (uint8_t)(n >> 8);
+    packet[9] = (uint8_t)n;
+
+    if (atapi_packet_in(packet, dst, bytes) != (int32_t)bytes)
+      return 1;
+
+    lba += n;
+    count -= n;
+    dst += bytes;
+  }
+
+  return 0;
+}
+
+// Disc size in bytes from READ CAPACITY(10), 0 on error
+uint32_t atapi_get_disc_size()
+{
+  uint8_t packet[12] = {0};
+  uint8_t buf[8];
+
+  packet[0] = ATAPI_READ_CAPACITY;
+
+  if (atapi_packet_in(packet, buf, sizeof(buf)) != (int32_t)sizeof(buf))
+    return 0;
+
+  // Both fields are big endian: last LBA, then block size
   uint32_t max_lba =
       ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | ((uint32_t)buf[3]);
-
-  // bytes 4–7 = block size (should be 2048)
   uint32_t block_size =
       ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) | ((uint32_t)buf[6] << 8) | ((uint32_t)buf[7]);
 
-  // total disc size in bytes
   return (max_lba + 1) * block_size;
 }
+
+// ===== Block device (ATAPI, secondary master) =====
+// The CD-ROM is read with polled PIO, so requests complete right away
+// inside submit.
+static void atapi_blk_submit(blkdev_t *dev, blk_request_t *req)
+{
+  if (req->write || req->flush)
+  {
+    blk_complete(dev, req, 1);
+    return;
+  }
+
+  blk_complete(dev, req,
+               atapi_read_sectors((uint32_t)req->lba, req->count, req->buffer));
+}
+
+static void atapi_blk_poll(blkdev_t *dev) {}
+
+static void atapi_blk_abort(blkdev_t *dev) {}
+
+blkdev_t atapi_blkdev = {
+    .name = "atapi0",
+    .sector_size = ATAPI_SECTOR_BYTES,
+    .max_sectors = ATAPI_MAX_SECTORS,
+    .submit = atapi_blk_submit,
+    .poll = atapi_blk_poll,
+    .abort = atapi_blk_abort,
+};
@@ -1,10 +1,32 @@
 #include <string.h>
 #include <stdint.h>
+#include "bcache.c"
+#include "block.c"
+#include "lz4.c"
 
 // Constants dla FAT32
 #define FAT32_CLUSTER_FREE 0x00000000
 #define FAT32_CLUSTER_EOC 0x0FFFFFF8
 
+// Largest sector (4Kn disks) and cluster (the FAT spec limit) handled
+#define FAT32_MAX_SECTOR 4096
+#define FAT32_MAX_CLUSTER 32768
+
+// Memory for the FAT cache; FATs up to this size are loaded whole
+#define FAT32_FAT_CACHE_BYTES (512 * 1024)
+
+// Free cluster bitmap: one bit per cluster number up to 8x this
+#define FAT32_FREE_MAP_BYTES (128 * 1024)
+#define FAT32_FREE_MAP_SECTORS (FAT32_FREE_MAP_BYTES * 8 * 4 / 512) // FAT sectors it covers
+
+#define FAT32_FSINFO_LEAD_SIG 0x41615252
+#define FAT32_FSINFO_STRUCT_SIG 0x61417272
+#define FAT32_FREE_UNKNOWN 0xFFFFFFFF
+
+// Appending files get up to this many clusters held back past their end
+#define FAT32_PREALLOC_FILES 4
+#define FAT32_PREALLOC_MAX 64
+
 #pragma pack(push, 1)
 typedef struct
 {
@@ -61,51 +83,340 @@ typedef struct
     uint32_t size;
     int is_directory;
 
-    uint32_t entry_lba;    // sektor na którym jest wpis katalogowy
-    uint32_t entry_offset; // offset w sektorze (0..511)
+    uint64_t entry_lba;    // sektor na którym jest wpis katalogowy
+    uint32_t entry_offset; // offset w sektorze (0..bytes_per_sector-1)
 } fat32_dir_entry_info_t;
 
 fat32_bpb_t fat32_bpb;
 
-uint32_t fat_begin_lba;
-uint32_t cluster_begin_lba;
+// Absolute LBAs: the volume may start anywhere on an LBA48 disk
+uint64_t fat_begin_lba;
+uint64_t cluster_begin_lba;
 
 uint32_t bytes_per_sector;
 uint32_t sectors_per_cluster;
 
-uint32_t fat_start_lba;
+uint64_t fat_start_lba; // boot sector of the volume
+
+// Block device the volume lives on
+blkdev_t *fat32_dev;
+
+// Set by fat32_init() once the BPB checked out; nothing touches the disk
+// (and nothing is written) without it
+uint8_t fat32_mounted;
+
+// ===== FAT cache =====
+// Chain walks and allocation read FAT entries from memory. The cache is
+// direct mapped by FAT sector: a FAT that fits in FAT32_FAT_CACHE_BYTES
+// gets one slot per sector and is read whole at mount, larger ones fill
+// slots as sectors are first touched. Entry writes update the cached
+// sector and write it to every mirrored FAT copy through the block cache.
+static uint8_t fat32_fat_buf[FAT32_FAT_CACHE_BYTES];
+static uint32_t fat32_fat_tag[FAT32_FAT_CACHE_BYTES / 512]; // FAT sector + 1
+static uint32_t fat32_fat_slots;
+static uint32_t fat32_active_fat; // FAT copy read from (ext_flags)
+
+static uint32_t fat32_fat_generation; // bumped by every FAT entry write
+
+typedef struct
+{
+    uint32_t fat_lookups; // FAT entries read
+    uint32_t fat_reads;   // FAT sector reads passed down (FAT cache misses)
+    uint32_t dentry_hits; // path components found in the dentry cache
+    uint32_t dir_scans;   // path components looked up on disk
+} fat32_stats_t;
+
+fat32_stats_t fat32_stats;
+
+// Cached FAT sector `sector` (relative to the FAT), NULL on a read error
+static uint8_t *fat32_fat_sector(uint32_t sector)
+{
+    uint32_t slot = sector % fat32_fat_slots;
+    uint8_t *data = fat32_fat_buf + slot * bytes_per_sector;
+
+    if (fat32_fat_tag[slot] != sector + 1)
+    {
+        fat32_stats.fat_reads++;
+        uint64_t lba = fat_begin_lba + (uint64_t)fat32_active_fat * fat32_bpb.sectors_per_fat_32 + sector;
+        if (bcache_read(fat32_dev, lba, 1, data))
+        {
+            fat32_fat_tag[slot] = 0;
+            return NULL;
+        }
+        fat32_fat_tag[slot] = sector + 1;
+    }
+
+    return data;
+}
+
+static void fat32_fat_cache_init(void)
+{
+    uint32_t fat_sectors = fat32_bpb.sectors_per_fat_32;
+
+    fat32_fat_slots = bytes_per_sector ? FAT32_FAT_CACHE_BYTES / bytes_per_sector : 0;
+    memset(fat32_fat_tag, 0, sizeof(fat32_fat_tag));
+
+    // Bit 7 of ext_flags: only the FAT in bits 0-3 is active, no mirroring
+    fat32_active_fat = (fat32_bpb.ext_flags & 0x80) ? (fat32_bpb.ext_flags & 0x0F) : 0;
+
+    if (fat32_fat_slots == 0 || fat_sectors > fat32_fat_slots)
+        return;
+
+    // Small FAT: one read loads all of it, sector i into slot i
+    fat32_stats.fat_reads++;
+    uint64_t lba = fat_begin_lba + (uint64_t)fat32_active_fat * fat_sectors;
+    if (bcache_read(fat32_dev, lba, fat_sectors, fat32_fat_buf))
+        return;
+
+    for (uint32_t i = 0; i < fat_sectors; i++)
+        fat32_fat_tag[i] = i + 1;
+}
+
+// ===== Free cluster map =====
+// A bit per cluster, set while the cluster is free. The map is filled one
+// FAT sector at a time, the first time allocation looks there (right away
+// at mount when the whole FAT is cached anyway), and kept up to date by
+// fat32_write_fat_entry. The free count and next-free hint start from the
+// FSInfo sector and are written back to it after every file write.
+static uint8_t fat32_free_map[FAT32_FREE_MAP_BYTES];
+static uint8_t fat32_free_map_scanned[FAT32_FREE_MAP_SECTORS];
+static uint8_t fat32_free_map_ok;  // volume small enough for the map
+static uint8_t fat32_free_map_full; // every FAT sector scanned
+static uint32_t fat32_cluster_end; // last cluster number + 1
+static uint32_t fat32_free_clusters = FAT32_FREE_UNKNOWN;
+static uint32_t fat32_next_free = 2; // where allocation looks first
+static uint64_t fat32_fsinfo_lba;    // 0 = none
+
+// Free clusters kept out of the map for a growing file; still free in the FAT
+typedef struct
+{
+    uint32_t first_cluster; // file, 0 = slot unused
+    uint32_t start;
+    uint32_t count;
+} fat32_prealloc_t;
+
+static fat32_prealloc_t fat32_prealloc[FAT32_PREALLOC_FILES];
+
+static int fat32_free_map_test(uint32_t cluster)
+{
+    return (fat32_free_map[cluster >> 3] >> (cluster & 7)) & 1;
+}
+
+static void fat32_free_map_set(uint32_t cluster, int free)
+{
+    if (free)
+        fat32_free_map[cluster >> 3] |= (uint8_t)(1 << (cluster & 7));
+    else
+        fat32_free_map[cluster >> 3] &= (uint8_t)~(1 << (cluster & 7));
+}
+
+// Fills the map from FAT sector `sector`; returns 1 on a read error
+static int fat32_free_map_scan(uint32_t sector)
+{
+    if (fat32_free_map_scanned[sector])
+        return 0;
+
+    uint8_t *data = fat32_fat_sector(sector);
+    if (!data)
+        return 1;
+
+    uint32_t per_sector = bytes_per_sector / 4;
+    for (uint32_t i = 0; i < per_sector; i++)
+    {
+        uint32_t cluster = sector * per_sector + i;
+        if (cluster < 2 || cluster >= fat32_cluster_end)
+            continue;
+        fat32_free_map_set(cluster, (((uint32_t *)data)[i] & 0x0FFFFFFF) == FAT32_CLUSTER_FREE);
+    }
+
+    fat32_free_map_scanned[sector] = 1;
+    return 0;
+}
+
+// Scans every FAT sector not seen yet and recounts the free clusters
+static void fat32_free_map_scan_all(void)
+{
+    uint32_t per_sector = bytes_per_sector / 4;
+    uint32_t free = 0;
+
+    for (uint32_t sector = 0; sector * per_sector < fat32_cluster_end; sector++)
+    {
+        if (fat32_free_map_scan(sector))
+            return; // count stays unknown
+    }
+
+    for (uint32_t c = 2; c < fat32_cluster_end; c++)
+        free += fat32_free_map_test(c);
+    fat32_free_clusters = free;
+    fat32_free_map_full = 1;
+}
 
-void fat32_init(uint32_t lba)
+static void fat32_free_map_init(uint64_t lba)
 {
+    uint64_t data_sectors = (uint64_t)fat32_bpb.total_sectors_32 - (cluster_begin_lba - lba);
+    uint32_t clusters = sectors_per_cluster ? (uint32_t)udiv64(data_sectors, sectors_per_cluster) : 0;
+
+    fat32_cluster_end = clusters + 2;
+    if ((uint64_t)fat32_cluster_end * 4 > (uint64_t)fat32_bpb.sectors_per_fat_32 * bytes_per_sector)
+        fat32_cluster_end = fat32_bpb.sectors_per_fat_32 * (bytes_per_sector / 4);
+
+    fat32_free_map_ok = fat32_cluster_end <= FAT32_FREE_MAP_BYTES * 8 &&
+                        fat32_bpb.sectors_per_fat_32 <= FAT32_FREE_MAP_SECTORS;
+    memset(fat32_free_map, 0, sizeof(fat32_free_map));
+    memset(fat32_free_map_scanned, 0, sizeof(fat32_free_map_scanned));
+    fat32_free_map_full = 0;
+    memset(fat32_prealloc, 0, sizeof(fat32_prealloc));
+    fat32_free_clusters = FAT32_FREE_UNKNOWN;
+    fat32_next_free = 2;
+    fat32_fsinfo_lba = 0;
+
+    // FSInfo: free count and next-free hint, both only hints
+    if (fat32_bpb.fs_info != 0 && fat32_bpb.fs_info != 0xFFFF)
+    {
+        static uint8_t fsinfo[FAT32_MAX_SECTOR];
+
+        if (bcache_read(fat32_dev, lba + fat32_bpb.fs_info, 1, fsinfo) == 0 &&
+            *(uint32_t *)(fsinfo + 0) == FAT32_FSINFO_LEAD_SIG &&
+            *(uint32_t *)(fsinfo + 484) == FAT32_FSINFO_STRUCT_SIG)
+        {
+            uint32_t free = *(uint32_t *)(fsinfo + 488);
+            uint32_t next = *(uint32_t *)(fsinfo + 492);
+
+            fat32_fsinfo_lba = lba + fat32_bpb.fs_info;
+            if (free <= clusters)
+                fat32_free_clusters = free;
+            if (next >= 2 && next < fat32_cluster_end)
+                fat32_next_free = next;
+        }
+    }
+
+    // With the whole FAT in memory the map costs no I/O, and the count
+    // becomes exact
+    if (fat32_free_map_ok && fat32_bpb.sectors_per_fat_32 <= fat32_fat_slots)
+        fat32_free_map_scan_all();
+}
+
+// Keeps the map, the free count and the hint in step with a FAT entry
+// change from `old` to `value`
+static void fat32_free_map_update(uint32_t cluster, uint32_t old, uint32_t value)
+{
+    int was_free = old == FAT32_CLUSTER_FREE;
+    int is_free = value == FAT32_CLUSTER_FREE;
+
+    if (was_free == is_free || cluster < 2 || cluster >= fat32_cluster_end)
+        return;
+
+    if (fat32_free_map_ok && fat32_free_map_scanned[cluster * 4 / bytes_per_sector])
+        fat32_free_map_set(cluster, is_free);
+
+    if (fat32_free_clusters != FAT32_FREE_UNKNOWN)
+        fat32_free_clusters += is_free ? 1 : -1;
+
+    if (!is_free && cluster == fat32_next_free)
+        fat32_next_free = cluster + 1 < fat32_cluster_end ? cluster + 1 : 2;
+}
+
+// Writes the free count and next-free hint back to the FSInfo sector
+static void fat32_fsinfo_write(void)
+{
+    static uint8_t fsinfo[FAT32_MAX_SECTOR];
+
+    if (!fat32_fsinfo_lba || bcache_read(fat32_dev, fat32_fsinfo_lba, 1, fsinfo))
+        return;
+
+    if (*(uint32_t *)(fsinfo + 488) == fat32_free_clusters &&
+        *(uint32_t *)(fsinfo + 492) == fat32_next_free)
+        return;
+
+    *(uint32_t *)(fsinfo + 488) = fat32_free_clusters;
+    *(uint32_t *)(fsinfo + 492) = fat32_next_free;
+    bcache_write(fat32_dev, fat32_fsinfo_lba, 1, fsinfo);
+}
+
+static void fat32_dentry_reset(void);
+
+// Mounts the volume whose boot sector is at `lba`. Returns 0 on success,
+// 1 when the BPB is unreadable or describes a layout this code can't
+// address; the volume then stays unmounted.
+int fat32_init(blkdev_t *dev, uint64_t lba)
+{
+    static uint8_t boot_sector[FAT32_MAX_SECTOR];
+
+    fat32_mounted = 0;
+    fat32_dev = dev;
     fat_start_lba = lba;
-    ata_read_sector(lba, (uint16_t *)&fat32_bpb);
+
+    if (dev->sector_size > FAT32_MAX_SECTOR)
+        return 1;
+
+    // BPB is smaller than a sector, don't read straight into it
+    if (bcache_read(dev, lba, 1, boot_sector))
+        return 1;
+    memcpy_c(&fat32_bpb, boot_sector, sizeof(fat32_bpb));
 
     bytes_per_sector = fat32_bpb.bytes_per_sector;
     sectors_per_cluster = fat32_bpb.sectors_per_cluster;
 
+    // LBAs count the device's logical sectors, so the volume must use the
+    // same size (512 on 512n/512e disks, 4096 on 4Kn ones)
+    if (bytes_per_sector != dev->sector_size || sectors_per_cluster == 0 ||
+        sectors_per_cluster * bytes_per_sector > FAT32_MAX_CLUSTER ||
+        fat32_bpb.fat_count == 0 || fat32_bpb.sectors_per_fat_32 == 0)
+    {
+        DebugWriteString("FAT32: sector or cluster size not supported\n");
+        return 1;
+    }
+
     fat_begin_lba = lba + fat32_bpb.reserved_sectors;
-    cluster_begin_lba = fat_begin_lba + fat32_bpb.fat_count * fat32_bpb.sectors_per_fat_32;
+    cluster_begin_lba = fat_begin_lba + (uint64_t)fat32_bpb.fat_count * fat32_bpb.sectors_per_fat_32;
+
+    fat32_fat_cache_init();
+    fat32_free_map_init(lba);
+    fat32_dentry_reset();
+    fat32_mounted = 1;
+    return 0;
+}
+
+uint64_t fat32_cluster_lba(uint32_t cluster)
+{
+    return cluster_begin_lba + (uint64_t)(cluster - 2) * sectors_per_cluster;
+}
+
+// Reads `count` physically contiguous clusters with one request; with
+// LBA48 commands a single transfer can span many megabytes.
+int fat32_read_clusters(uint32_t first_cluster, uint32_t count, uint8_t *buffer)
+{
+    return bcache_read(fat32_dev, fat32_cluster_lba(first_cluster), count * sectors_per_cluster, buffer);
+}
+
+int fat32_write_clusters(uint32_t first_cluster, uint32_t count, const uint8_t *buffer)
+{
+    return bcache_write(fat32_dev, fat32_cluster_lba(first_cluster), count * sectors_per_cluster, buffer);
 }
 
 void fat32_read_cluster(uint32_t cluster, uint8_t *buffer)
 {
-    uint32_t first_sector = cluster_begin_lba + (cluster - 2) * sectors_per_cluster;
+    fat32_read_clusters(cluster, 1, buffer);
+}
 
-    for (uint32_t i = 0; i < sectors_per_cluster; i++)
-    {
-        ata_read_sector(first_sector + i, (uint16_t *)(buffer + i * bytes_per_sector));
-    }
+void fat32_write_cluster(uint32_t cluster, const uint8_t *buffer)
+{
+    fat32_write_clusters(cluster, 1, buffer);
 }
 
 void fat32_list_directory(uint32_t cluster)
 {
-    uint8_t cluster_buf[4096]; // wystarczy dla 32 KB klastra
+    static uint8_t cluster_buf[FAT32_MAX_CLUSTER];
+    uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
+
+    if (cluster_size > sizeof(cluster_buf))
+        return;
 
     fat32_read_cluster(cluster, cluster_buf);
 
     fat32_directory_entry_t *ent = (fat32_directory_entry_t *)cluster_buf;
 
-    for (int i = 0; i < (4096 / sizeof(fat32_directory_entry_t)); i++)
+    for (uint32_t i = 0; i < cluster_size / sizeof(fat32_directory_entry_t); i++)
     {
         if (ent[i].name[0] == 0x00)
             break;
@@ -152,7 +463,9 @@ uint32_t fat32_get_cluster_of_path(const char *path)
             path++;
             continue;
         }
-        part[pos++] = *path++;
+        if (pos < (int)sizeof(part) - 1)
+            part[pos++] = *path;
+        path++;
     }
 
     if (pos > 0)
@@ -166,6 +479,12 @@ uint32_t fat32_get_cluster_of_path(const char *path)
 
 void fat32_ls_path(const char *path)
 {
+    if (!fat32_mounted)
+    {
+        terminal_writestring("Volume not mounted.\n");
+        return;
+    }
+
     uint32_t cluster = fat32_get_cluster_of_path(path);
     fat32_list_directory(cluster);
 }
@@ -257,18 +576,16 @@ uint32_t fat32_next_cluster(uint32_t cluster)
     // Each FAT entry is 4 bytes
     uint32_t fat_offset = cluster * 4;
 
-    // Which sector of FAT?
-    uint32_t fat_sector = fat_start_lba + (fat_offset / bytes_per_sector);
-
-    // Position inside sector
+    // FAT sector (from the cache) and position inside it
+    uint8_t *fat_sector = fat32_fat_sector(fat_offset / bytes_per_sector);
     uint32_t offset_in_sector = fat_offset % bytes_per_sector;
 
-    // Read FAT sector
-    static uint8_t fat_sector_buf[512];
-    ata_read_sector(fat_sector, (uint16_t *)fat_sector_buf);
+    fat32_stats.fat_lookups++;
+    if (!fat_sector)
+        return 0;
 
     // Read 32-bit entry
-    uint32_t value = *(uint32_t *)(fat_sector_buf + offset_in_sector);
+    uint32_t value = *(uint32_t *)(fat_sector + offset_in_sector);
 
     // Mask to 28 bits (FAT32 spec)
     value &= 0x0FFFFFFF;
@@ -276,137 +593,409 @@ uint32_t fat32_next_cluster(uint32_t cluster)
     return value;
 }
 
-// -----------------------------
-// fat32_find_in_directory
-// Search a directory (given by cluster) for an entry named 'name' (user input).
-// Returns cluster number of the found entry (first cluster of file/dir), or 0 if not found.
-// - Skips deleted entries and LFN entries.
-// - Stops at 0x00 (end of directory).
-// - Does NOT support matching long names (LFN).
-// -----------------------------
-uint32_t fat32_find_in_directory(uint32_t dirCluster, const char *name)
+// ===== Extent maps =====
+// A file's cluster chain compressed into runs of physically contiguous
+// clusters, built from the (cached) FAT the first time the file is
+// accessed. Reads and writes move a whole run per transfer, and finding
+// the cluster at a file offset is a binary search. Maps are kept for the
+// last few files and rebuilt once any FAT entry has changed. Chains with
+// more than FAT32_EXTENT_MAX runs are mapped up to that many; lookups past
+// them walk the chain from the end of the last run.
+#define FAT32_EXTENT_FILES 4
+#define FAT32_EXTENT_MAX 64
+
+typedef struct
 {
-    if (dirCluster < 2)
-        return 0;
+    uint32_t index;   // first file cluster index of the run
+    uint32_t cluster; // its cluster number
+    uint32_t count;   // clusters in the run
+} fat32_extent_t;
 
-    // prepare short-name to match (11 bytes)
-    uint8_t want[11];
-    make_short_name_from_input(name, want);
+typedef struct
+{
+    uint32_t first_cluster; // file, 0 = slot unused
+    uint32_t generation;    // fat32_fat_generation when built
+    uint32_t last_used;
+    uint32_t clusters;      // chain length
+    uint32_t last_cluster;  // last cluster of the chain
+    uint32_t count;         // runs in ext
+    fat32_extent_t ext[FAT32_EXTENT_MAX];
+} fat32_extent_map_t;
+
+static fat32_extent_map_t fat32_extent_maps[FAT32_EXTENT_FILES];
+static uint32_t fat32_extent_clock;
+
+static void fat32_extent_build(fat32_extent_map_t *map, uint32_t first_cluster)
+{
+    uint32_t c = first_cluster;
 
-    // allocate a buffer sized to cluster (stack or static)
-    // be conservative: cluster size up to, e.g., 32 sectors * 512 = 16384 bytes
-    // If sectors_per_cluster * bytes_per_sector is large, you might want static buffer.
-    uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
-    // For simplicity use a static buffer (avoid stack overflow):
-    static uint8_t cluster_buf[16384]; // supports up to 32 * 512 = 16384; adjust if needed
-    if (cluster_size > sizeof(cluster_buf))
+    map->first_cluster = first_cluster;
+    map->generation = fat32_fat_generation;
+    map->clusters = 0;
+    map->last_cluster = 0;
+    map->count = 0;
+
+    while (c >= 2 && c < FAT32_CLUSTER_EOC && map->clusters < fat32_cluster_end)
+    {
+        fat32_extent_t *last = map->count ? &map->ext[map->count - 1] : NULL;
+
+        if (last && c == last->cluster + last->count &&
+            last->index + last->count == map->clusters)
+        {
+            last->count++;
+        }
+        else if (map->count < FAT32_EXTENT_MAX)
+        {
+            map->ext[map->count].index = map->clusters;
+            map->ext[map->count].cluster = c;
+            map->ext[map->count].count = 1;
+            map->count++;
+        }
+
+        map->last_cluster = c;
+        map->clusters++;
+        c = fat32_next_cluster(c);
+    }
+}
+
+// Extent map of the file starting at `first_cluster`, built if needed
+fat32_extent_map_t *fat32_extent_map(uint32_t first_cluster)
+{
+    fat32_extent_map_t *victim = &fat32_extent_maps[0];
+
+    for (int i = 0; i < FAT32_EXTENT_FILES; i++)
     {
-        // cluster too large for buffer — fail gracefully
+        fat32_extent_map_t *map = &fat32_extent_maps[i];
+
+        if (map->first_cluster == first_cluster)
+        {
+            victim = map;
+            break;
+        }
+        if (map->last_used < victim->last_used)
+            victim = map;
+    }
+
+    if (victim->first_cluster != first_cluster || victim->generation != fat32_fat_generation)
+        fat32_extent_build(victim, first_cluster);
+
+    victim->last_used = ++fat32_extent_clock;
+    return victim;
+}
+
+// Cluster holding file cluster `index` and how many clusters from there on
+// are physically contiguous. Returns 0 past the end of the chain.
+int fat32_extent_lookup(fat32_extent_map_t *map, uint32_t index,
+                        uint32_t *cluster, uint32_t *run)
+{
+    if (index >= map->clusters || map->count == 0)
         return 0;
+
+    uint32_t lo = 0, hi = map->count;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (map->ext[mid].index <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    fat32_extent_t *e = &map->ext[lo];
+    if (index < e->index + e->count)
+    {
+        *cluster = e->cluster + (index - e->index);
+        *run = e->count - (index - e->index);
+        return 1;
     }
 
-    uint32_t cluster = dirCluster;
+    // Past the mapped runs: walk on from the end of the last one
+    uint32_t c = e->cluster + e->count - 1;
+    for (uint32_t i = e->index + e->count - 1; i < index; i++)
+        c = fat32_next_cluster(c);
+    if (c < 2 || c >= FAT32_CLUSTER_EOC)
+        return 0;
+
+    *cluster = c;
+    *run = 1;
+    return 1;
+}
+
+// ===== Directory entry cache =====
+// Path lookups go through a hash table keyed by (directory cluster, 8.3
+// name), so resolving a path that was resolved before reads nothing from
+// the disk. Names that are not there are cached too (negative entries).
+// Slots are reused in round-robin order. fat32_update_dir_entry() writes
+// its changes through to the cached entry, and a remount empties the
+// cache. Nothing here creates or deletes entries; code that does must
+// drop the affected negative or positive entries.
+#define FAT32_DENTRY_BUCKETS 128
+#define FAT32_DENTRY_MAX 256
+
+typedef struct
+{
+    uint32_t parent;   // directory cluster, 0 = slot unused
+    uint8_t name[11];  // 8.3, as stored on disk
+    uint8_t negative;  // no such entry in the directory
+    uint8_t attr;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint64_t entry_lba;    // where the entry is on disk
+    uint32_t entry_offset;
+    uint16_t hash_next; // next in the bucket (index + 1, 0 = end)
+} fat32_dentry_t;
+
+static fat32_dentry_t fat32_dentries[FAT32_DENTRY_MAX];
+static uint16_t fat32_dentry_buckets[FAT32_DENTRY_BUCKETS];
+static uint32_t fat32_dentry_clock;
+
+static uint32_t fat32_dentry_hash(uint32_t parent, const uint8_t name[11])
+{
+    uint32_t h = 2166136261u ^ parent; // FNV-1a
+    for (int i = 0; i < 11; i++)
+        h = (h ^ name[i]) * 16777619u;
+    return h % FAT32_DENTRY_BUCKETS;
+}
+
+static void fat32_dentry_reset(void)
+{
+    memset(fat32_dentries, 0, sizeof(fat32_dentries));
+    memset(fat32_dentry_buckets, 0, sizeof(fat32_dentry_buckets));
+    fat32_dentry_clock = 0;
+}
+
+// Reads directory `dir` looking for `want`; fills `d`, as a negative entry
+// when the name is not there. Returns 1 on a read error.
+static int fat32_dir_scan(uint32_t dir, const uint8_t want[11], fat32_dentry_t *d)
+{
+    static uint8_t cluster_buf[FAT32_MAX_CLUSTER];
+    uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
+    if (cluster_size > sizeof(cluster_buf))
+        return 1;
+
+    memset(d, 0, sizeof(*d));
+    d->parent = dir;
+    memcpy(d->name, want, 11);
+    d->negative = 1;
+
+    uint32_t cluster = dir;
 
     while (cluster >= 2 && cluster < 0x0FFFFFF8)
     {
-        // read full cluster
-        fat32_read_cluster(cluster, cluster_buf);
+        if (fat32_read_clusters(cluster, 1, cluster_buf))
+            return 1;
 
-        // iterate entries: 32 bytes each
         uint32_t entries = cluster_size / 32;
         for (uint32_t i = 0; i < entries; i++)
         {
             uint8_t *entry = cluster_buf + i * 32;
 
-            uint8_t first = entry[0];
+            if (entry[0] == 0x00)
+                return 0; // end of directory
+            if (entry[0] == 0xE5)
+                continue; // deleted
+            if ((entry[11] & 0x0F) == 0x0F)
+                continue; // LFN skip
 
-            if (first == 0x00)
+            if (compare_short_name(entry, want))
             {
-                // end of directory entries
+                uint16_t low = *(uint16_t *)(entry + 26);
+                uint16_t high = *(uint16_t *)(entry + 20);
+
+                d->negative = 0;
+                d->attr = entry[11];
+                d->first_cluster = ((uint32_t)high << 16) | low;
+                d->size = *(uint32_t *)(entry + 28);
+                d->entry_lba = fat32_cluster_lba(cluster) + i * 32 / bytes_per_sector;
+                d->entry_offset = i * 32 % bytes_per_sector;
                 return 0;
             }
-            if (first == 0xE5)
-            {
-                // deleted entry
-                continue;
-            }
+        }
 
-            uint8_t attr = entry[11];
-            if ((attr & 0x0F) == 0x0F)
-            {
-                // long file name entry -> skip
-                continue;
-            }
+        cluster = fat32_next_cluster(cluster);
+    }
 
-            // now compare 11-byte name
-            if (compare_short_name(entry, want))
-            {
-                // found — read cluster high/low
-                uint16_t low = *(uint16_t *)(entry + 26);  // first_cluster_low (offset 26)
-                uint16_t high = *(uint16_t *)(entry + 20); // first_cluster_high (offset 20)
-                uint32_t found_cluster = ((uint32_t)high << 16) | (uint32_t)low;
-                return found_cluster;
-            }
+    return 0;
+}
+
+// Entry `want` of directory `dir`, from the cache or else from the disk
+// (and then cached, found or not). NULL on a read error.
+static const fat32_dentry_t *fat32_dentry_lookup(uint32_t dir, const uint8_t want[11])
+{
+    if (dir < 2)
+        return NULL;
+
+    uint32_t b = fat32_dentry_hash(dir, want);
+
+    for (uint16_t i = fat32_dentry_buckets[b]; i; i = fat32_dentries[i - 1].hash_next)
+    {
+        fat32_dentry_t *d = &fat32_dentries[i - 1];
+        if (d->parent == dir && memcmp(d->name, want, 11) == 0)
+        {
+            fat32_stats.dentry_hits++;
+            return d;
         }
+    }
 
-        // go to next cluster in directory chain
-        cluster = fat32_next_cluster(cluster);
-        if (cluster == 0 || cluster >= 0x0FFFFFF8)
-            break;
+    static fat32_dentry_t found;
+    fat32_stats.dir_scans++;
+    if (fat32_dir_scan(dir, want, &found))
+        return NULL;
+
+    // Reuse the next slot; unlink it from its old bucket first
+    uint16_t slot = (uint16_t)(fat32_dentry_clock + 1);
+    fat32_dentry_t *d = &fat32_dentries[fat32_dentry_clock];
+    fat32_dentry_clock = (fat32_dentry_clock + 1) % FAT32_DENTRY_MAX;
+
+    if (d->parent)
+    {
+        uint16_t *link = &fat32_dentry_buckets[fat32_dentry_hash(d->parent, d->name)];
+        while (*link != slot)
+            link = &fat32_dentries[*link - 1].hash_next;
+        *link = d->hash_next;
     }
 
-    return 0; // not found
+    *d = found;
+    d->hash_next = fat32_dentry_buckets[b];
+    fat32_dentry_buckets[b] = slot;
+    return d;
 }
 
-// Reads file content and prints it via terminal_writestring.
-// Assumes:
-// - "cluster" is the first cluster of the file (from directory entry)
-// - "size" is the exact file size in bytes.
-// Prints exactly file content (no null-termination).
-void fat32_read_file(uint32_t first_cluster, uint32_t size)
+// Keeps the cached copy of an entry in step with a write of it to disk
+static void fat32_dentry_update(const fat32_dir_entry_info_t *info)
 {
-    if (first_cluster < 2)
+    for (uint32_t i = 0; i < FAT32_DENTRY_MAX; i++)
     {
-        terminal_writestring("Invalid file cluster!\n");
-        return;
+        fat32_dentry_t *d = &fat32_dentries[i];
+
+        if (d->parent && !d->negative && d->entry_lba == info->entry_lba &&
+            d->entry_offset == info->entry_offset)
+        {
+            d->first_cluster = info->first_cluster;
+            d->size = info->size;
+        }
     }
+}
 
-    uint32_t cluster = first_cluster;
+// -----------------------------
+// fat32_find_in_directory
+// Search a directory (given by cluster) for an entry named 'name' (user input).
+// Returns cluster number of the found entry (first cluster of file/dir), or 0 if not found.
+// - Skips deleted entries and LFN entries.
+// - Stops at 0x00 (end of directory).
+// - Does NOT support matching long names (LFN).
+// -----------------------------
+uint32_t fat32_find_in_directory(uint32_t dirCluster, const char *name)
+{
+    // prepare short-name to match (11 bytes)
+    uint8_t want[11];
+    make_short_name_from_input(name, want);
 
-    // cluster size in bytes
-    uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
+    const fat32_dentry_t *d = fat32_dentry_lookup(dirCluster, want);
+    if (!d || d->negative)
+        return 0; // not found
 
-    // static buffer for one cluster (max 16 KB; adjust if bigger clusters)
-    static uint8_t cluster_buf[16384];
-    if (cluster_size > sizeof(cluster_buf))
+    return d->first_cluster;
+}
+
+// ===== Sequential read-ahead =====
+// Each recently read file remembers where the next sequential read would
+// be. While reads keep arriving there, the clusters ahead of the reader are
+// prefetched into the block cache, and the window doubles on every
+// sequential read (up to FAT32_RA_MAX clusters). Physically contiguous
+// clusters are prefetched as one run. A jump elsewhere in the file resets
+// the window.
+#define FAT32_RA_FILES 4
+#define FAT32_RA_MIN 2  // clusters
+#define FAT32_RA_MAX 32 // clusters
+
+typedef struct
+{
+    uint32_t first_cluster; // file, 0 = slot unused
+    uint32_t next_index;    // cluster index a sequential read asks for next
+    uint32_t ra_index;      // clusters before this index are prefetched
+    uint32_t ra_cluster;    // cluster number at ra_index
+    uint32_t window;        // clusters kept ahead; 0 = not sequential
+    uint32_t last_used;
+} fat32_ra_t;
+
+static fat32_ra_t fat32_ra[FAT32_RA_FILES];
+static uint32_t fat32_ra_clock;
+
+static fat32_ra_t *fat32_ra_get(uint32_t first_cluster)
+{
+    fat32_ra_t *victim = &fat32_ra[0];
+
+    for (int i = 0; i < FAT32_RA_FILES; i++)
     {
-        terminal_writestring("Cluster size too big for buffer!\n");
-        return;
+        if (fat32_ra[i].first_cluster == first_cluster)
+        {
+            victim = &fat32_ra[i];
+            victim->last_used = ++fat32_ra_clock;
+            return victim;
+        }
+        if (fat32_ra[i].last_used < victim->last_used)
+            victim = &fat32_ra[i];
     }
 
-    uint32_t bytes_left = size;
+    memset(victim, 0, sizeof(*victim));
+    victim->first_cluster = first_cluster;
+    victim->last_used = ++fat32_ra_clock;
+    return victim;
+}
+
+// Called before the file starting at `first_cluster` reads `count`
+// contiguous clusters from `cluster`, its `index`-th cluster, on
+void fat32_readahead(uint32_t first_cluster, uint32_t index, uint32_t count, uint32_t cluster)
+{
+    fat32_ra_t *ra = fat32_ra_get(first_cluster);
+
+    // The cache can only have so many prefetches in flight
+    uint32_t max = BCACHE_PREFETCH_MAX / sectors_per_cluster;
+    if (max > FAT32_RA_MAX)
+        max = FAT32_RA_MAX;
 
-    while (cluster >= 2 && cluster < 0x0FFFFFF8 && bytes_left > 0)
+    if (index == ra->next_index && max > 0)
     {
-        // Read this cluster
-        fat32_read_cluster(cluster, cluster_buf);
+        ra->window = ra->window ? ra->window * 2 : FAT32_RA_MIN;
+        if (ra->window > max)
+            ra->window = max;
+    }
+    else
+    {
+        ra->window = 0;
+    }
+    ra->next_index = index + count;
+
+    if (!ra->window)
+        return;
 
-        // How many bytes to print from this cluster?
-        uint32_t to_print = (bytes_left < cluster_size) ? bytes_left : cluster_size;
+    if (ra->ra_index < index + count)
+    {
+        ra->ra_index = index + count;
+        ra->ra_cluster = fat32_next_cluster(cluster + count - 1);
+    }
 
-        // Temporary null-termination for terminal_writestring
-        // (Assumes terminal_writestring expects a C-string)
-        cluster_buf[to_print] = 0;
+    // Top up only once half the window is used, so runs stay long
+    uint32_t target = index + count + ra->window;
+    if (ra->ra_index - (index + count) > ra->window / 2)
+        return;
 
-        terminal_writestring((char *)cluster_buf);
+    while (ra->ra_index < target && ra->ra_cluster >= 2 && ra->ra_cluster < FAT32_CLUSTER_EOC)
+    {
+        uint32_t run_start = ra->ra_cluster;
+        uint32_t run = 0;
+        uint32_t prev;
 
-        bytes_left -= to_print;
+        do
+        {
+            prev = ra->ra_cluster;
+            ra->ra_cluster = fat32_next_cluster(prev);
+            ra->ra_index++;
+            run++;
+        } while (ra->ra_index < target && ra->ra_cluster == prev + 1);
 
-        // move to next cluster
-        if (bytes_left > 0)
-            cluster = fat32_next_cluster(cluster);
-        else
-            break;
+        bcache_prefetch(fat32_dev, fat32_cluster_lba(run_start), run * sectors_per_cluster);
     }
 }
 
@@ -417,7 +1006,7 @@ void fat32_read_file(uint32_t first_cluster, uint32_t size)
 
 int fat32_resolve_path(const char *path, fat32_dir_entry_info_t *info)
 {
-    if (!info)
+    if (!info || !fat32_mounted)
         return 0;
 
     uint32_t cluster = fat32_bpb.root_cluster;
@@ -435,6 +1024,8 @@ int fat32_resolve_path(const char *path, fat32_dir_entry_info_t *info)
         info->first_cluster = cluster;
         info->size = 0;
         info->is_directory = 1;
+        info->entry_lba = 0;
+        info->entry_offset = 0;
         return 1;
     }
 
@@ -454,83 +1045,129 @@ int fat32_resolve_path(const char *path, fat32_dir_entry_info_t *info)
         if (*path == '/')
             path++;
 
-        // Find entry in current directory cluster
-        uint8_t cluster_buf[16384]; // max cluster buffer; adjust if needed
-        uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
+        // Find entry in current directory (dentry cache)
+        uint8_t want[11];
+        make_short_name_from_input(part, want);
 
-        uint32_t current_cluster = cluster;
+        const fat32_dentry_t *d = fat32_dentry_lookup(cluster, want);
+        if (!d || d->negative)
+            return 0; // Not found
 
-        int found = 0;
+        int is_dir = (d->attr & 0x10) != 0;
 
-        while (current_cluster >= 2 && current_cluster < 0x0FFFFFF8)
+        // If last component, fill info and return success
+        if (*path == 0)
         {
-            fat32_read_cluster(current_cluster, cluster_buf);
+            info->first_cluster = d->first_cluster;
+            info->size = d->size;
+            info->is_directory = is_dir;
+            info->entry_lba = d->entry_lba;
+            info->entry_offset = d->entry_offset;
+            return 1;
+        }
 
-            uint32_t entries = cluster_size / 32;
+        // Descend into directory
+        if (!is_dir)
+        {
+            // path continues but this is file → fail
+            return 0;
+        }
 
-            for (uint32_t i = 0; i < entries; i++)
-            {
-                uint8_t *entry = cluster_buf + i * 32;
-
-                uint8_t first = entry[0];
-                if (first == 0x00)
-                {
-                    // End of directory
-                    break;
-                }
-                if (first == 0xE5)
-                    continue; // deleted
-                if ((entry[11] & 0x0F) == 0x0F)
-                    continue; // LFN skip
-
-                uint8_t want[11];
-                make_short_name_from_input(part, want);
-
-                if (compare_short_name(entry, want))
-                {
-                    // Found
-                    uint16_t low = *(uint16_t *)(entry + 26);
-                    uint16_t high = *(uint16_t *)(entry + 20);
-                    uint32_t first_cluster = ((uint32_t)high << 16) | low;
-
-                    uint32_t size = *(uint32_t *)(entry + 28);
-                    uint8_t attr = entry[11];
-                    int is_dir = (attr & 0x10) != 0;
-
-                    // If last component, fill info and return success
-                    if (*path == 0)
-                    {
-                        info->first_cluster = first_cluster;
-                        info->size = size;
-                        info->is_directory = is_dir;
-                        return 1;
-                    }
-                    else
-                    {
-                        // Descend into directory
-                        if (!is_dir)
-                        {
-                            // path continues but this is file → fail
-                            return 0;
-                        }
-                        cluster = first_cluster;
-                        found = 1;
-                        break;
-                    }
-                }
-            }
+        // ".." of a top-level directory holds 0 for the root
+        cluster = d->first_cluster ? d->first_cluster : fat32_bpb.root_cluster;
+    }
 
-            if (found)
-                break;
+    return 0; // Should not reach here
+}
+
+// ===== Streaming file reads =====
+// fat32_file_read() finds the clusters at the current position in the
+// file's extent map. Whole clusters go straight into the caller's buffer,
+// a physically contiguous run of them in one transfer; only partial
+// clusters pass through a cluster buffer.
+typedef struct
+{
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t pos;
+} fat32_file_t;
 
-            current_cluster = fat32_next_cluster(current_cluster);
+// Returns 1 on success, 0 if the path is missing or a directory
+int fat32_open(const char *path, fat32_file_t *file)
+{
+    fat32_dir_entry_info_t info;
+
+    if (!fat32_resolve_path(path, &info) || info.is_directory)
+        return 0;
+
+    file->first_cluster = info.first_cluster;
+    file->size = info.size;
+    file->pos = 0;
+    return 1;
+}
+
+// Reads up to `len` bytes. Returns the count, 0 at the end of the file or
+// -1 on error.
+int32_t fat32_file_read(fat32_file_t *file, void *buffer, uint32_t len)
+{
+    static uint8_t cluster_buf[FAT32_MAX_CLUSTER];
+    uint32_t cluster_size = sectors_per_cluster * bytes_per_sector;
+    uint8_t *dst = (uint8_t *)buffer;
+    uint32_t done = 0;
+
+    if (cluster_size == 0 || cluster_size > FAT32_MAX_CLUSTER)
+        return -1;
+    if (len > file->size - file->pos)
+        len = file->size - file->pos;
+
+    while (done < len)
+    {
+        fat32_extent_map_t *map = fat32_extent_map(file->first_cluster);
+        uint32_t index = file->pos / cluster_size;
+        uint32_t offset = file->pos % cluster_size;
+        uint32_t cluster, run;
+
+        if (!fat32_extent_lookup(map, index, &cluster, &run))
+            return -1;
+
+        // Whole clusters: as much of the run as the caller wants
+        uint32_t count = 1;
+        if (offset == 0 && len - done >= cluster_size)
+        {
+            count = (len - done) / cluster_size;
+            if (count > run)
+                count = run;
         }
 
-        if (!found)
-            return 0; // Not found
+        fat32_readahead(file->first_cluster, index, count, cluster);
+
+        uint32_t n;
+        if (offset == 0 && len - done >= cluster_size)
+        {
+            if (fat32_read_clusters(cluster, count, dst + done))
+                return -1;
+            n = count * cluster_size;
+        }
+        else
+        {
+            if (fat32_read_clusters(cluster, 1, cluster_buf))
+                return -1;
+            n = cluster_size - offset;
+            if (n > len - done)
+                n = len - done;
+            memcpy(dst + done, cluster_buf + offset, n);
+        }
+
+        done += n;
+        file->pos += n;
     }
 
-    return 0; // Should not reach here
+    return (int32_t)done;
+}
+
+static int32_t fat32_lz4_read(void *ctx, void *buffer, uint32_t len)
+{
+    return fat32_file_read((fat32_file_t *)ctx, buffer, len);
 }
 
 void cmd_cat(const char *path)
@@ -548,66 +1185,284 @@ void cmd_cat(const char *path)
         return;
     }
 
-    fat32_read_file(info.first_cluster, info.size);
+    // Streamed in chunks; LZ4 frames are decompressed on the fly
+    fat32_file_t file;
+    fat32_open(path, &file);
+    lz4_cat(fat32_lz4_read, &file);
+}
+
+// Sets a FAT entry in the cached FAT sector only; returns the sector, or
+// NULL on a read error. fat32_fat_flush() then writes the sector out.
+static uint8_t *fat32_fat_set(uint32_t cluster, uint32_t value)
+{
+    uint32_t fat_offset = cluster * 4;
+    uint8_t *fat_sector = fat32_fat_sector(fat_offset / bytes_per_sector);
+    if (!fat_sector)
+        return NULL;
+
+    // Wpisujemy 28 bitów value; górne 4 bity wpisu są zarezerwowane
+    uint32_t *entry = (uint32_t *)(fat_sector + fat_offset % bytes_per_sector);
+    fat32_free_map_update(cluster, *entry & 0x0FFFFFFF, value & 0x0FFFFFFF);
+    *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    fat32_fat_generation++;
+    return fat_sector;
+}
+
+// Zapis sektora FAT do każdej kopii FAT (albo tylko aktywnej, gdy
+// mirroring wyłączony)
+static void fat32_fat_flush(uint32_t sector, const uint8_t *fat_sector)
+{
+    for (uint32_t copy = 0; copy < fat32_bpb.fat_count; copy++)
+    {
+        if ((fat32_bpb.ext_flags & 0x80) && copy != fat32_active_fat)
+            continue;
+        bcache_write(fat32_dev, fat_begin_lba + (uint64_t)copy * fat32_bpb.sectors_per_fat_32 + sector, 1, fat_sector);
+    }
 }
 
 // FAT32 entry write (podobnie jak fat32_next_cluster, ale zapis)
 void fat32_write_fat_entry(uint32_t cluster, uint32_t value)
 {
-    uint32_t fat_offset = cluster * 4;
-    uint32_t fat_sector = fat_start_lba + (fat_offset / bytes_per_sector);
-    uint32_t offset_in_sector = fat_offset % bytes_per_sector;
+    uint8_t *fat_sector = fat32_fat_set(cluster, value);
+    if (fat_sector)
+        fat32_fat_flush(cluster * 4 / bytes_per_sector, fat_sector);
+}
 
-    static uint8_t fat_sector_buf[512];
-    ata_read_sector(fat_sector, (uint16_t *)fat_sector_buf);
+// Links clusters start..start+count-1 into a chain ending with EOC and
+// hangs it after `prev` (0 = none). The run's entries are set in the
+// cached FAT and each FAT sector they cover is written once.
+static void fat32_link_run(uint32_t prev, uint32_t start, uint32_t count)
+{
+    uint32_t per_sector = bytes_per_sector / 4;
+    uint32_t end = start + count;
 
-    // Wpisujemy 4 bajty value (28 bit masked)
-    *(uint32_t *)(fat_sector_buf + offset_in_sector) = value & 0x0FFFFFFF;
+    for (uint32_t c = start; c < end;)
+    {
+        uint32_t sector = c / per_sector;
+        uint32_t stop = (sector + 1) * per_sector;
+        uint8_t *fat_sector = NULL;
+
+        if (stop > end)
+            stop = end;
+        for (; c < stop; c++)
+            fat_sector = fat32_fat_set(c, c + 1 < end ? c + 1 : FAT32_CLUSTER_EOC);
+        if (fat_sector)
+            fat32_fat_flush(sector, fat_sector);
+    }
 
-    ata_write_sector(fat_sector, (uint16_t *)fat_sector_buf);
+    // Stary koniec łańcucha dopiero po zapisaniu nowego fragmentu
+    if (prev)
+        fat32_write_fat_entry(prev, start);
 }
 
-// Znajduje wolny klaster zaczynając od podanego (lub od 2)
+// Znajduje wolny klaster zaczynając od podanego; start 2 (lub mniej)
+// oznacza "gdziekolwiek" i zaczyna od podpowiedzi next-free. Po dojściu
+// do końca wolumenu szuka od początku.
 uint32_t fat32_find_free_cluster(uint32_t start_cluster)
 {
-    static uint8_t fat_sector_buf[512];
-    uint32_t fat_entries_per_sector = bytes_per_sector / 4;
-    uint32_t total_fat_sectors = fat32_bpb.sectors_per_fat_32;
+    uint32_t per_sector = bytes_per_sector / 4;
+    uint32_t end = fat32_cluster_end;
 
-    for (uint32_t sector = 0; sector < total_fat_sectors; sector++)
+    if (start_cluster <= 2)
+        start_cluster = fat32_next_free;
+    if (start_cluster < 2 || start_cluster >= end)
+        start_cluster = 2;
+
+    for (uint32_t pass = 0; pass < 2; pass++)
     {
-        uint32_t fat_sector = fat_start_lba + sector;
-        ata_read_sector(fat_sector, (uint16_t *)fat_sector_buf);
+        uint32_t from = pass ? 2 : start_cluster;
+        uint32_t to = pass ? start_cluster : end;
 
-        for (uint32_t i = 0; i < fat_entries_per_sector; i++)
+        for (uint32_t c = from; c < to;)
         {
-            uint32_t cluster = sector * fat_entries_per_sector + i;
-            if (cluster < 2)
-                continue; // cluster 0 and 1 reserved
+            uint32_t sector = c / per_sector;
 
-            if (cluster < start_cluster)
+            if (!fat32_free_map_ok)
+            {
+                // Volume too big for the map: look at the cached FAT
+                uint8_t *data = fat32_fat_sector(sector);
+                if (!data)
+                    return 0;
+                if ((((uint32_t *)data)[c % per_sector] & 0x0FFFFFFF) == FAT32_CLUSTER_FREE)
+                    return c;
+                c++;
                 continue;
+            }
 
-            uint32_t entry = *(uint32_t *)(fat_sector_buf + i * 4) & 0x0FFFFFFF;
+            if (fat32_free_map_scan(sector))
+                return 0;
 
-            if (entry == FAT32_CLUSTER_FREE)
+            // Skip whole bytes of used clusters
+            if ((c & 7) == 0 && fat32_free_map[c >> 3] == 0)
             {
-                return cluster;
+                c += 8;
+                continue;
             }
+            if (fat32_free_map_test(c))
+                return c;
+            c++;
         }
     }
+
     return 0; // no free cluster found
 }
 
-// Zeruje łańcuch klastrów (ustawia wszystkie FAT entries na 0)
-// cluster: pierwszy klaster pliku
+// ===== Run allocation =====
+// Writes take clusters in runs: the free run right after the file's last
+// cluster if there is one, otherwise the smallest run that holds the whole
+// request (best fit), otherwise the largest run and the rest in further
+// runs. Needs the complete free map; without it clusters come one at a
+// time from fat32_find_free_cluster.
+
+// Free clusters from `start` on, counting up to `max`
+static uint32_t fat32_free_run_length(uint32_t start, uint32_t max)
+{
+    uint32_t c = start;
+
+    while (c < fat32_cluster_end && c - start < max && fat32_free_map_test(c))
+    {
+        if ((c & 7) == 0 && fat32_free_map[c >> 3] == 0xFF && max - (c - start) >= 8)
+            c += 8;
+        else
+            c++;
+    }
+    return c - start;
+}
+
+// First cluster of a free run for `want` clusters next to `goal` (0 = no
+// preference); `*len` gets how many of them to use (at most `want`).
+// Returns 0 when the volume is full.
+static uint32_t fat32_find_free_run(uint32_t goal, uint32_t want, uint32_t *len)
+{
+    *len = 0;
+
+    if (fat32_free_map_ok && !fat32_free_map_full)
+        fat32_free_map_scan_all();
+    if (!fat32_free_map_full)
+    {
+        uint32_t c = fat32_find_free_cluster(goal);
+        *len = c ? 1 : 0;
+        return c;
+    }
+
+    if (goal >= 2 && goal < fat32_cluster_end && fat32_free_map_test(goal))
+    {
+        *len = fat32_free_run_length(goal, want);
+        return goal;
+    }
+
+    uint32_t fit = 0, fit_len = 0;         // smallest run >= want
+    uint32_t largest = 0, largest_len = 0; // fallback when none is
+
+    for (uint32_t c = 2; c < fat32_cluster_end;)
+    {
+        // Skip whole bytes of used clusters
+        if ((c & 7) == 0 && fat32_free_map[c >> 3] == 0)
+        {
+            c += 8;
+            continue;
+        }
+        if (!fat32_free_map_test(c))
+        {
+            c++;
+            continue;
+        }
+
+        uint32_t run = fat32_free_run_length(c, 0xFFFFFFFF);
+        if (run >= want && (fit == 0 || run < fit_len))
+        {
+            fit = c;
+            fit_len = run;
+            if (run == want)
+                break;
+        }
+        if (run > largest_len)
+        {
+            largest = c;
+            largest_len = run;
+        }
+        c += run;
+    }
+
+    if (fit)
+    {
+        *len = want;
+        return fit;
+    }
+    *len = largest_len;
+    return largest;
+}
+
+// Hands a file's held back clusters back to the map
+static void fat32_prealloc_release(uint32_t first_cluster)
+{
+    for (uint32_t i = 0; i < FAT32_PREALLOC_FILES; i++)
+    {
+        fat32_prealloc_t *p = &fat32_prealloc[i];
+
+        if (p->first_cluster == 0 || p->first_cluster != first_cluster)
+            continue;
+        for (uint32_t c = p->start; c < p->start + p->count; c++)
+            fat32_free_map_set(c, 1);
+        p->first_cluster = 0;
+    }
+}
+
+// Releases every reservation; returns 1 if there was any
+static int fat32_prealloc_release_all(void)
+{
+    int any = 0;
+
+    for (uint32_t i = 0; i < FAT32_PREALLOC_FILES; i++)
+    {
+        if (fat32_prealloc[i].first_cluster)
+        {
+            any = 1;
+            fat32_prealloc_release(fat32_prealloc[i].first_cluster);
+        }
+    }
+    return any;
+}
+
+// Holds back up to `count` free clusters from `start` for the file, so the
+// next append continues the same run. Only the in-memory map changes: the
+// clusters stay free on disk and go back when space runs out.
+static void fat32_prealloc_reserve(uint32_t first_cluster, uint32_t start, uint32_t count)
+{
+    static uint32_t next_slot;
+
+    if (!fat32_free_map_full)
+        return;
+
+    count = fat32_free_run_length(start, count);
+    if (count == 0)
+        return;
+
+    fat32_prealloc_t *p = &fat32_prealloc[next_slot];
+    next_slot = (next_slot + 1) % FAT32_PREALLOC_FILES;
+    if (p->first_cluster)
+        fat32_prealloc_release(p->first_cluster);
+
+    for (uint32_t c = start; c < start + count; c++)
+        fat32_free_map_set(c, 0);
+    p->first_cluster = first_cluster;
+    p->start = start;
+    p->count = count;
+}
+
+// Frees the cluster chain starting at `cluster` and queues its data area
+// for discard (TRIM); the cache coalesces neighbouring clusters into larger
+// ranges. The walk stops at anything that is not a cluster of the volume
+// (EOC, the bad-cluster mark, a corrupt link), so nothing outside the data
+// area is trimmed.
 void fat32_free_cluster_chain(uint32_t cluster)
 {
     uint32_t c = cluster;
-    while (c >= 2 && c < FAT32_CLUSTER_EOC)
+    while (c >= 2 && c < fat32_cluster_end)
     {
         uint32_t next = fat32_next_cluster(c);
         fat32_write_fat_entry(c, FAT32_CLUSTER_FREE);
+        bcache_discard(fat32_dev, fat32_cluster_lba(c), sectors_per_cluster);
         c = next;
     }
 }
@@ -618,269 +1473,143 @@ typedef enum
     FAT32_WRITE_APPEND = 1
 } fat32_write_mode_t;
 
+// Makes the chain starting at `first_cluster` (0 = none yet) at least
+// `need` clusters long, taking free runs and linking each with one FAT
+// update per FAT sector, then holds back up to `prealloc` more clusters
+// after its end. Returns the first cluster, or 0 when the disk is full
+// (the chain is then left as it was).
+static uint32_t fat32_extend_chain(uint32_t first_cluster, uint32_t need, uint32_t prealloc)
+{
+    uint32_t have = 0;
+    uint32_t last = 0;
+
+    if (first_cluster >= 2)
+    {
+        fat32_extent_map_t *map = fat32_extent_map(first_cluster);
+        have = map->clusters;
+        last = map->last_cluster;
+        fat32_prealloc_release(first_cluster);
+    }
+
+    uint32_t old_last = last;
+    uint32_t added = 0; // first cluster linked here
+
+    while (have < need)
+    {
+        uint32_t len;
+        uint32_t start = fat32_find_free_run(last ? last + 1 : 0, need - have, &len);
+        if (start == 0 && fat32_prealloc_release_all())
+            continue;
+        if (start == 0)
+        {
+            // brak miejsca: cofnij to, co zostało dołączone
+            if (old_last)
+                fat32_write_fat_entry(old_last, FAT32_CLUSTER_EOC);
+            if (added)
+                fat32_free_cluster_chain(added);
+            return 0;
+        }
+
+        fat32_link_run(last, start, len);
+        if (!last)
+            first_cluster = start;
+
+        if (!added)
+            added = start;
+        last = start + len - 1;
+        have += len;
+    }
+
+    if (prealloc && last + 1 < fat32_cluster_end)
+        fat32_prealloc_reserve(first_cluster, last + 1, prealloc);
+
+    return first_cluster;
+}
+
 // Zapisuje dane do pliku (nadpisanie lub dopisanie)
 // first_cluster: pierwszy klaster pliku
 // current_size: aktualny rozmiar pliku (w bajtach)
 // data: wskaźnik do danych do zapisania
 // data_size: rozmiar danych do zapisania
-// mode: nadpisz (od zera) lub dopisz
+// mode: nadpisz (od zera) lub dopisz; dopisywane pliki dostają zapas
+// klastrów (prealokację)
+//
+// Nadpisanie pisze do nowego łańcucha; stary zostaje nietknięty, aż wpis
+// katalogowy wskaże nowy (zwalnia go fat32_write_file_by_path).
 //
 // Zwraca: nowy pierwszy klaster pliku (jeśli plik był pusty, nadpisany itp.), lub 0 przy błędzie
-// uint32_t fat32_write_file(uint32_t first_cluster, uint32_t current_size, const uint8_t *data, uint32_t data_size, fat32_write_mode_t mode, char *path)
-// {
-//     uint32_t cluster_size = bytes_per_sector * sectors_per_cluster;
-
-//     if (mode == FAT32_WRITE_OVERWRITE)
-//     {
-//         // Zwolnij wszystkie klastry starego pliku
-//         if (first_cluster >= 2)
-//         {
-//             fat32_free_cluster_chain(first_cluster);
-//         }
-
-//         // Znajdź nowy klaster startowy
-//         uint32_t new_cluster = fat32_find_free_cluster(2);
-//         if (new_cluster == 0)
-//             return 0; // brak miejsca
-
-//         // Ustaw go jako koniec łańcucha w FAT
-//         fat32_write_fat_entry(new_cluster, FAT32_CLUSTER_EOC);
-
-//         first_cluster = new_cluster;
-//         current_size = 0;
-//     }
-//     else if (mode == FAT32_WRITE_APPEND)
-//     {
-//         // jeśli plik pusty, nadpisujemy od nowa (bo nie ma klastra)
-//         if (first_cluster < 2)
-//         {
-//             uint32_t new_cluster = fat32_find_free_cluster(2);
-//             if (new_cluster == 0)
-//                 return 0;
-//             fat32_write_fat_entry(new_cluster, FAT32_CLUSTER_EOC);
-//             first_cluster = new_cluster;
-//             current_size = 0;
-//         }
-//         else
-//         {
-//             // idź do ostatniego klastra w łańcuchu
-//             uint32_t c = first_cluster;
-//             uint32_t next = fat32_next_cluster(c);
-//             while (next >= 2 && next < FAT32_CLUSTER_EOC)
-//             {
-//                 c = next;
-//                 next = fat32_next_cluster(c);
-//             }
-//             // teraz c jest ostatnim klastrem
-//             first_cluster = first_cluster; // start pliku
-//             // ustawiamy cluster na ostatni do dopisania
-//         }
-//     }
-//     else
-//     {
-//         return 0; // nieznany tryb
-//     }
-
-//     // Obliczamy w którym klastrze pliku kończy się aktualny rozmiar (tylko dla dopisywania)
-//     uint32_t cluster = first_cluster;
-//     uint32_t size = current_size;
-//     uint32_t cluster_index = 0;
-
-//     if (mode == FAT32_WRITE_APPEND)
-//     {
-//         cluster_index = size / cluster_size;
-//         uint32_t last_cluster = cluster;
-
-//         // idź do ostatniego klastra
-//         for (uint32_t i = 0; i < cluster_index; i++)
-//         {
-//             uint32_t next = fat32_next_cluster(last_cluster);
-//             if (next >= FAT32_CLUSTER_EOC || next == 0)
-//                 break;
-//             last_cluster = next;
-//         }
-//         cluster = last_cluster;
-//     }
-
-//     uint32_t offset_in_cluster = current_size % cluster_size;
-
-//     uint32_t bytes_written = 0;
-//     static uint8_t cluster_buf[16384]; // bufor klastra (max 16KB)
-
-//     while (bytes_written < data_size)
-//     {
-//         // jeśli zaczynamy nowy klaster a offset_in_cluster jest 0 — zeruj bufor
-//         if (offset_in_cluster == 0)
-//         {
-//             for (uint32_t i = 0; i < cluster_size; i++)
-//                 cluster_buf[i] = 0;
-//         }
-//         else
-//         {
-//             // czytaj obecny klaster do bufora
-//             fat32_read_cluster(cluster, cluster_buf);
-//         }
-
-//         // ile możemy zapisać do obecnego klastra
-//         uint32_t can_write = cluster_size - offset_in_cluster;
-//         uint32_t to_write = (data_size - bytes_written < can_write) ? (data_size - bytes_written) : can_write;
-
-//         // kopiuj dane do bufora
-//         for (uint32_t i = 0; i < to_write; i++)
-//         {
-//             cluster_buf[offset_in_cluster + i] = data[bytes_written + i];
-//         }
-
-//         // zapisz sektor po sektorze
-//         for (uint32_t sector = 0; sector < sectors_per_cluster; sector++)
-//         {
-//             ata_write_sector(
-//                 cluster_begin_lba + (cluster - 2) * sectors_per_cluster + sector,
-//                 (uint16_t *)(cluster_buf + sector * bytes_per_sector));
-//         }
-
-//         bytes_written += to_write;
-//         offset_in_cluster = 0; // po pierwszym klastrze offset zerujemy
-
-//         // jeśli jeszcze coś zostało do zapisania
-//         if (bytes_written < data_size)
-//         {
-//             uint32_t next = fat32_next_cluster(cluster);
-
-//             if (next >= FAT32_CLUSTER_EOC || next == 0)
-//             {
-//                 // trzeba zaalokować nowy klaster
-//                 uint32_t new_cluster = fat32_find_free_cluster(cluster + 1);
-//                 if (new_cluster == 0)
-//                 {
-//                     // brak miejsca
-//                     break;
-//                 }
-//                 fat32_write_fat_entry(cluster, new_cluster);
-//                 fat32_write_fat_entry(new_cluster, FAT32_CLUSTER_EOC);
-//                 cluster = new_cluster;
-//             }
-//             else
-//             {
-//                 cluster = next;
-//             }
-//         }
-//     }
-
-//     // fat32_dir_entry_info_t info;
-
-//     // fat32_resolve_path(path, &info);
-
-//     // info.first_cluster = first_cluster;
-//     // if (mode == FAT32_WRITE_OVERWRITE)
-//     //     info.size = data_size;
-//     // else if (mode == FAT32_WRITE_APPEND)
-//     //     info.size += data_size;
-
-//     // fat32_update_dir_entry(&info);
-
-//     return first_cluster;
-// }
-
 uint32_t fat32_write_file(uint32_t first_cluster, uint32_t current_size,
                          const uint8_t *data, uint32_t data_size,
                          fat32_write_mode_t mode)
 {
     uint32_t cluster_size = bytes_per_sector * sectors_per_cluster;
+    if (!fat32_mounted || cluster_size == 0 || cluster_size > FAT32_MAX_CLUSTER)
+        return 0;
 
     if (mode == FAT32_WRITE_OVERWRITE) {
-        if (first_cluster >= 2) {
-            fat32_free_cluster_chain(first_cluster);
-        }
-        uint32_t new_cluster = fat32_find_free_cluster(2);
-        if (new_cluster == 0) return 0;
-        fat32_write_fat_entry(new_cluster, FAT32_CLUSTER_EOC);
-        first_cluster = new_cluster;
+        first_cluster = 0;
+        current_size = 0;
+    } else if (first_cluster < 2) {
+        // dopisywanie do pustego pliku
         current_size = 0;
     }
 
-    if (mode == FAT32_WRITE_APPEND) {
-        if (first_cluster < 2) {
-            // jeśli plik pusty, załóż nowy klaster
-            uint32_t new_cluster = fat32_find_free_cluster(2);
-            if (new_cluster == 0) return 0;
-            fat32_write_fat_entry(new_cluster, FAT32_CLUSTER_EOC);
-            first_cluster = new_cluster;
-            current_size = 0;
-        } else {
-            // idź do ostatniego klastra w łańcuchu
-            uint32_t c = first_cluster;
-            uint32_t next = fat32_next_cluster(c);
-            while (next >= 2 && next < FAT32_CLUSTER_EOC) {
-                c = next;
-                next = fat32_next_cluster(c);
-            }
-            // teraz c jest ostatnim klastrem
-            first_cluster = first_cluster; // start pliku
-            // ustawiamy cluster na ostatni do dopisania
-        }
-    }
+    // Łańcuch musi pokryć nowy koniec pliku (i co najmniej jeden klaster)
+    uint32_t end = current_size + data_size;
+    uint32_t need = (end + cluster_size - 1) / cluster_size;
+    if (need == 0)
+        need = 1;
+
+    // Rosnący plik: zapas tyle klastrów, ile już ma (najwyżej FAT32_PREALLOC_MAX)
+    uint32_t prealloc = 0;
+    if (mode == FAT32_WRITE_APPEND)
+        prealloc = need < FAT32_PREALLOC_MAX ? need : FAT32_PREALLOC_MAX;
+
+    first_cluster = fat32_extend_chain(first_cluster, need, prealloc);
+    if (first_cluster == 0)
+        return 0;
 
-    uint32_t cluster;
-    uint32_t offset_in_cluster;
+    static uint8_t cluster_buf[FAT32_MAX_CLUSTER];
+    fat32_extent_map_t *map = fat32_extent_map(first_cluster);
+    uint32_t pos = current_size;
     uint32_t bytes_written = 0;
-    static uint8_t cluster_buf[16384];
-    uint32_t cluster_size_bytes = cluster_size;
-
-    if (mode == FAT32_WRITE_APPEND && first_cluster >= 2) {
-        // znajdź ostatni klaster, ustaw offset_in_cluster na koniec pliku
-        cluster = first_cluster;
-        uint32_t next = fat32_next_cluster(cluster);
-        while (next >= 2 && next < FAT32_CLUSTER_EOC) {
-            cluster = next;
-            next = fat32_next_cluster(cluster);
-        }
-        offset_in_cluster = current_size % cluster_size_bytes;
-    } else {
-        cluster = first_cluster;
-        offset_in_cluster = 0;
-    }
 
     while (bytes_written < data_size) {
-        if (offset_in_cluster == 0) {
-            for (uint32_t i = 0; i < cluster_size_bytes; i++) cluster_buf[i] = 0;
-        } else {
-            fat32_read_cluster(cluster, cluster_buf);
-        }
+        uint32_t index = pos / cluster_size;
+        uint32_t offset = pos % cluster_size;
+        uint32_t left = data_size - bytes_written;
+        uint32_t cluster, run, n;
 
-        uint32_t can_write = cluster_size_bytes - offset_in_cluster;
-        uint32_t to_write = (data_size - bytes_written < can_write) ? (data_size - bytes_written) : can_write;
-
-        for (uint32_t i = 0; i < to_write; i++) {
-            cluster_buf[offset_in_cluster + i] = data[bytes_written + i];
-        }
+        if (!fat32_extent_lookup(map, index, &cluster, &run))
+            return 0;
 
-        // zapisz sektor po sektorze
-        for (uint32_t sector = 0; sector < sectors_per_cluster; sector++) {
-            ata_write_sector(
-                cluster_begin_lba + (cluster - 2) * sectors_per_cluster + sector,
-                (uint16_t*)(cluster_buf + sector * bytes_per_sector)
-            );
+        if (offset == 0 && left >= cluster_size) {
+            // Całe klastry: cały ciągły fragment jednym zapisem, prosto z danych
+            uint32_t count = left / cluster_size;
+            if (count > run)
+                count = run;
+            if (fat32_write_clusters(cluster, count, data + bytes_written))
+                return 0;
+            n = count * cluster_size;
+        } else {
+            // Początek lub koniec w środku klastra: odczyt-modyfikacja-zapis;
+            // klaster za starym końcem pliku zaczyna od zer
+            if (offset == 0)
+                memset(cluster_buf, 0, cluster_size);
+            else
+                fat32_read_cluster(cluster, cluster_buf);
+
+            n = cluster_size - offset;
+            if (n > left)
+                n = left;
+            memcpy(cluster_buf + offset, data + bytes_written, n);
+
+            if (fat32_write_clusters(cluster, 1, cluster_buf))
+                return 0;
         }
 
-        bytes_written += to_write;
-        offset_in_cluster = 0;
-
-        if (bytes_written < data_size) {
-            uint32_t next = fat32_next_cluster(cluster);
-            if (next >= FAT32_CLUSTER_EOC || next == 0) {
-                uint32_t new_cluster = fat32_find_free_cluster(cluster + 1);
-                if (new_cluster == 0) {
-                    // brak miejsca
-                    break;
-                }
-                fat32_write_fat_entry(cluster, new_cluster);
-                fat32_write_fat_entry(new_cluster, FAT32_CLUSTER_EOC);
-                cluster = new_cluster;
-            } else {
-                cluster = next;
-            }
-        }
+        bytes_written += n;
+        pos += n;
     }
 
     return first_cluster;
@@ -896,8 +1625,8 @@ int fat32_update_dir_entry(const fat32_dir_entry_info_t *info)
     if (!info)
         return 0;
 
-    uint8_t sector_buf[512];
-    ata_read_sector(info->entry_lba, (uint16_t *)sector_buf);
+    static uint8_t sector_buf[FAT32_MAX_SECTOR];
+    bcache_read(fat32_dev, info->entry_lba, 1, sector_buf);
 
     // Aktualizuj pierwszy klaster (high i low)
     uint16_t first_cluster_high = (info->first_cluster >> 16) & 0xFFFF;
@@ -915,7 +1644,8 @@ int fat32_update_dir_entry(const fat32_dir_entry_info_t *info)
     sector_buf[info->entry_offset + 30] = ((size >> 16) & 0xFF);
     sector_buf[info->entry_offset + 31] = ((size >> 24) & 0xFF);
 
-    ata_write_sector(info->entry_lba, (uint16_t *)sector_buf);
+    bcache_write(fat32_dev, info->entry_lba, 1, sector_buf);
+    fat32_dentry_update(info);
 
     return 1;
 }
@@ -924,6 +1654,12 @@ int fat32_write_file_by_path(const char *path, const uint8_t *data, uint32_t dat
 {
     fat32_dir_entry_info_t info;
 
+    if (!fat32_mounted)
+    {
+        terminal_writestring("Volume not mounted.\n");
+        return 0;
+    }
+
     // 1. Znajdź plik po ścieżce
     if (!fat32_resolve_path(path, &info))
     {
@@ -938,6 +1674,7 @@ int fat32_write_file_by_path(const char *path, const uint8_t *data, uint32_t dat
     }
 
     // 2. Zapisz dane do pliku
+    uint32_t old_first_cluster = info.first_cluster;
     uint32_t new_first_cluster = fat32_write_file(info.first_cluster, info.size, data, data_size, mode);
 
     if (new_first_cluster == 0)
@@ -954,6 +1691,11 @@ int fat32_write_file_by_path(const char *path, const uint8_t *data, uint32_t dat
     else if (mode == FAT32_WRITE_APPEND)
         info.size += data_size;
 
+    // Barrier: the data and the FAT chain must be on stable media before
+    // the directory entry points at them, or a crash could leave the entry
+    // referring to clusters that were never written
+    bcache_sync();
+
     // 4. Zaktualizuj wpis katalogowy
     if (!fat32_update_dir_entry(&info))
     {
@@ -961,5 +1703,56 @@ int fat32_write_file_by_path(const char *path, const uint8_t *data, uint32_t dat
         return 0;
     }
 
+    // 5. Overwrite: the old chain is freed (and queued for discard) only
+    // once the entry pointing at the new one is on stable media, so a crash
+    // leaves either the old or the new contents
+    if (mode == FAT32_WRITE_OVERWRITE && old_first_cluster >= 2)
+    {
+        bcache_sync();
+        fat32_prealloc_release(old_first_cluster);
+        fat32_free_cluster_chain(old_first_cluster);
+    }
+
+    fat32_fsinfo_write();
+
     return 1; // sukces
 }
+
+// df: rozmiar wolumenu i wolne miejsce. Z pełną mapą lub poprawnym FSInfo
+// nie czyta nic z dysku.
+void fat32_df(void)
+{
+    uint32_t cluster_bytes = sectors_per_cluster * bytes_per_sector;
+    uint32_t clusters = fat32_cluster_end - 2;
+    char num[32];
+
+    if (!fat32_mounted)
+    {
+        terminal_writestring("Volume not mounted.\n");
+        return;
+    }
+
+    if (fat32_free_clusters == FAT32_FREE_UNKNOWN && fat32_free_map_ok)
+        fat32_free_map_scan_all();
+
+    terminal_writestring("Size: ");
+    utoa_bare(num, sizeof(num), (uint32_t)udiv64((uint64_t)clusters * cluster_bytes, 1024), 10);
+    terminal_writestring(num);
+    terminal_writestring(" KiB (");
+    utoa_bare(num, sizeof(num), clusters, 10);
+    terminal_writestring(num);
+    terminal_writestring(" clusters)\nFree: ");
+
+    if (fat32_free_clusters == FAT32_FREE_UNKNOWN)
+    {
+        terminal_writestring("unknown\n");
+        return;
+    }
+
+    utoa_bare(num, sizeof(num), (uint32_t)udiv64((uint64_t)fat32_free_clusters * cluster_bytes, 1024), 10);
+    terminal_writestring(num);
+    terminal_writestring(" KiB (");
+    utoa_bare(num, sizeof(num), fat32_free_clusters, 10);
+    terminal_writestring(num);
+    terminal_writestring(" clusters)\n");
+}
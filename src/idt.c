@@ -0,0 +1,174 @@
+#pragma once
+
+#include "io.c"
+#include <stdint.h>
+
+// ===== 8259 PIC =====
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA 0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA 0xA1
+
+#define PIC_EOI 0x20
+#define PIC_READ_ISR 0x0B
+
+// IRQ 0..15 are remapped to vectors 0x20..0x2F, clear of CPU exceptions
+#define IRQ_VECTOR_BASE 0x20
+
+typedef struct
+{
+  uint16_t offset_low;
+  uint16_t selector;
+  uint8_t zero;
+  uint8_t type_attr;
+  uint16_t offset_high;
+} __attribute__((packed)) idt_entry_t;
+
+typedef struct
+{
+  uint16_t limit;
+  uint32_t base;
+} __attribute__((packed)) idt_ptr_t;
+
+typedef void (*irq_handler_t)(int irq);
+
+static idt_entry_t idt[256] __attribute__((aligned(8)));
+// PCI interrupt lines may be shared, so each IRQ can have a few handlers;
+// every one of them runs and checks whether its device raised it
+#define IRQ_MAX_SHARED 4
+
+static irq_handler_t irq_handlers[16][IRQ_MAX_SHARED];
+
+// Entry stubs from boot.asm, one per IRQ line
+extern uint32_t irq_stub_table[16];
+
+int irqs_ready;
+
+// ===== Interrupt flag helpers =====
+typedef uint32_t irq_flags_t;
+
+static inline irq_flags_t irq_save(void)
+{
+  irq_flags_t flags;
+  __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+  return flags;
+}
+
+static inline void irq_restore(irq_flags_t flags)
+{
+  if (flags & 0x200)
+    __asm__ __volatile__("sti" : : : "memory");
+}
+
+static inline void irq_enable(void) { __asm__ __volatile__("sti" : : : "memory"); }
+
+static inline void irq_disable(void) { __asm__ __volatile__("cli" : : : "memory"); }
+
+// Atomically enables interrupts and halts until the next one arrives.
+// `sti` only takes effect after the following instruction, so an IRQ can't
+// slip in between the caller's last check and the `hlt`.
+static inline void irq_enable_and_wait(void)
+{
+  __asm__ __volatile__("sti; hlt" : : : "memory");
+}
+
+// ===== PIC =====
+static void pic_remap(void)
+{
+  outb(PIC1_COMMAND, 0x11); // ICW1: init, expect ICW4
+  outb(PIC2_COMMAND, 0x11);
+  outb(PIC1_DATA, IRQ_VECTOR_BASE);     // ICW2: vector offsets
+  outb(PIC2_DATA, IRQ_VECTOR_BASE + 8);
+  outb(PIC1_DATA, 0x04); // ICW3: slave on IRQ2
+  outb(PIC2_DATA, 0x02);
+  outb(PIC1_DATA, 0x01); // ICW4: 8086 mode
+  outb(PIC2_DATA, 0x01);
+
+  // Everything masked except the cascade; drivers unmask their own lines
+  outb(PIC1_DATA, 0xFB);
+  outb(PIC2_DATA, 0xFF);
+}
+
+static void pic_unmask(int irq)
+{
+  uint16_t port = irq < 8 ? PIC1_DATA : PIC2_DATA;
+  outb(port, inb(port) & ~(1 << (irq & 7)));
+}
+
+static uint16_t pic_read_isr(void)
+{
+  outb(PIC1_COMMAND, PIC_READ_ISR);
+  outb(PIC2_COMMAND, PIC_READ_ISR);
+  return ((uint16_t)inb(PIC2_COMMAND) << 8) | inb(PIC1_COMMAND);
+}
+
+// Called from the boot.asm stubs with interrupts disabled
+void irq_dispatch(uint32_t irq)
+{
+  // IRQ7/IRQ15 may be spurious: then the ISR bit is not set and no EOI
+  // (or only the cascade EOI) must be sent
+  if ((irq == 7 || irq == 15) && !(pic_read_isr() & (1 << irq)))
+  {
+    if (irq == 15)
+      outb(PIC1_COMMAND, PIC_EOI);
+    return;
+  }
+
+  for (int i = 0; i < IRQ_MAX_SHARED && irq_handlers[irq][i]; i++)
+    irq_handlers[irq][i](irq);
+
+  if (irq >= 8)
+    outb(PIC2_COMMAND, PIC_EOI);
+  outb(PIC1_COMMAND, PIC_EOI);
+}
+
+// Adds `handler` to the line and unmasks it. Returns 0, or 1 if the line
+// already has IRQ_MAX_SHARED handlers.
+int irq_install(int irq, irq_handler_t handler)
+{
+  irq_flags_t flags = irq_save();
+  int i = 0;
+
+  while (i < IRQ_MAX_SHARED && irq_handlers[irq][i] &&
+         irq_handlers[irq][i] != handler)
+    i++;
+
+  if (i == IRQ_MAX_SHARED)
+  {
+    irq_restore(flags);
+    return 1;
+  }
+
+  irq_handlers[irq][i] = handler;
+  pic_unmask(irq);
+  irq_restore(flags);
+  return 0;
+}
+
+static void idt_set_gate(uint8_t vector, uint32_t handler, uint16_t selector)
+{
+  idt[vector].offset_low = handler & 0xFFFF;
+  idt[vector].selector = selector;
+  idt[vector].zero = 0;
+  idt[vector].type_attr = 0x8E; // present, ring 0, 32-bit interrupt gate
+  idt[vector].offset_high = handler >> 16;
+}
+
+// Installs the IRQ gates and remaps the PICs. Interrupts stay disabled until
+// the caller runs irq_enable().
+void idt_init(void)
+{
+  uint16_t cs;
+  __asm__ __volatile__("mov %%cs, %0" : "=r"(cs));
+
+  for (int i = 0; i < 16; i++)
+    idt_set_gate(IRQ_VECTOR_BASE + i, irq_stub_table[i], cs);
+
+  idt_ptr_t idtr;
+  idtr.limit = sizeof(idt) - 1;
+  idtr.base = (uint32_t)idt;
+  __asm__ __volatile__("lidt %0" : : "m"(idtr));
+
+  pic_remap();
+  irqs_ready = 1;
+}
@@ -29,6 +29,23 @@ static inline void outw(unsigned short port, unsigned short data) {
                    : "a"(data), "dN"(port)); // dane w AX, port w DX
 }
 
+// Read __n 16-bit words from an I/O port into __buf (rep insw)
+static __inline void insw(uint16_t __port, void *__buf, unsigned long __n) {
+  __asm__ __volatile__("cld; rep; insw"
+                       : "+D"(__buf), "+c"(__n)
+                       : "d"(__port)
+                       : "memory");
+}
+
+// Write __n 16-bit words from __buf to an I/O port (rep outsw)
+static __inline__ void outsw(uint16_t __port, const void *__buf,
+                             unsigned long __n) {
+  __asm__ __volatile__("cld; rep; outsw"
+                       : "+S"(__buf), "+c"(__n)
+                       : "d"(__port)
+                       : "memory");
+}
+
 static inline unsigned int inl(unsigned short port) {
   unsigned int result;
   __asm__ volatile("inl %1, %0" : "=a"(result) : "dN"(port));
@@ -39,10 +56,35 @@ static inline void outl(unsigned short port, unsigned int data) {
   __asm__ volatile("outl %0, %1" : : "a"(data), "dN"(port));
 }
 
+// Memory-mapped device registers. Paging is off, so the physical address
+// from a PCI BAR is used directly.
+static inline uint32_t mmio_read32(uint32_t addr) {
+  return *(volatile uint32_t *)addr;
+}
+
+static inline void mmio_write32(uint32_t addr, uint32_t value) {
+  *(volatile uint32_t *)addr = value;
+}
+
+// Compiler barrier: keeps memory accesses (DMA descriptors, buffers) from
+// being reordered across port I/O that starts or finishes a transfer
+static inline void io_barrier(void) { __asm__ __volatile__("" ::: "memory"); }
+
+// Full memory barrier: also keeps a store from passing a later load, which
+// shared-memory rings (virtio) need. Works on every x86, unlike mfence.
+static inline void io_mb(void) {
+  __asm__ __volatile__("lock; addl $0, (%%esp)" ::: "memory", "cc");
+}
+
+// Background work to run while waiting for a key (e.g. flushing the block
+// cache). May be NULL.
+void (*io_idle_hook)(void);
+
 uint8_t read_scancode() {
   // czekaj, aż PS/2 kontroler ma dane (bit 0 w porcie 0x64)
   while (!(inb(0x64) & 1))
-    ;
+    if (io_idle_hook)
+      io_idle_hook();
   return inb(0x60);
 }
 
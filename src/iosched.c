@@ -0,0 +1,378 @@
+#pragma once
+
+#include "block.c"
+#include "idt.c"
+#include "timer.c"
+#include "utils.c"
+#include <stdint.h>
+
+// ===== Elevator I/O scheduler =====
+// Sits between the filesystems and a block driver. Queued requests are kept
+// sorted by LBA and dispatched in C-LOOK order: upwards from where the last
+// dispatch ended, then back to the lowest pending LBA. Requests directly
+// behind the chosen one (same direction, contiguous LBAs) are merged into
+// the same command. Each request also has a deadline; expired ones go
+// first, so a stream of writes near the head can't starve a read elsewhere.
+//
+// Overlapping requests are never reordered: a read fully covered by a
+// queued write is answered from that write's buffer, a write to exactly
+// the range of a queued write replaces it, and any other overlap drains the
+// queue before the new request is accepted. Discards are never merged and
+// count as a write of the span they cover.
+//
+// A cache flush is a barrier: it is dispatched only once nothing else is
+// in flight, and nothing is dispatched next to it. blk_flush() also
+// drains the queue first, so the flush covers every earlier write.
+
+#define IOSCHED_READ_DEADLINE_MS 50
+#define IOSCHED_WRITE_DEADLINE_MS 500
+#define IOSCHED_MAX_IN_FLIGHT 32
+
+typedef struct iosched
+{
+  blkdev_t *dev;
+
+  blk_request_t *pending; // sorted by LBA, linked through `next`
+  uint32_t depth;
+
+  blk_request_t *in_flight[IOSCHED_MAX_IN_FLIGHT]; // dispatched chain heads
+  uint32_t in_flight_count;
+  uint32_t max_in_flight; // commands the driver may hold at once
+
+  uint64_t head_lba; // where the last dispatch ended
+  uint8_t plugged;
+  uint8_t barrier; // a flush is in flight
+
+  // Statistics
+  uint32_t submitted;
+  uint32_t dispatched;    // commands handed to the driver
+  uint32_t merges;        // requests merged into (or replaced by) another
+  uint32_t forwarded;     // reads answered from a queued write
+  uint64_t depth_sum;     // queue depth found by each submit
+  uint32_t latency_count; // requests dispatched
+  uint64_t latency_sum;   // TSC cycles from submit to dispatch
+  uint64_t latency_max;
+} iosched_t;
+
+void iosched_attach(blkdev_t *dev, iosched_t *sched, uint32_t max_in_flight)
+{
+  memset(sched, 0, sizeof(*sched));
+
+  if (max_in_flight == 0)
+    max_in_flight = 1;
+  if (max_in_flight > IOSCHED_MAX_IN_FLIGHT)
+    max_in_flight = IOSCHED_MAX_IN_FLIGHT;
+
+  sched->dev = dev;
+  sched->max_in_flight = max_in_flight;
+  dev->sched = sched;
+}
+
+static int iosched_overlaps(const blk_request_t *a, const blk_request_t *b)
+{
+  return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+// Link of the request to dispatch next: the most overdue one if any
+// deadline expired, otherwise C-LOOK order
+static blk_request_t **iosched_pick(iosched_t *sched, uint64_t now)
+{
+  blk_request_t **overdue = NULL;
+  blk_request_t **ahead = NULL;
+
+  for (blk_request_t **link = &sched->pending; *link; link = &(*link)->next)
+  {
+    blk_request_t *r = *link;
+
+    if (r->deadline <= now && (!overdue || r->deadline < (*overdue)->deadline))
+      overdue = link;
+    if (!ahead && r->lba >= sched->head_lba)
+      ahead = link;
+  }
+
+  if (overdue)
+    return overdue;
+  if (ahead)
+    return ahead;
+  return &sched->pending; // wrap around to the lowest LBA
+}
+
+// Hands requests to the driver while it has room. Interrupts disabled.
+static void iosched_dispatch(iosched_t *sched)
+{
+  uint64_t now = timer_now();
+  uint32_t dispatched = sched->dispatched;
+
+  while (!sched->plugged && !sched->barrier && sched->pending &&
+         sched->in_flight_count < sched->max_in_flight)
+  {
+    blk_request_t **link = iosched_pick(sched, now);
+    blk_request_t *head = *link;
+
+    if (head->flush)
+    {
+      if (sched->in_flight_count)
+        break; // wait for the device to go idle
+      sched->barrier = 1;
+    }
+    blk_request_t *tail = head;
+    uint32_t total = head->count;
+    uint32_t segments = 1;
+    uint32_t max_segments = sched->dev->max_segments;
+
+    *link = head->next;
+    head->next = NULL;
+    sched->depth--;
+
+    // The list is sorted, so mergeable requests follow directly
+    while (*link)
+    {
+      blk_request_t *n = *link;
+
+      if (n->write != head->write || n->nr_ranges || head->nr_ranges ||
+          n->flush || head->flush ||
+          n->lba != tail->lba + tail->count ||
+          total + n->count > sched->dev->max_sectors ||
+          (max_segments && segments == max_segments))
+        break;
+
+      *link = n->next;
+      n->next = NULL;
+      sched->depth--;
+
+      tail->merge_next = n;
+      tail = n;
+      total += n->count;
+      segments++;
+      sched->merges++;
+    }
+
+    for (blk_request_t *r = head; r; r = r->merge_next)
+    {
+      uint64_t latency = now - r->queued_at;
+
+      sched->latency_count++;
+      sched->latency_sum += latency;
+      if (latency > sched->latency_max)
+        sched->latency_max = latency;
+    }
+
+    for (uint32_t i = 0; i < IOSCHED_MAX_IN_FLIGHT; i++)
+    {
+      if (!sched->in_flight[i])
+      {
+        sched->in_flight[i] = head;
+        break;
+      }
+    }
+    sched->in_flight_count++;
+    sched->head_lba = tail->lba + tail->count;
+    sched->dispatched++;
+
+    sched->dev->submit(sched->dev, head);
+  }
+
+  if (sched->dispatched != dispatched && sched->dev->kick)
+    sched->dev->kick(sched->dev);
+}
+
+// Called through blk_complete() when a dispatched chain finishes
+void iosched_completed(iosched_t *sched, blk_request_t *head)
+{
+  if (head->flush)
+    sched->barrier = 0;
+
+  for (uint32_t i = 0; i < IOSCHED_MAX_IN_FLIGHT; i++)
+  {
+    if (sched->in_flight[i] == head)
+    {
+      sched->in_flight[i] = NULL;
+      sched->in_flight_count--;
+      break;
+    }
+  }
+
+  iosched_dispatch(sched);
+}
+
+#define IOSCHED_ACCEPT 0
+#define IOSCHED_ANSWERED 1
+#define IOSCHED_CONFLICT 2
+
+// Resolves overlaps between `req` and everything queued or in flight.
+// Interrupts disabled.
+static int iosched_check_overlaps(iosched_t *sched, blk_request_t *req)
+{
+  uint32_t ss = sched->dev->sector_size;
+  blk_request_t **link = &sched->pending;
+
+  while (*link)
+  {
+    blk_request_t *r = *link;
+
+    if (!iosched_overlaps(r, req) || (!r->write && !req->write))
+    {
+      link = &r->next;
+      continue;
+    }
+
+    if (!req->write)
+    {
+      // Read behind a queued write: the write holds the newest data
+      if (!r->nr_ranges && r->lba <= req->lba &&
+          req->lba + req->count <= r->lba + r->count)
+      {
+        memcpy(req->buffer, (uint8_t *)r->buffer + (req->lba - r->lba) * ss,
+               req->count * ss);
+        sched->forwarded++;
+        blk_complete(NULL, req, 0);
+        return IOSCHED_ANSWERED;
+      }
+      return IOSCHED_CONFLICT;
+    }
+
+    if (r->write && !r->nr_ranges && !req->nr_ranges && r->lba == req->lba &&
+        r->count == req->count)
+    {
+      // Rewrite of the same range before it went out: drop the old one.
+      // Not for discards: their span also covers the gaps between ranges.
+      *link = r->next;
+      r->next = NULL;
+      sched->depth--;
+      sched->merges++;
+      blk_complete(NULL, r, 0);
+      continue;
+    }
+
+    return IOSCHED_CONFLICT;
+  }
+
+  // The device may reorder what it already has, so any overlap with an
+  // in-flight write (or a write over an in-flight read) must wait
+  for (uint32_t i = 0; i < IOSCHED_MAX_IN_FLIGHT; i++)
+  {
+    for (blk_request_t *r = sched->in_flight[i]; r; r = r->merge_next)
+    {
+      if (iosched_overlaps(r, req) && (r->write || req->write))
+        return IOSCHED_CONFLICT;
+    }
+  }
+
+  return IOSCHED_ACCEPT;
+}
+
+// Dispatches everything and waits until the device is idle.
+// Called with interrupts enabled.
+static void iosched_drain(iosched_t *sched)
+{
+  uint64_t deadline = timer_now() + timer_ms_to_cycles(BLK_TIMEOUT_MS);
+
+  iosched_unplug(sched);
+
+  for (;;)
+  {
+    irq_disable();
+
+    if (!sched->depth && !sched->in_flight_count)
+      break;
+
+    if (timer_now() > deadline)
+    {
+      sched->dev->abort(sched->dev);
+      deadline = timer_now() + timer_ms_to_cycles(BLK_TIMEOUT_MS);
+    }
+
+    if (irqs_ready)
+      irq_enable_and_wait();
+    irq_disable();
+    sched->dev->poll(sched->dev);
+    irq_enable();
+  }
+
+  irq_enable();
+}
+
+// Entry point from blk_submit(), interrupts enabled
+void iosched_submit(iosched_t *sched, blk_request_t *req)
+{
+  uint32_t ms = req->write ? IOSCHED_WRITE_DEADLINE_MS : IOSCHED_READ_DEADLINE_MS;
+  req->deadline = req->queued_at + timer_ms_to_cycles(ms);
+
+  irq_flags_t flags = irq_save();
+
+  sched->submitted++;
+  sched->depth_sum += sched->depth;
+
+  int r = iosched_check_overlaps(sched, req);
+  if (r == IOSCHED_ANSWERED)
+  {
+    irq_restore(flags);
+    return;
+  }
+
+  if (r == IOSCHED_CONFLICT)
+  {
+    irq_restore(flags);
+    iosched_drain(sched);
+    flags = irq_save();
+  }
+
+  // Insert sorted by LBA (after equal LBAs, keeping submit order)
+  blk_request_t **link = &sched->pending;
+  while (*link && (*link)->lba <= req->lba)
+    link = &(*link)->next;
+  req->next = *link;
+  *link = req;
+  sched->depth++;
+
+  iosched_dispatch(sched);
+  irq_restore(flags);
+}
+
+// While plugged, requests are only queued (and merged), not dispatched.
+// The queue is unplugged explicitly or as soon as somebody waits on one of
+// its requests.
+void iosched_plug(iosched_t *sched) { sched->plugged = 1; }
+
+void iosched_unplug(iosched_t *sched)
+{
+  irq_flags_t flags = irq_save();
+  sched->plugged = 0;
+  iosched_dispatch(sched);
+  irq_restore(flags);
+}
+
+void blk_plug(blkdev_t *dev)
+{
+  if (dev->sched)
+    iosched_plug(dev->sched);
+}
+
+void blk_unplug(blkdev_t *dev)
+{
+  if (dev->sched)
+    iosched_unplug(dev->sched);
+}
+
+// Write barrier: waits for every queued write, then has the device commit
+// its write cache. Only devices with a volatile cache and something
+// written since the last flush get the command. Interrupts enabled.
+// Returns 0 on success.
+int blk_flush(blkdev_t *dev)
+{
+  if (dev->sched)
+    iosched_drain(dev->sched);
+
+  if (!dev->write_cache || !dev->unflushed)
+    return 0;
+
+  blk_request_t req = {0};
+  req.flush = 1;
+
+  blk_submit(dev, &req);
+  if (blk_wait(dev, &req))
+    return 1; // still unflushed: the next sync tries again
+
+  dev->unflushed = 0;
+  return 0;
+}
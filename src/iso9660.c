@@ -1,4 +1,6 @@
 #include <stdint.h>
+#include "bcache.c"
+#include "lz4.c"
 #include "memory.c"
 
 #define SECTOR_SIZE 2048
@@ -18,13 +20,31 @@ static uint32_t read32(const uint8_t *p)
     return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
 }
 
-// Czytaj sektor jako raw bajty
+extern blkdev_t atapi_blkdev;
+
+// Czytaj sektor jako raw bajty (przez cache bloków)
 static uint8_t *read_sector_iso9660(uint32_t lba)
 {
-    atapi_read_sector(lba, sector_buffer);
+    bcache_read(&atapi_blkdev, lba, 1, sector_buffer);
     return (uint8_t *)sector_buffer;
 }
 
+// Czytaj cały katalog (extent) jednym żądaniem; bufor zwalnia wywołujący
+static uint8_t *read_extent_iso9660(uint32_t lba, uint32_t sectors)
+{
+    uint8_t *data = (uint8_t *)malloc(sectors * SECTOR_SIZE);
+    if (!data)
+        return NULL;
+
+    if (bcache_read(&atapi_blkdev, lba, sectors, data))
+    {
+        free(data);
+        return NULL;
+    }
+
+    return data;
+}
+
 static uint8_t names_equal(const char *a, const char *b, uint8_t b_len)
 {
     for (uint8_t i = 0; i < b_len; i++)
@@ -37,6 +57,157 @@ static uint8_t names_equal(const char *a, const char *b, uint8_t b_len)
     return a[b_len] == 0;
 }
 
+// -----------------------------------------------
+//      INDEKS TABLICY ŚCIEŻEK (PATH TABLE)
+// -----------------------------------------------
+// Tablica ścieżek typu L (z PVD) opisuje wszystkie katalogi płyty:
+// numer rodzica, nazwę i extent. Przy montowaniu trafia w całości do
+// pamięci jako tablica haszująca (rodzic, nazwa) -> katalog, więc
+// rozwiązywanie ścieżek nie czyta nic z płyty. Tablica nie zawiera
+// rozmiarów katalogów; rozmiar jest brany z rekordu "." przy pierwszym
+// użyciu katalogu (ten sektor i tak jest potem czytany).
+
+#define ISO_DIR_BUCKETS 256
+#define ISO_PATH_TABLE_MAX (64 * 1024) // większe tablice: chodzenie po katalogach
+
+typedef struct
+{
+    uint32_t lba;
+    uint32_t size;       // bajty, 0 = jeszcze nieznany
+    uint16_t parent;     // numer katalogu rodzica (od 1)
+    uint16_t hash_next;  // następny w kubełku (indeks + 1, 0 = koniec)
+    uint8_t name_len;
+    const char *name;    // wskazuje do wczytanej tablicy ścieżek
+} iso_dir_t;
+
+typedef struct
+{
+    uint8_t mounted;
+    uint32_t root_lba;
+    uint32_t root_size;
+    uint8_t *path_table;
+    iso_dir_t *dirs; // dirs[0] = katalog nr 1 (root)
+    uint32_t dir_count;
+    uint16_t buckets[ISO_DIR_BUCKETS];
+} iso_volume_t;
+
+static iso_volume_t iso;
+
+static uint32_t iso_hash(uint32_t parent, const char *name, uint32_t len)
+{
+    uint32_t h = 2166136261u ^ parent; // FNV-1a
+    for (uint32_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    return h % ISO_DIR_BUCKETS;
+}
+
+// Wczytuje tablicę ścieżek i buduje indeks. Przy błędzie indeks zostaje
+// pusty, a iso_open_path wraca do przeglądania rekordów katalogów.
+static void iso_load_path_table(uint32_t lba, uint32_t size)
+{
+    if (size == 0 || size > ISO_PATH_TABLE_MAX)
+        return;
+
+    uint32_t sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint8_t *table = (uint8_t *)malloc(sectors * SECTOR_SIZE);
+    if (!table)
+        return;
+
+    if (bcache_read(&atapi_blkdev, lba, sectors, table))
+    {
+        free(table);
+        return;
+    }
+
+    // Rekord: len_di, ext_attr_len, extent (4), rodzic (2), nazwa, pad
+    uint32_t count = 0;
+    for (uint32_t pos = 0; pos + 8 <= size && table[pos]; pos += 8 + table[pos] + (table[pos] & 1))
+        count++;
+
+    iso_dir_t *dirs = count ? (iso_dir_t *)malloc(count * sizeof(iso_dir_t)) : NULL;
+    if (!dirs)
+    {
+        free(dirs);
+        free(table);
+        return;
+    }
+
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        iso_dir_t *d = &dirs[i];
+
+        d->name_len = table[pos];
+        d->lba = read32(table + pos + 2);
+        d->parent = (uint16_t)(table[pos + 6] | (table[pos + 7] << 8));
+        d->name = (const char *)(table + pos + 8);
+        d->size = 0;
+        d->hash_next = 0;
+
+        // Root (nazwa 0x00) nie jest nigdy szukany po nazwie
+        if (i > 0)
+        {
+            uint32_t b = iso_hash(d->parent, d->name, d->name_len);
+            d->hash_next = iso.buckets[b];
+            iso.buckets[b] = (uint16_t)(i + 1);
+        }
+
+        pos += 8 + d->name_len + (d->name_len & 1);
+    }
+
+    dirs[0].size = iso.root_size;
+    iso.path_table = table;
+    iso.dirs = dirs;
+    iso.dir_count = count;
+}
+
+// Czyta PVD i indeks katalogów. Zwraca 0 gdy płyta jest zamontowana.
+uint8_t iso_mount(void)
+{
+    if (iso.mounted)
+        return 0;
+
+    uint8_t *pvd = read_sector_iso9660(16);
+    if (pvd[0] != 1 || pvd[1] != 'C' || pvd[2] != 'D' || pvd[3] != '0' || pvd[4] != '0' || pvd[5] != '1')
+        return 1;
+
+    uint32_t table_size = read32(pvd + 132);
+    uint32_t table_lba = read32(pvd + 140); // tablica typu L
+    iso.root_lba = read32(pvd + 156 + 2);
+    iso.root_size = read32(pvd + 156 + 10);
+
+    iso_load_path_table(table_lba, table_size);
+    iso.mounted = 1;
+    return 0;
+}
+
+// Numer katalogu (od 1) o nazwie `name` w katalogu `parent`, 0 gdy brak
+static uint32_t iso_index_lookup(uint32_t parent, const char *name, uint32_t len)
+{
+    uint16_t i = iso.buckets[iso_hash(parent, name, len)];
+
+    while (i)
+    {
+        iso_dir_t *d = &iso.dirs[i - 1];
+        if (d->parent == parent && d->name_len == len && memcmp(d->name, name, len) == 0)
+            return i;
+        i = d->hash_next;
+    }
+
+    return 0;
+}
+
+// Rozmiar katalogu z jego rekordu "." (pierwszy wpis extentu)
+static uint32_t iso_index_size(uint32_t num)
+{
+    iso_dir_t *d = &iso.dirs[num - 1];
+
+    if (d->size == 0)
+        d->size = read32(read_sector_iso9660(d->lba) + 10);
+
+    return d->size;
+}
+
 // -----------------------------------------------
 //      LISTOWANIE PLIKÓW ISO9660
 // -----------------------------------------------
@@ -61,7 +232,13 @@ void list_cd_files()
     uint32_t root_size = read32(root + 10); // Size in bytes
 
     // Liczba sektorów katalogu
-    uint32_t root_sectors = root_size / SECTOR_SIZE + 1;
+    uint32_t root_sectors = root_size / SECTOR_SIZE;
+    if (root_size % SECTOR_SIZE)
+        root_sectors++;
+
+    uint8_t *root_data = read_extent_iso9660(root_lba, root_sectors);
+    if (!root_data)
+        return;
 
     print("Lista plikow:");
 
@@ -71,7 +248,7 @@ void list_cd_files()
     for (uint32_t s = 0; s < root_sectors; s++)
     {
 
-        uint8_t *dir = read_sector_iso9660(root_lba + s);
+        uint8_t *dir = root_data + s * SECTOR_SIZE;
         uint32_t pos = 0;
 
         while (pos < SECTOR_SIZE)
@@ -106,6 +283,8 @@ void list_cd_files()
             pos += len;
         }
     }
+
+    free(root_data);
 }
 
 void iso_list_directory(uint32_t dir_lba, uint32_t dir_size)
@@ -114,10 +293,14 @@ void iso_list_directory(uint32_t dir_lba, uint32_t dir_size)
     if (dir_size % SECTOR_SIZE)
         sectors++;
 
+    uint8_t *extent = read_extent_iso9660(dir_lba, sectors);
+    if (!extent)
+        return;
+
     for (uint32_t s = 0; s < sectors; s++)
     {
 
-        uint8_t *buf = read_sector_iso9660(dir_lba + s);
+        uint8_t *buf = extent + s * SECTOR_SIZE;
         uint32_t pos = 0;
 
         while (pos < SECTOR_SIZE)
@@ -157,12 +340,29 @@ void iso_list_directory(uint32_t dir_lba, uint32_t dir_size)
             pos += len;
         }
     }
+
+    free(extent);
 }
 
-uint8_t iso_find_directory(
+// Nazwa pliku bez wersji (";1") i bez kropki na końcu ("README.;1")
+static uint8_t file_name_equal(const char *a, const char *b, uint8_t b_len)
+{
+    uint8_t n = 0;
+    while (n < b_len && b[n] != ';')
+        n++;
+    if (n > 0 && b[n - 1] == '.')
+        n--;
+
+    return names_equal(a, b, n);
+}
+
+// Szuka wpisu `name` w katalogu: podkatalogu gdy want_dir, pliku w
+// przeciwnym razie
+static uint8_t iso_find_record(
     uint32_t dir_lba,
     uint32_t dir_size,
     const char *name,
+    uint8_t want_dir,
     uint32_t *out_lba,
     uint32_t *out_size)
 {
@@ -170,9 +370,13 @@ uint8_t iso_find_directory(
     if (dir_size % SECTOR_SIZE)
         sectors++;
 
+    uint8_t *extent = read_extent_iso9660(dir_lba, sectors);
+    if (!extent)
+        return 0;
+
     for (uint32_t s = 0; s < sectors; s++)
     {
-        uint8_t *buf = read_sector_iso9660(dir_lba + s);
+        uint8_t *buf = extent + s * SECTOR_SIZE;
         uint32_t pos = 0;
 
         while (pos < SECTOR_SIZE)
@@ -193,10 +397,14 @@ uint8_t iso_find_directory(
             {
 
                 // porównanie
-                if ((flags & 0x02) && names_equal(name, rec_name, name_len))
+                uint8_t is_dir = (flags & 0x02) != 0;
+                if (is_dir == want_dir &&
+                    (is_dir ? names_equal(name, rec_name, name_len)
+                            : file_name_equal(name, rec_name, name_len)))
                 {
                     *out_lba = read32(rec + 2);
                     *out_size = read32(rec + 10);
+                    free(extent);
                     return 1;
                 }
             }
@@ -204,9 +412,21 @@ uint8_t iso_find_directory(
             pos += len;
         }
     }
+
+    free(extent);
     return 0;
 }
 
+uint8_t iso_find_directory(
+    uint32_t dir_lba,
+    uint32_t dir_size,
+    const char *name,
+    uint32_t *out_lba,
+    uint32_t *out_size)
+{
+    return iso_find_record(dir_lba, dir_size, name, 1, out_lba, out_size);
+}
+
 void iso_list_directory_by_name(
     uint32_t parent_lba,
     uint32_t parent_size,
@@ -247,6 +467,7 @@ uint8_t iso_open_path(
 
     uint32_t cur_lba = root_lba;
     uint32_t cur_size = root_size;
+    uint32_t cur_num = 1; // numer w indeksie, gdy jest załadowany
 
     const char *p = path;
 
@@ -271,7 +492,13 @@ uint8_t iso_open_path(
         part[part_len] = 0;
 
         // Jeśli komponent nie jest pusty — schodzimy w katalog:
-        if (part_len > 0)
+        if (part_len > 0 && iso.dirs && root_lba == iso.root_lba)
+        {
+            cur_num = iso_index_lookup(cur_num, part, part_len);
+            if (!cur_num)
+                return 0; // katalog nie istnieje
+        }
+        else if (part_len > 0)
         {
             uint32_t new_lba, new_size;
 
@@ -293,6 +520,12 @@ uint8_t iso_open_path(
             p++;
     }
 
+    if (iso.dirs && root_lba == iso.root_lba)
+    {
+        cur_lba = iso.dirs[cur_num - 1].lba;
+        cur_size = iso_index_size(cur_num);
+    }
+
     *out_lba = cur_lba;
     *out_size = cur_size;
 
@@ -300,14 +533,13 @@ uint8_t iso_open_path(
 }
 
 void iso_list_by_path(const char *path) {
-    uint8_t *pvd = read_sector_iso9660(16);
-    uint8_t *root = pvd + 156;
-
-    uint32_t root_lba  = read32(root + 2);
-    uint32_t root_size = read32(root + 10);
+    if (iso_mount()) {
+        terminal_writestring("No ISO9660 disc\n");
+        return;
+    }
 
     uint32_t lba, size;
-    if (!iso_open_path(path, root_lba, root_size, &lba, &size)) {
+    if (!iso_open_path(path, iso.root_lba, iso.root_size, &lba, &size)) {
         terminal_writestring("Path doesn't exists: ");
         terminal_writestring(path);
         terminal_writestring("\n");
@@ -317,9 +549,6 @@ void iso_list_by_path(const char *path) {
     iso_list_directory(lba, size);
 }
 
-// Prototyp funkcji do odczytu pojedynczego sektora (2048 bajtów)
-void atapi_read_sector(uint32_t lba, uint16_t *buffer);
-
 uint8_t* atapi_read_file(uint32_t start_lba, uint32_t sectors_count)
 {
     if (sectors_count == 0)
@@ -330,22 +559,122 @@ uint8_t* atapi_read_file(uint32_t start_lba, uint32_t sectors_count)
     if (!file_data)
         return NULL; // błąd alokacji
 
-    // Bufor pośredni do odczytu sektora jako 16-bitowych słów
-    uint16_t sector_buffer[1024];
+    // Sektory trafiają prosto do bufora pliku; duże pliki omijają cache
+    if (bcache_read(&atapi_blkdev, start_lba, sectors_count, file_data))
+    {
+        free(file_data);
+        return NULL;
+    }
+
+    return file_data;
+}
+
+// -----------------------------------------------
+//      STRUMIENIOWE CZYTANIE PLIKÓW
+// -----------------------------------------------
+// Plik ISO9660 to jeden ciągły extent. iso_read czyta całe sektory prosto
+// do bufora wywołującego (bez kopii i bez alokacji całego pliku); przez
+// sector_buffer idą tylko niepełne sektory na początku i końcu.
+
+typedef struct
+{
+    uint32_t lba;  // pierwszy sektor extentu
+    uint32_t size; // bajty
+    uint32_t pos;  // bieżąca pozycja
+} iso_file_t;
 
-    for (uint32_t i = 0; i < sectors_count; i++)
+// Otwiera plik po ścieżce ("/DIR/FILE.TXT"). Zwraca 1 gdy znaleziono.
+uint8_t iso_open(const char *path, iso_file_t *file)
+{
+    if (iso_mount())
+        return 0;
+
+    // Podział na katalog i nazwę pliku
+    const char *name = path;
+    for (const char *p = path; *p; p++)
     {
-        atapi_read_sector(start_lba + i, sector_buffer);
+        if (*p == '/')
+            name = p + 1;
+    }
+    if (*name == 0)
+        return 0;
+
+    static char dir_path[256];
+    uint32_t dir_len = (uint32_t)(name - path);
+    if (dir_len >= sizeof(dir_path))
+        return 0;
+    memcpy(dir_path, path, dir_len);
+    dir_path[dir_len] = 0;
+
+    uint32_t dir_lba, dir_size;
+    if (!iso_open_path(dir_path, iso.root_lba, iso.root_size, &dir_lba, &dir_size))
+        return 0;
+
+    if (!iso_find_record(dir_lba, dir_size, name, 0, &file->lba, &file->size))
+        return 0;
+
+    file->pos = 0;
+    return 1;
+}
+
+// Czyta do `len` bajtów od bieżącej pozycji. Zwraca liczbę bajtów
+// (0 na końcu pliku) albo -1 przy błędzie odczytu.
+int32_t iso_read(iso_file_t *file, void *buffer, uint32_t len)
+{
+    uint8_t *dst = (uint8_t *)buffer;
+    uint32_t done = 0;
+
+    if (len > file->size - file->pos)
+        len = file->size - file->pos;
 
-        // Kopiujemy sektor z sector_buffer (uint16_t) do file_data (uint8_t)
-        // ATAPI zwraca dane w little endian 16-bit - a my chcemy ciąg bajtów
-        for (int j = 0; j < 1024; j++)
+    while (done < len)
+    {
+        uint32_t lba = file->lba + file->pos / SECTOR_SIZE;
+        uint32_t offset = file->pos % SECTOR_SIZE;
+        uint32_t left = len - done;
+        uint32_t n;
+
+        if (offset == 0 && left >= SECTOR_SIZE)
         {
-            // Little endian 16-bit: niska pozycja = młodszy bajt
-            file_data[i * 2048 + j * 2]     = sector_buffer[j] & 0xFF;
-            file_data[i * 2048 + j * 2 + 1] = (sector_buffer[j] >> 8) & 0xFF;
+            // Całe sektory: prosto do bufora wywołującego
+            uint32_t sectors = left / SECTOR_SIZE;
+            if (bcache_read(&atapi_blkdev, lba, sectors, dst + done))
+                return -1;
+            n = sectors * SECTOR_SIZE;
         }
+        else
+        {
+            if (bcache_read(&atapi_blkdev, lba, 1, sector_buffer))
+                return -1;
+            n = SECTOR_SIZE - offset;
+            if (n > left)
+                n = left;
+            memcpy(dst + done, (uint8_t *)sector_buffer + offset, n);
+        }
+
+        done += n;
+        file->pos += n;
     }
 
-    return file_data;
+    return (int32_t)done;
+}
+
+static int32_t iso_lz4_read(void *ctx, void *buffer, uint32_t len)
+{
+    return iso_read((iso_file_t *)ctx, buffer, len);
+}
+
+// cat /cdrom/...: plik dowolnej wielkości, strumieniowo; pliki LZ4 są
+// rozpakowywane w locie
+void iso_cat(const char *path)
+{
+    iso_file_t file;
+
+    if (!iso_open(path, &file))
+    {
+        terminal_writestring("File not found.\n");
+        return;
+    }
+
+    lz4_cat(iso_lz4_read, &file);
 }
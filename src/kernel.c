@@ -5,28 +5,57 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
-#include "cdrom.c"
 #include "debug.c"
 #include "disk.c"
+#include "ahci.c"
+#include "virtio_blk.c"
 #include "split.c"
 #include "term.c"
 #include "utils.c"
 #include "iso9660.c"
 #include "fat32.c"
 #include "memory.c"
+#include "multiboot.c"
+#include "ramfs.c"
+#include "idt.c"
+#include "timer.c"
 #include "apps/nickfetch.c"
+#include "apps/dmabench.c"
+#include "apps/iostat.c"
+#include "apps/diskbench.c"
+#include "apps/lz4bench.c"
 
 bool logged;
 
-void kernel_main(void)
+void kernel_main(uint32_t multiboot_magic, uint32_t multiboot_info)
 {
+  multiboot_init(multiboot_magic, multiboot_info); // before the heap overwrites it
   init_heap();
   terminal_initialize();
   // terminal_writestring("Hello, kernel World!\r\n");
 
   DebugWriteString("Hello, world! From E9.\r\n");
 
-  fat32_init(0);
+  timer_init();
+  idt_init();
+  timer_start_tick();
+
+  ata_dma_init();
+  ata_init();
+  int sata = ahci_init();
+  int virtio = virtio_blk_init();
+  irq_enable();
+
+  // The file system lives on the fastest disk there is
+  blkdev_t *disk = &ata_blkdev;
+  if (virtio)
+    disk = &virtio_blkdev;
+  else if (sata)
+    disk = &ahci_blkdev;
+  if (fat32_init(disk, 0))
+    terminal_writestring("No usable FAT32 volume; /home is not mounted.\n");
+  ramfs_mount();
+  io_idle_hook = bcache_idle;
 
   terminal_writestring_format(
       "Welcome to $9Nick$4OS $70.0.0 build 2!\nPlease login as $1live user "
@@ -93,21 +122,46 @@ void kernel_main(void)
           ata_identify(&ataid);
 
           char nos[32];
-          itoa_bare(nos, sizeof(nos), ataid.sectors, 10);
+          u64toa_bare(nos, sizeof(nos), ataid.sectors48);
 
           char lss[32];
           itoa_bare(lss, sizeof(lss), ataid.logical_sector_size, 10);
 
           char pss[32];
-          itoa_bare(pss, sizeof(pss), ataid.sectors, 10);
+          itoa_bare(pss, sizeof(pss), ataid.physical_sector_size, 10);
 
           terminal_writestring("Number of sectors: ");
           terminal_writestring(nos);
           terminal_writestring("\n");
 
+          terminal_writestring("Sector size: ");
+          terminal_writestring(lss);
+          terminal_writestring(" logical, ");
+          terminal_writestring(pss);
+          terminal_writestring(" physical\n");
+
           terminal_writestring("Disk model: ");
           terminal_writestring(ataid.model);
           terminal_writestring("\n");
+
+          terminal_writestring("LBA48: ");
+          terminal_writestring(ataid.lba48 ? "yes\n" : "no\n");
+
+          terminal_writestring("Multiple mode: ");
+          if (ataid.multiple)
+          {
+            char mul[16];
+            itoa_bare(mul, sizeof(mul), ataid.multiple, 10);
+            terminal_writestring(mul);
+            terminal_writestring(" sectors per block (max ");
+            itoa_bare(mul, sizeof(mul), ataid.multiple_max, 10);
+            terminal_writestring(mul);
+            terminal_writestring(")\n");
+          }
+          else
+          {
+            terminal_writestring("off\n");
+          }
           // terminal_writestring("CD-ROM:\n");
           // char cdsize[32];
 
@@ -132,7 +186,11 @@ void kernel_main(void)
           {
             if (memcmp(fragments[1], "/cdrom/", 7) == 0 || memcmp(fragments[1], "/cdrom ", 7) == 0 || memcmp(fragments[1], "/cdrom\0", 7) == 0)
             {
-              // atapi_read_file()
+              iso_cat(fragments[1] + 6);
+            }
+            else if (memcmp(fragments[1], "/ram/", 5) == 0 || memcmp(fragments[1], "/ram\0", 5) == 0)
+            {
+              ramfs_cat(fragments[1] + 4);
             }
             else if (memcmp(fragments[1], "/home/", 6) == 0 || memcmp(fragments[1], "/home ", 6) == 0 || memcmp(fragments[1], "/home\0", 6) == 0)
             {
@@ -142,38 +200,46 @@ void kernel_main(void)
         }
         else if (strcmp(cmd, "ls") == 0)
         {
-          if (fragmentCount <= 1)
+          if (fragmentCount <= 1 || strcmp(fragments[1], "/") == 0)
           {
             terminal_writestring("/home\n");
             terminal_writestring("/cdrom\n");
+            if (ramfs.mounted)
+              terminal_writestring("/ram\n");
           }
-          else if (fragments[1][0] == '/')
+          else if (memcmp(fragments[1], "/cdrom/", 7) == 0 || memcmp(fragments[1], "/cdrom ", 7) == 0 || memcmp(fragments[1], "/cdrom\0", 7) == 0)
           {
-            terminal_writestring("/home\n");
-            terminal_writestring("/cdrom\n");
+            iso_list_by_path(fragments[1] + 6);
+          }
+          else if (memcmp(fragments[1], "/ram/", 5) == 0 || memcmp(fragments[1], "/ram\0", 5) == 0)
+          {
+            ramfs_ls(fragments[1] + 4);
+          }
+          else if (memcmp(fragments[1], "/home/", 6) == 0 || memcmp(fragments[1], "/home\0", 6) == 0)
+          {
+            fat32_ls_path(fragments[1] + 5);
           }
           else
           {
-            if (memcmp(fragments[1], "/cdrom/", 7) == 0 || memcmp(fragments[1], "/cdrom ", 7) == 0 || memcmp(fragments[1], "/cdrom\0", 7) == 0)
-            {
-              iso_list_by_path(fragments[1] + 6);
-            }
-            else if (memcmp(fragments[1], "/home/", 7) == 0 || memcmp(fragments[1], "/home ", 7) == 0 || memcmp(fragments[1], "/home\0", 6) == 0)
-            {
-              fat32_ls_path(fragments[1] + 5);
-            }
+            fat32_ls_path(fragments[1]);
           }
-          fat32_ls_path(fragments[1]);
         }
         else if (strcmp(cmd, "poweroff") == 0 ||
                  strcmp(cmd, "shutdown") == 0)
         {
+          bcache_sync();
           poweroff();
         }
         else if (strcmp(cmd, "reboot") == 0 || strcmp(cmd, "restart") == 0)
         {
+          bcache_sync();
           outb(0x64, 0xFE);
         }
+        else if (strcmp(cmd, "sync") == 0)
+        {
+          if (bcache_sync())
+            terminal_writestring("sync: write error\n");
+        }
         else if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "logout") == 0)
         {
           logged = false;
@@ -193,12 +259,40 @@ void kernel_main(void)
               "drive\nreboot - restarts a system\nrestart - alias for "
               "reboot\npoweroff - shutdowns a system\nshutdown - alias for "
               "poweroff\nexit - logs out from system\nlogout - alias for "
-              "exit\nls [path] - list files in given path (or root dir). Default path is /\ncat <path> - read file content and display");
+              "exit\nls [path] - list files in given path (or root dir). Default path is /\ncat <path> - read file content and display\n"
+              "dmabench - compares PIO and DMA disk read speed\n"
+              "iostat - shows I/O scheduler and block cache statistics\n"
+              "diskbench [device] [write <lba>] - measures raw disk "
+              "throughput and latency\n"
+              "lz4bench <path>... - measures file read throughput, "
+              "decompressing LZ4 files\n"
+              "sync - writes cached changes to disk\n"
+              "df - shows size and free space of the file system\n");
         }
         else if (strcmp(cmd, "nickfetch") == 0)
         {
           execute_nickfetch();
         }
+        else if (strcmp(cmd, "dmabench") == 0)
+        {
+          execute_dmabench();
+        }
+        else if (strcmp(cmd, "iostat") == 0)
+        {
+          execute_iostat();
+        }
+        else if (strcmp(cmd, "diskbench") == 0)
+        {
+          execute_diskbench(disk, fragmentCount, fragments);
+        }
+        else if (strcmp(cmd, "df") == 0)
+        {
+          fat32_df();
+        }
+        else if (strcmp(cmd, "lz4bench") == 0)
+        {
+          execute_lz4bench(fragmentCount, fragments);
+        }
         else
         {
           terminal_writestring("Command not found!\n");
@@ -0,0 +1,379 @@
+#pragma once
+
+#include "term.c"
+#include "utils.c"
+#include <stddef.h>
+#include <stdint.h>
+
+// ===== LZ4 frame decoder =====
+// Streaming decoder for the LZ4 frame format (what the `lz4` tool writes).
+// Compressed input is pulled through a read callback LZ4_IN_CHUNK bytes at
+// a time and output is produced in whatever amounts the caller asks for,
+// so neither the compressed nor the decompressed file is ever held whole.
+// Matches reach at most 64 KiB back, so the last 64 KiB of output are kept
+// in a ring that matches copy from; that covers both linked and
+// independent blocks. Block and content checksums are skipped, not
+// verified. Skippable and concatenated frames are handled.
+
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_SKIPPABLE_MAGIC 0x184D2A50 // low 4 bits vary
+#define LZ4_WINDOW 65536
+#define LZ4_IN_CHUNK (64 * 1024)
+
+// Reads up to `len` bytes of the source; returns the count, 0 at the end
+// or -1 on error
+typedef int32_t (*lz4_read_fn)(void *ctx, void *buffer, uint32_t len);
+
+typedef struct
+{
+  lz4_read_fn read;
+  void *ctx;
+  uint8_t in[LZ4_IN_CHUNK];
+  uint32_t in_pos;
+  uint32_t in_len;
+  uint32_t in_total; // source bytes read so far
+
+  uint8_t ring[LZ4_WINDOW]; // last 64 KiB of output
+  uint32_t ring_pos;        // output bytes so far (wraps in the ring)
+  uint8_t ring_full;
+
+  uint32_t block_max;
+  uint32_t block_left;   // block bytes not consumed yet
+  uint8_t in_block;
+  uint8_t block_checksum;
+  uint8_t content_checksum;
+
+  uint32_t literal_left;
+  uint8_t need_match; // literals of a sequence done, match not read yet
+  uint8_t match_token;
+  uint32_t match_left;
+  uint32_t match_offset;
+
+  uint8_t eof;
+  uint8_t done;
+} lz4_stream_t;
+
+static lz4_stream_t lz4_stream;
+
+int lz4_is_frame(const uint8_t *data, uint32_t len)
+{
+  return len >= 4 && (data[0] | (data[1] << 8) | (data[2] << 16) |
+                      ((uint32_t)data[3] << 24)) == LZ4_MAGIC;
+}
+
+// Returns 0 with more input buffered, 1 at the end of the source or on error
+static int lz4_refill(lz4_stream_t *s)
+{
+  int32_t n = s->read(s->ctx, s->in, LZ4_IN_CHUNK);
+  if (n <= 0)
+  {
+    s->eof = 1;
+    return 1;
+  }
+
+  s->in_pos = 0;
+  s->in_len = (uint32_t)n;
+  s->in_total += (uint32_t)n;
+  return 0;
+}
+
+static int lz4_byte(lz4_stream_t *s, uint8_t *b)
+{
+  if (s->in_pos == s->in_len && lz4_refill(s))
+    return 1;
+  *b = s->in[s->in_pos++];
+  return 0;
+}
+
+static int lz4_u32(lz4_stream_t *s, uint32_t *v)
+{
+  uint8_t b;
+
+  *v = 0;
+  for (int i = 0; i < 4; i++)
+  {
+    if (lz4_byte(s, &b))
+      return 1;
+    *v |= (uint32_t)b << (8 * i);
+  }
+  return 0;
+}
+
+static int lz4_skip(lz4_stream_t *s, uint32_t n)
+{
+  uint8_t b;
+
+  while (n--)
+  {
+    if (lz4_byte(s, &b))
+      return 1;
+  }
+  return 0;
+}
+
+// A byte of the current compressed block
+static int lz4_block_byte(lz4_stream_t *s, uint8_t *b)
+{
+  if (s->block_left == 0)
+    return 1;
+  s->block_left--;
+  return lz4_byte(s, b);
+}
+
+// LZ4 length: `n`, plus extension bytes while the nibble was 15
+static int lz4_length(lz4_stream_t *s, uint32_t n, uint32_t *len)
+{
+  uint8_t b = 255;
+
+  if (n == 15)
+  {
+    while (b == 255)
+    {
+      if (lz4_block_byte(s, &b))
+        return 1;
+      n += b;
+    }
+  }
+
+  *len = n;
+  return 0;
+}
+
+static int lz4_frame_header(lz4_stream_t *s)
+{
+  uint32_t magic, len;
+  uint8_t flg, bd;
+
+  for (;;)
+  {
+    if (lz4_u32(s, &magic))
+      return 1;
+    if ((magic & 0xFFFFFFF0) != LZ4_SKIPPABLE_MAGIC)
+      break;
+    if (lz4_u32(s, &len) || lz4_skip(s, len))
+      return 1;
+  }
+
+  if (magic != LZ4_MAGIC || lz4_byte(s, &flg) || lz4_byte(s, &bd))
+    return 1;
+
+  uint32_t max_id = (bd >> 4) & 7;
+  if ((flg >> 6) != 1 || max_id < 4)
+    return 1; // unknown version or block size
+
+  s->block_max = 1u << (8 + 2 * max_id); // 4 -> 64 KiB ... 7 -> 4 MiB
+  s->block_checksum = (flg & 0x10) != 0;
+  s->content_checksum = (flg & 0x04) != 0;
+
+  // Content size, dictionary ID, header checksum
+  return lz4_skip(s, ((flg & 0x08) ? 8 : 0) + ((flg & 0x01) ? 4 : 0) + 1);
+}
+
+// Reads the next block header; at the end of a frame moves on to the next
+// frame or marks the stream done
+static int lz4_next_block(lz4_stream_t *s)
+{
+  uint32_t size;
+
+  if (s->in_block)
+  {
+    s->in_block = 0;
+    if (s->block_checksum && lz4_skip(s, 4))
+      return 1;
+  }
+
+  if (lz4_u32(s, &size))
+    return 1;
+
+  if (size == 0) // end mark
+  {
+    if (s->content_checksum && lz4_skip(s, 4))
+      return 1;
+
+    if (s->in_pos == s->in_len && lz4_refill(s))
+    {
+      s->done = 1;
+      return 0;
+    }
+    return lz4_frame_header(s);
+  }
+
+  uint8_t raw = (size & 0x80000000) != 0;
+  size &= 0x7FFFFFFF;
+  if (size > s->block_max)
+    return 1;
+
+  s->in_block = 1;
+  s->block_left = size;
+  if (raw)
+    s->literal_left = size; // stored blocks are one long literal
+  return 0;
+}
+
+// Token and literal length of the next sequence
+static int lz4_sequence(lz4_stream_t *s)
+{
+  uint8_t token;
+
+  if (lz4_block_byte(s, &token) || lz4_length(s, token >> 4, &s->literal_left))
+    return 1;
+  if (s->literal_left > s->block_left)
+    return 1;
+
+  s->match_token = token & 15;
+  s->need_match = 1;
+  return 0;
+}
+
+// Offset and length of the match ending a sequence
+static int lz4_match(lz4_stream_t *s)
+{
+  uint8_t lo, hi;
+  uint32_t len;
+
+  if (lz4_block_byte(s, &lo) || lz4_block_byte(s, &hi))
+    return 1;
+
+  uint32_t offset = lo | ((uint32_t)hi << 8);
+  if (offset == 0 || (!s->ring_full && offset > s->ring_pos))
+    return 1;
+  if (lz4_length(s, s->match_token, &len))
+    return 1;
+
+  s->match_offset = offset;
+  s->match_left = len + 4;
+  s->need_match = 0;
+  return 0;
+}
+
+static void lz4_advance(lz4_stream_t *s, uint32_t n)
+{
+  s->ring_pos += n;
+  if (s->ring_pos >= LZ4_WINDOW)
+    s->ring_full = 1;
+}
+
+// Starts decoding from `read`. `prefix` holds bytes the caller has already
+// taken from the source (at most LZ4_IN_CHUNK). Returns 0 on success.
+int lz4_open(lz4_stream_t *s, lz4_read_fn read, void *ctx,
+             const void *prefix, uint32_t prefix_len)
+{
+  memset(s, 0, sizeof(*s));
+  s->read = read;
+  s->ctx = ctx;
+
+  if (prefix_len > LZ4_IN_CHUNK)
+    return 1;
+  memcpy(s->in, prefix, prefix_len);
+  s->in_len = prefix_len;
+  s->in_total = prefix_len;
+
+  return lz4_frame_header(s);
+}
+
+// Decompresses up to `len` bytes. Returns the count, 0 at the end of the
+// stream or -1 on corrupt or truncated input.
+int32_t lz4_read(lz4_stream_t *s, void *buffer, uint32_t len)
+{
+  uint8_t *out = (uint8_t *)buffer;
+  uint32_t done = 0;
+
+  while (done < len && !s->done)
+  {
+    if (s->match_left)
+    {
+      // Byte by byte: a match may overlap the bytes it produces
+      uint32_t n = s->match_left < len - done ? s->match_left : len - done;
+      uint32_t from = s->ring_pos - s->match_offset;
+
+      for (uint32_t i = 0; i < n; i++)
+      {
+        uint8_t b = s->ring[(from + i) & (LZ4_WINDOW - 1)];
+        s->ring[(s->ring_pos + i) & (LZ4_WINDOW - 1)] = b;
+        out[done + i] = b;
+      }
+
+      lz4_advance(s, n);
+      s->match_left -= n;
+      done += n;
+    }
+    else if (s->literal_left)
+    {
+      if (s->in_pos == s->in_len && lz4_refill(s))
+        return -1;
+
+      uint32_t n = s->literal_left;
+      if (n > len - done)
+        n = len - done;
+      if (n > s->in_len - s->in_pos)
+        n = s->in_len - s->in_pos;
+
+      const uint8_t *src = s->in + s->in_pos;
+      uint32_t at = s->ring_pos & (LZ4_WINDOW - 1);
+      uint32_t first = LZ4_WINDOW - at < n ? LZ4_WINDOW - at : n;
+
+      memcpy(out + done, src, n);
+      memcpy(s->ring + at, src, first);
+      memcpy(s->ring, src + first, n - first);
+
+      lz4_advance(s, n);
+      s->in_pos += n;
+      s->block_left -= n;
+      s->literal_left -= n;
+      done += n;
+    }
+    else if (s->need_match && s->block_left == 0)
+    {
+      s->need_match = 0; // last sequence of the block has no match
+    }
+    else if (s->need_match)
+    {
+      if (lz4_match(s))
+        return -1;
+    }
+    else if (s->block_left)
+    {
+      if (lz4_sequence(s))
+        return -1;
+    }
+    else if (lz4_next_block(s))
+    {
+      return -1;
+    }
+  }
+
+  return (int32_t)done;
+}
+
+// Prints a file read through `read`, decompressing it on the fly when it
+// starts with an LZ4 frame
+void lz4_cat(lz4_read_fn read, void *ctx)
+{
+  static uint8_t chunk[LZ4_IN_CHUNK];
+  int32_t n = read(ctx, chunk, sizeof(chunk));
+
+  if (n > 0 && lz4_is_frame(chunk, (uint32_t)n))
+  {
+    if (lz4_open(&lz4_stream, read, ctx, chunk, (uint32_t)n))
+      n = -1;
+    else
+      n = lz4_read(&lz4_stream, chunk, sizeof(chunk));
+
+    while (n > 0)
+    {
+      terminal_write((const char *)chunk, (size_t)n);
+      n = lz4_read(&lz4_stream, chunk, sizeof(chunk));
+    }
+  }
+  else
+  {
+    while (n > 0)
+    {
+      terminal_write((const char *)chunk, (size_t)n);
+      n = read(ctx, chunk, sizeof(chunk));
+    }
+  }
+
+  if (n < 0)
+    terminal_writestring("Read error.\n");
+}
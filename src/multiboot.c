@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+// ===== Multiboot information =====
+// GRUB passes the magic in EAX and the physical address of its info
+// structure in EBX; boot.asm hands both to kernel_main. The structure and
+// the module list can live anywhere in memory (also where the heap goes),
+// so multiboot_init() copies what the kernel needs before init_heap().
+// Modules themselves are loaded page aligned (MBALIGN) above the kernel.
+
+#define MULTIBOOT_BOOTLOADER_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MODS (1 << 3) // mods_count/mods_addr are valid
+
+typedef struct
+{
+  uint32_t flags;
+  uint32_t mem_lower;
+  uint32_t mem_upper;
+  uint32_t boot_device;
+  uint32_t cmdline;
+  uint32_t mods_count;
+  uint32_t mods_addr;
+} __attribute__((packed)) multiboot_info_t;
+
+typedef struct
+{
+  uint32_t mod_start;
+  uint32_t mod_end; // first byte past the module
+  uint32_t cmdline;
+  uint32_t reserved;
+} __attribute__((packed)) multiboot_module_t;
+
+// First boot module (the `module` line in grub.cfg), empty if none
+static const uint8_t *multiboot_module_start;
+static uint32_t multiboot_module_size;
+
+void multiboot_init(uint32_t magic, uint32_t info_addr)
+{
+  if (magic != MULTIBOOT_BOOTLOADER_MAGIC || info_addr == 0)
+    return;
+
+  const multiboot_info_t *info = (const multiboot_info_t *)info_addr;
+  if (!(info->flags & MULTIBOOT_INFO_MODS) || info->mods_count == 0)
+    return;
+
+  const multiboot_module_t *mod = (const multiboot_module_t *)info->mods_addr;
+  if (mod->mod_end <= mod->mod_start)
+    return;
+
+  multiboot_module_start = (const uint8_t *)mod->mod_start;
+  multiboot_module_size = mod->mod_end - mod->mod_start;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "io.c"
+#include <stdint.h>
+
+// ===== PCI configuration space (mechanism #1) =====
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+#define PCI_VENDOR_ID 0x00
+#define PCI_COMMAND 0x04
+#define PCI_CLASS_REVISION 0x08
+#define PCI_HEADER_TYPE 0x0E
+#define PCI_BAR0 0x10
+#define PCI_INTERRUPT_LINE 0x3C
+
+#define PCI_COMMAND_IO 0x0001
+#define PCI_COMMAND_MEMORY 0x0002
+#define PCI_COMMAND_BUS_MASTER 0x0004
+
+typedef struct
+{
+  uint8_t bus;
+  uint8_t device;
+  uint8_t function;
+  uint16_t vendor_id;
+  uint16_t device_id;
+  uint8_t class_code;
+  uint8_t subclass;
+  uint8_t prog_if;
+  uint8_t irq_line;
+} pci_device_t;
+
+static uint32_t pci_address(uint8_t bus, uint8_t device, uint8_t function,
+                            uint8_t offset)
+{
+  return 0x80000000u | ((uint32_t)bus << 16) | ((uint32_t)device << 11) |
+         ((uint32_t)function << 8) | (offset & 0xFC);
+}
+
+uint32_t pci_read32(const pci_device_t *dev, uint8_t offset)
+{
+  outl(PCI_CONFIG_ADDRESS,
+       pci_address(dev->bus, dev->device, dev->function, offset));
+  return inl(PCI_CONFIG_DATA);
+}
+
+void pci_write32(const pci_device_t *dev, uint8_t offset, uint32_t value)
+{
+  outl(PCI_CONFIG_ADDRESS,
+       pci_address(dev->bus, dev->device, dev->function, offset));
+  outl(PCI_CONFIG_DATA, value);
+}
+
+uint16_t pci_read16(const pci_device_t *dev, uint8_t offset)
+{
+  return (uint16_t)(pci_read32(dev, offset) >> ((offset & 2) * 8));
+}
+
+void pci_write16(const pci_device_t *dev, uint8_t offset, uint16_t value)
+{
+  uint32_t v = pci_read32(dev, offset);
+  uint32_t shift = (offset & 2) * 8;
+
+  v &= ~(0xFFFFu << shift);
+  v |= (uint32_t)value << shift;
+  pci_write32(dev, offset, v);
+}
+
+// Base address register `bar` (0..5) with the type bits masked off
+uint32_t pci_read_bar(const pci_device_t *dev, int bar)
+{
+  uint32_t v = pci_read32(dev, PCI_BAR0 + bar * 4);
+
+  if (v & 1)
+    return v & 0xFFFFFFFC; // I/O space
+  return v & 0xFFFFFFF0;   // memory space
+}
+
+void pci_enable_bus_master(const pci_device_t *dev)
+{
+  uint16_t cmd = pci_read16(dev, PCI_COMMAND);
+  cmd |= PCI_COMMAND_IO | PCI_COMMAND_MEMORY | PCI_COMMAND_BUS_MASTER;
+  pci_write16(dev, PCI_COMMAND, cmd);
+}
+
+static void pci_fill_device(pci_device_t *dev)
+{
+  uint32_t id = pci_read32(dev, PCI_VENDOR_ID);
+  uint32_t cls = pci_read32(dev, PCI_CLASS_REVISION);
+
+  dev->vendor_id = id & 0xFFFF;
+  dev->device_id = id >> 16;
+  dev->class_code = cls >> 24;
+  dev->subclass = (cls >> 16) & 0xFF;
+  dev->prog_if = (cls >> 8) & 0xFF;
+  dev->irq_line = pci_read32(dev, PCI_INTERRUPT_LINE) & 0xFF;
+}
+
+typedef int (*pci_match_t)(const pci_device_t *dev, uint32_t a, uint32_t b);
+
+// Brute-force scan of every bus/device/function. Returns 1 and fills `out`
+// with the first function `match` accepts, 0 if there is none.
+static int pci_find(pci_match_t match, uint32_t a, uint32_t b, pci_device_t *out)
+{
+  for (uint32_t bus = 0; bus < 256; bus++)
+  {
+    for (uint8_t device = 0; device < 32; device++)
+    {
+      for (uint8_t function = 0; function < 8; function++)
+      {
+        pci_device_t dev = {0};
+        dev.bus = bus;
+        dev.device = device;
+        dev.function = function;
+
+        if ((pci_read32(&dev, PCI_VENDOR_ID) & 0xFFFF) == 0xFFFF)
+        {
+          if (function == 0)
+            break; // no device in this slot
+          continue;
+        }
+
+        pci_fill_device(&dev);
+
+        if (match(&dev, a, b))
+        {
+          *out = dev;
+          return 1;
+        }
+
+        // Single-function device: don't probe functions 1..7
+        if (function == 0 && !(pci_read16(&dev, PCI_HEADER_TYPE) & 0x80))
+          break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int pci_match_class(const pci_device_t *dev, uint32_t class_code,
+                           uint32_t subclass)
+{
+  return dev->class_code == class_code && dev->subclass == subclass;
+}
+
+static int pci_match_id(const pci_device_t *dev, uint32_t vendor_id,
+                        uint32_t device_id)
+{
+  return dev->vendor_id == vendor_id && dev->device_id == device_id;
+}
+
+// First function of the given class and subclass
+int pci_find_class(uint8_t class_code, uint8_t subclass, pci_device_t *out)
+{
+  return pci_find(pci_match_class, class_code, subclass, out);
+}
+
+// First function with the given vendor and device ID
+int pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t *out)
+{
+  return pci_find(pci_match_id, vendor_id, device_id, out);
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+#include "lz4.c"
+#include "multiboot.c"
+#include "string.c"
+#include "term.c"
+#include "utils.c"
+#include <stddef.h>
+#include <stdint.h>
+
+// ===== RAM file system (/ram) =====
+// A read-only ustar archive loaded by GRUB as the first multiboot module
+// (build.sh packs the ramfs/ directory). The archive is used in place:
+// lookups walk the 512-byte headers in memory and file data is handed out
+// straight from the module, so nothing here touches a disk.
+
+#define RAMFS_BLOCK 512
+#define RAMFS_PATH_MAX 256
+
+typedef struct
+{
+  const uint8_t *image;
+  uint32_t size;
+  uint8_t mounted;
+} ramfs_t;
+
+static ramfs_t ramfs;
+
+// ustar header fields used here
+#define RAMFS_NAME 0     // 100 bytes
+#define RAMFS_SIZE 124   // 12 bytes, octal
+#define RAMFS_TYPE 156   // '0' or 0 = file, '5' = directory
+#define RAMFS_MAGIC 257  // "ustar"
+#define RAMFS_PREFIX 345 // 155 bytes, prepended to the name
+
+static uint32_t ramfs_octal(const uint8_t *p, uint32_t len)
+{
+  uint32_t v = 0;
+
+  for (uint32_t i = 0; i < len && p[i] >= '0' && p[i] <= '7'; i++)
+    v = (v << 3) | (uint32_t)(p[i] - '0');
+
+  return v;
+}
+
+static int ramfs_is_header(const uint8_t *h)
+{
+  return memcmp(h + RAMFS_MAGIC, "ustar", 5) == 0;
+}
+
+// Mounts the boot module if it is a ustar archive. Returns 0 on success.
+int ramfs_mount(void)
+{
+  if (multiboot_module_size < RAMFS_BLOCK ||
+      !ramfs_is_header(multiboot_module_start))
+    return 1;
+
+  ramfs.image = multiboot_module_start;
+  ramfs.size = multiboot_module_size;
+  ramfs.mounted = 1;
+  return 0;
+}
+
+// Full path of a header without "./", leading or trailing slashes
+static void ramfs_entry_path(const uint8_t *h, char *out)
+{
+  uint32_t n = 0;
+
+  for (uint32_t i = 0; i < 155 && h[RAMFS_PREFIX + i] && n < RAMFS_PATH_MAX - 2; i++)
+    out[n++] = (char)h[RAMFS_PREFIX + i];
+  if (n)
+    out[n++] = '/';
+  for (uint32_t i = 0; i < 100 && h[RAMFS_NAME + i] && n < RAMFS_PATH_MAX - 1; i++)
+    out[n++] = (char)h[RAMFS_NAME + i];
+  out[n] = 0;
+
+  // "./dir/" -> "dir"
+  uint32_t skip = 0;
+  while (out[skip] == '/' || (out[skip] == '.' && (out[skip + 1] == '/' || out[skip + 1] == 0)))
+    skip++;
+  while (n > skip && out[n - 1] == '/')
+    n--;
+
+  for (uint32_t i = skip; i < n; i++)
+    out[i - skip] = out[i];
+  out[n - skip] = 0;
+}
+
+// Next header after `h`, NULL at the end of the archive
+static const uint8_t *ramfs_next(const uint8_t *h)
+{
+  uint32_t size = ramfs_octal(h + RAMFS_SIZE, 12);
+  uint32_t offset = (uint32_t)(h - ramfs.image) + RAMFS_BLOCK +
+                    (size + RAMFS_BLOCK - 1) / RAMFS_BLOCK * RAMFS_BLOCK;
+
+  if (offset + RAMFS_BLOCK > ramfs.size || !ramfs_is_header(ramfs.image + offset))
+    return NULL;
+  return ramfs.image + offset;
+}
+
+static const uint8_t *ramfs_first(void)
+{
+  return ramfs.mounted ? ramfs.image : NULL;
+}
+
+// Strips leading and trailing slashes from a user path into `out`
+static void ramfs_clean_path(const char *path, char *out)
+{
+  while (*path == '/')
+    path++;
+
+  uint32_t n = 0;
+  while (path[n] && n < RAMFS_PATH_MAX - 1)
+  {
+    out[n] = path[n];
+    n++;
+  }
+  while (n && out[n - 1] == '/')
+    n--;
+  out[n] = 0;
+}
+
+// Looks up a file. Returns 1 and its data when found.
+int ramfs_open(const char *path, const uint8_t **data, uint32_t *size)
+{
+  static char want[RAMFS_PATH_MAX];
+  static char name[RAMFS_PATH_MAX];
+
+  ramfs_clean_path(path, want);
+
+  for (const uint8_t *h = ramfs_first(); h; h = ramfs_next(h))
+  {
+    uint8_t type = h[RAMFS_TYPE];
+    if (type != '0' && type != 0)
+      continue;
+
+    ramfs_entry_path(h, name);
+    if (strcmp(name, want) == 0)
+    {
+      *data = h + RAMFS_BLOCK;
+      *size = ramfs_octal(h + RAMFS_SIZE, 12);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+// Lists the entries directly inside `path`
+void ramfs_ls(const char *path)
+{
+  static char dir[RAMFS_PATH_MAX];
+  static char name[RAMFS_PATH_MAX];
+
+  if (!ramfs.mounted)
+  {
+    terminal_writestring("No RAM disk\n");
+    return;
+  }
+
+  ramfs_clean_path(path, dir);
+  uint32_t dir_len = (uint32_t)strlen(dir);
+
+  for (const uint8_t *h = ramfs_first(); h; h = ramfs_next(h))
+  {
+    ramfs_entry_path(h, name);
+
+    const char *rest = name;
+    if (dir_len)
+    {
+      if (memcmp(name, dir, dir_len) != 0 || name[dir_len] != '/')
+        continue;
+      rest = name + dir_len + 1;
+    }
+
+    const char *slash = rest;
+    while (*slash && *slash != '/')
+      slash++;
+    if (*rest == 0 || *slash)
+      continue;
+
+    terminal_writestring(rest);
+    terminal_writestring(h[RAMFS_TYPE] == '5' ? "/\n" : "\n");
+  }
+}
+
+// Sequential reader over a file's data, for lz4_read_fn users
+typedef struct
+{
+  const uint8_t *data;
+  uint32_t size;
+  uint32_t pos;
+} ramfs_file_t;
+
+int32_t ramfs_read(void *ctx, void *buffer, uint32_t len)
+{
+  ramfs_file_t *file = (ramfs_file_t *)ctx;
+
+  if (len > file->size - file->pos)
+    len = file->size - file->pos;
+  memcpy(buffer, file->data + file->pos, len);
+  file->pos += len;
+
+  return (int32_t)len;
+}
+
+void ramfs_cat(const char *path)
+{
+  ramfs_file_t file = {0};
+
+  if (!ramfs_open(path, &file.data, &file.size))
+  {
+    terminal_writestring("File not found.\n");
+    return;
+  }
+
+  // LZ4 frames are decompressed on the fly
+  lz4_cat(ramfs_read, &file);
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "idt.c"
+#include "io.c"
+#include "utils.c"
+#include <stdint.h>
+
+// ===== PIT =====
+// Channel 0 drives the periodic tick on IRQ0, channel 2 is used only for
+// TSC calibration
+#define PIT_CHANNEL0 0x40
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND 0x43
+#define PIT_GATE 0x61
+#define PIT_FREQUENCY 1193182
+
+#define TIMER_CALIBRATE_MS 50
+#define TIMER_HZ 100
+
+// TSC cycles per millisecond, measured by timer_init()
+uint32_t tsc_khz;
+
+// Incremented by IRQ0 TIMER_HZ times per second. Besides keeping time it
+// guarantees that a CPU halted in `hlt` wakes up regularly.
+volatile uint32_t timer_ticks;
+
+static inline uint64_t rdtsc(void)
+{
+  uint32_t lo, hi;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// Measures the TSC frequency against a one-shot PIT channel 2 countdown.
+void timer_init(void)
+{
+  uint16_t latch = PIT_FREQUENCY * TIMER_CALIBRATE_MS / 1000;
+
+  // Gate high, speaker off
+  outb(PIT_GATE, (inb(PIT_GATE) & ~0x02) | 0x01);
+
+  // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+  outb(PIT_COMMAND, 0xB0);
+  outb(PIT_CHANNEL2, latch & 0xFF);
+  outb(PIT_CHANNEL2, latch >> 8);
+
+  uint64_t start = rdtsc();
+  while (!(inb(PIT_GATE) & 0x20))
+  {
+  }
+  uint64_t end = rdtsc();
+
+  tsc_khz = (uint32_t)udiv64(end - start, TIMER_CALIBRATE_MS);
+  if (tsc_khz == 0)
+    tsc_khz = 1;
+}
+
+static inline uint64_t timer_now(void) { return rdtsc(); }
+
+uint64_t timer_cycles_to_us(uint64_t cycles)
+{
+  return udiv64(cycles * 1000, tsc_khz);
+}
+
+uint64_t timer_us_to_cycles(uint32_t us)
+{
+  return udiv64((uint64_t)us * tsc_khz, 1000);
+}
+
+uint64_t timer_ms_to_cycles(uint32_t ms) { return (uint64_t)ms * tsc_khz; }
+
+static void timer_irq(int irq)
+{
+  (void)irq;
+  timer_ticks++;
+}
+
+// Starts the periodic IRQ0 tick. Needs idt_init() first.
+void timer_start_tick(void)
+{
+  uint16_t divisor = PIT_FREQUENCY / TIMER_HZ;
+
+  // Channel 0, lobyte/hibyte, mode 3 (square wave)
+  outb(PIT_COMMAND, 0x36);
+  outb(PIT_CHANNEL0, divisor & 0xFF);
+  outb(PIT_CHANNEL0, divisor >> 8);
+
+  irq_install(0, timer_irq);
+}
@@ -173,10 +173,69 @@ int memcmp(const void *s1, const void *s2, size_t n) {
     return 0;
 }
 
+// Freestanding compilers may emit calls to memcpy on their own as well
+void *memcpy(void *dest, const void *src, size_t n)
+{
+  void *ret = dest;
+  size_t dwords = n >> 2;
+
+  __asm__ __volatile__("cld; rep movsl"
+                       : "+D"(dest), "+S"(src), "+c"(dwords)
+                       :
+                       : "memory");
+  n &= 3;
+  __asm__ __volatile__("rep movsb"
+                       : "+D"(dest), "+S"(src), "+c"(n)
+                       :
+                       : "memory");
+  return ret;
+}
+
 static void memcpy_c(void *dst, const void *src, int n)
 {
   char *d = (char *)dst;
   const char *s = (const char *)src;
   while (n--)
     *d++ = *s++;
-}
\ No newline at end of file
+}
+
+// 64-bit by 32-bit unsigned division. We link without libgcc, so plain
+// `uint64_t / uint32_t` would pull in an unresolved __udivdi3.
+static inline uint64_t udiv64(uint64_t n, uint32_t d)
+{
+  uint32_t hi = (uint32_t)(n >> 32);
+  uint32_t lo = (uint32_t)n;
+  uint32_t q_hi = hi / d;
+  uint32_t r = hi % d;
+  uint32_t q_lo;
+
+  // r < d, so the quotient of r:lo / d fits in 32 bits
+  __asm__("divl %4" : "=a"(q_lo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+
+  return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// Decimal conversion of a 64-bit value (utoa_bare only takes a long)
+char *u64toa_bare(char *buf, size_t bufsize, uint64_t value)
+{
+  char tmp[21];
+  size_t ti = 0;
+
+  if (!buf || bufsize == 0)
+    return NULL;
+
+  do
+  {
+    uint64_t q = udiv64(value, 10);
+    tmp[ti++] = (char)('0' + (uint32_t)(value - q * 10));
+    value = q;
+  } while (value);
+
+  if (ti + 1 > bufsize)
+    return NULL;
+
+  for (size_t j = 0; j < ti; j++)
+    buf[j] = tmp[ti - 1 - j];
+  buf[ti] = '\0';
+  return buf;
+}
@@ -0,0 +1,489 @@
+#pragma once
+
+#include "block.c"
+#include "debug.c"
+#include "idt.c"
+#include "io.c"
+#include "iosched.c"
+#include "pci.c"
+#include "utils.c"
+#include <stdint.h>
+
+// ===== virtio-blk (legacy PCI) =====
+// Paravirtual disk for QEMU (-drive if=virtio). A request is a chain of
+// descriptors in a shared ring: a header (type + sector), the data buffers
+// and a status byte the device fills in. There are no per-sector port
+// accesses: requests are added to the available ring and the device is
+// notified once per batch (blkdev kick), and only when it asked to be
+// (VIRTIO_RING_F_EVENT_IDX). With EVENT_IDX completions are also
+// coalesced: the device is asked to interrupt only after about half of the
+// outstanding requests have finished, and at the latest when the last one
+// has. Paging is off, so ring and buffer addresses are physical.
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_BLK_DEVICE_ID 0x1001 // transitional (legacy-capable) block
+
+// Legacy I/O registers (BAR0)
+#define VIRTIO_REG_DEVICE_FEATURES 0x00
+#define VIRTIO_REG_GUEST_FEATURES 0x04
+#define VIRTIO_REG_QUEUE_PFN 0x08
+#define VIRTIO_REG_QUEUE_SIZE 0x0C
+#define VIRTIO_REG_QUEUE_SELECT 0x0E
+#define VIRTIO_REG_QUEUE_NOTIFY 0x10
+#define VIRTIO_REG_STATUS 0x12
+#define VIRTIO_REG_ISR 0x13
+#define VIRTIO_REG_CONFIG 0x14 // device config, without MSI-X
+
+#define VIRTIO_STATUS_ACK 0x01
+#define VIRTIO_STATUS_DRIVER 0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VIRTIO_BLK_F_SEG_MAX (1u << 2)
+#define VIRTIO_BLK_F_RO (1u << 5)
+#define VIRTIO_BLK_F_BLK_SIZE (1u << 6)
+#define VIRTIO_BLK_F_FLUSH (1u << 9)
+#define VIRTIO_BLK_F_TOPOLOGY (1u << 10)
+#define VIRTIO_RING_F_EVENT_IDX (1u << 29)
+
+// virtio-blk config space
+#define VIRTIO_BLK_CFG_CAPACITY 0x00 // 64-bit, 512-byte sectors
+#define VIRTIO_BLK_CFG_SEG_MAX 0x0C
+#define VIRTIO_BLK_CFG_BLK_SIZE 0x14  // logical block size, bytes
+#define VIRTIO_BLK_CFG_PHYS_EXP 0x18  // log2 logical blocks per physical
+#define VIRTIO_BLK_CFG_ALIGN 0x19     // first aligned logical block
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VRING_DESC_F_NEXT 1
+#define VRING_DESC_F_WRITE 2 // device writes into the buffer
+#define VRING_USED_F_NO_NOTIFY 1
+
+#define VIRTIO_BLK_QUEUE_MAX 256 // largest ring the static area holds
+#define VIRTIO_BLK_MAX_SEGMENTS 64
+#define VIRTIO_BLK_MAX_BYTES (4 * 1024 * 1024) // merged chains
+#define VIRTIO_BLK_MAX_BLOCK 4096              // largest logical block
+
+typedef struct
+{
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} __attribute__((packed)) vring_desc_t;
+
+typedef struct
+{
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[]; // then used_event
+} vring_avail_t;
+
+typedef struct
+{
+  uint32_t id;
+  uint32_t len;
+} __attribute__((packed)) vring_used_elem_t;
+
+typedef struct
+{
+  uint16_t flags;
+  uint16_t idx;
+  vring_used_elem_t ring[]; // then avail_event
+} vring_used_t;
+
+typedef struct
+{
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} __attribute__((packed)) virtio_blk_hdr_t;
+
+// Legacy layout: descriptors and available ring, then the used ring on
+// the next 4 KiB boundary
+static uint8_t virtio_blk_ring[16384] __attribute__((aligned(4096)));
+
+typedef struct
+{
+  uint16_t io;
+  uint8_t irq;
+  uint8_t event_idx;
+  uint8_t read_only;
+  uint8_t sector_shift; // log2 of 512-byte units per logical sector
+
+  uint16_t size; // ring entries
+  vring_desc_t *desc;
+  vring_avail_t *avail;
+  vring_used_t *used;
+  volatile uint16_t *used_event;  // in the available ring, written by us
+  volatile uint16_t *avail_event; // in the used ring, written by the device
+
+  uint16_t free_head; // free descriptors, linked through `next`
+  uint16_t num_free;
+  uint16_t avail_idx;   // our copy of avail->idx
+  uint16_t kicked_idx;  // avail_idx at the last notify
+  uint16_t last_used;   // used entries consumed so far
+  uint16_t in_flight;
+
+  // Per request, indexed by its head descriptor
+  blk_request_t *reqs[VIRTIO_BLK_QUEUE_MAX];
+  virtio_blk_hdr_t hdrs[VIRTIO_BLK_QUEUE_MAX];
+  volatile uint8_t status[VIRTIO_BLK_QUEUE_MAX];
+
+  // Requests waiting for descriptors (FIFO)
+  blk_request_t *head;
+  blk_request_t *tail;
+
+  uint32_t notifies;
+  uint32_t irq_count;
+  blkdev_t *dev;
+} virtio_blk_t;
+
+virtio_blk_t virtio_blk;
+
+// vring_need_event() from the virtio spec: has `event` been passed when the
+// index moved from `old_idx` to `new_idx`?
+static int virtio_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx)
+{
+  return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static uint16_t virtio_alloc_desc(virtio_blk_t *vb)
+{
+  uint16_t d = vb->free_head;
+
+  vb->free_head = vb->desc[d].next;
+  vb->num_free--;
+  return d;
+}
+
+static void virtio_free_chain(virtio_blk_t *vb, uint16_t head)
+{
+  uint16_t d = head;
+
+  for (;;)
+  {
+    uint16_t flags = vb->desc[d].flags;
+    uint16_t next = vb->desc[d].next;
+
+    vb->desc[d].next = vb->free_head;
+    vb->free_head = d;
+    vb->num_free++;
+
+    if (!(flags & VRING_DESC_F_NEXT))
+      break;
+    d = next;
+  }
+}
+
+static void virtio_set_desc(virtio_blk_t *vb, uint16_t d, const void *addr,
+                            uint32_t len, uint16_t flags)
+{
+  vb->desc[d].addr = (uint32_t)addr;
+  vb->desc[d].len = len;
+  vb->desc[d].flags = flags;
+}
+
+// Puts one request (or merged chain) on the available ring:
+// header, one descriptor per buffer, status
+static void virtio_blk_add(virtio_blk_t *vb, blk_request_t *req)
+{
+  uint16_t head = virtio_alloc_desc(vb);
+  uint16_t d = head;
+  uint16_t data_flags = req->write ? 0 : VRING_DESC_F_WRITE;
+
+  vb->reqs[head] = req;
+  vb->hdrs[head].type = req->flush   ? VIRTIO_BLK_T_FLUSH
+                        : req->write ? VIRTIO_BLK_T_OUT
+                                     : VIRTIO_BLK_T_IN;
+  vb->hdrs[head].reserved = 0;
+  vb->hdrs[head].sector = req->lba << vb->sector_shift; // 512-byte units
+  vb->status[head] = 0xFF;
+
+  virtio_set_desc(vb, d, &vb->hdrs[head], sizeof(virtio_blk_hdr_t),
+                  VRING_DESC_F_NEXT);
+
+  for (blk_request_t *r = req->flush ? NULL : req; r; r = r->merge_next)
+  {
+    uint16_t n = virtio_alloc_desc(vb);
+    vb->desc[d].next = n;
+    d = n;
+    virtio_set_desc(vb, d, r->buffer, r->count * vb->dev->sector_size,
+                    data_flags | VRING_DESC_F_NEXT);
+  }
+
+  uint16_t s = virtio_alloc_desc(vb);
+  vb->desc[d].next = s;
+  virtio_set_desc(vb, s, (const void *)&vb->status[head], 1, VRING_DESC_F_WRITE);
+
+  vb->avail->ring[vb->avail_idx % vb->size] = head;
+  vb->avail_idx++;
+  vb->in_flight++;
+
+  // Descriptors must be visible before the index that publishes them
+  io_barrier();
+  vb->avail->idx = vb->avail_idx;
+}
+
+// Moves waiting requests onto the ring while descriptors last
+static void virtio_blk_start(virtio_blk_t *vb)
+{
+  while (vb->head)
+  {
+    blk_request_t *req = vb->head;
+    uint32_t segments = 0;
+
+    for (blk_request_t *r = req; r; r = r->merge_next)
+      segments++;
+    if (vb->num_free < segments + 2)
+      return;
+
+    vb->head = req->next;
+    if (!vb->head)
+      vb->tail = NULL;
+
+    if (req->write && vb->read_only)
+    {
+      blk_complete(vb->dev, req, 1);
+      continue;
+    }
+
+    virtio_blk_add(vb, req);
+  }
+}
+
+// Notifies the device of new requests, unless it said it doesn't need to
+// know yet
+static void virtio_blk_notify(virtio_blk_t *vb)
+{
+  if (vb->avail_idx == vb->kicked_idx)
+    return;
+
+  io_mb();
+
+  int notify;
+  if (vb->event_idx)
+    notify = virtio_need_event(*vb->avail_event, vb->avail_idx, vb->kicked_idx);
+  else
+    notify = !(vb->used->flags & VRING_USED_F_NO_NOTIFY);
+
+  vb->kicked_idx = vb->avail_idx;
+  if (notify)
+  {
+    vb->notifies++;
+    outw(vb->io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+  }
+}
+
+// Completes everything on the used ring. Runs from the IRQ handler and
+// from polling, always with interrupts disabled.
+static void virtio_blk_service(virtio_blk_t *vb)
+{
+  for (;;)
+  {
+    while (vb->last_used != *(volatile uint16_t *)&vb->used->idx)
+    {
+      io_barrier();
+      uint16_t head = vb->used->ring[vb->last_used % vb->size].id;
+      blk_request_t *req = vb->reqs[head];
+      int error = vb->status[head] != 0;
+
+      vb->last_used++;
+      vb->in_flight--;
+      vb->reqs[head] = NULL;
+      virtio_free_chain(vb, head);
+      blk_complete(vb->dev, req, error);
+    }
+
+    if (!vb->event_idx)
+      break;
+
+    // Next interrupt once half of what is outstanding has finished (the
+    // next completion if only one is left), then look again in case it
+    // already happened
+    *vb->used_event = vb->last_used + vb->in_flight / 2;
+    io_mb();
+    if (vb->last_used == *(volatile uint16_t *)&vb->used->idx)
+      break;
+  }
+
+  virtio_blk_start(vb);
+  virtio_blk_notify(vb);
+}
+
+static void virtio_blk_irq(int irq)
+{
+  virtio_blk_t *vb = &virtio_blk;
+
+  // Reading ISR acknowledges the interrupt; 0 means another device on a
+  // shared line raised it
+  if (!(inb(vb->io + VIRTIO_REG_ISR) & 1))
+    return;
+
+  vb->irq_count++;
+  virtio_blk_service(vb);
+}
+
+// ===== Block device =====
+static void virtio_blk_submit(blkdev_t *dev, blk_request_t *req)
+{
+  virtio_blk_t *vb = (virtio_blk_t *)dev->priv;
+
+  if (vb->tail)
+    vb->tail->next = req;
+  else
+    vb->head = req;
+  vb->tail = req;
+
+  virtio_blk_start(vb);
+}
+
+static void virtio_blk_kick(blkdev_t *dev)
+{
+  virtio_blk_notify((virtio_blk_t *)dev->priv);
+}
+
+static void virtio_blk_poll(blkdev_t *dev)
+{
+  virtio_blk_service((virtio_blk_t *)dev->priv);
+}
+
+// The device has no way to cancel a request; notify it unconditionally in
+// case a notification got lost
+static void virtio_blk_abort(blkdev_t *dev)
+{
+  virtio_blk_t *vb = (virtio_blk_t *)dev->priv;
+
+  vb->kicked_idx = vb->avail_idx;
+  outw(vb->io + VIRTIO_REG_QUEUE_NOTIFY, 0);
+}
+
+iosched_t virtio_blk_iosched;
+
+blkdev_t virtio_blkdev = {
+    .name = "vda",
+    .sector_size = 512,
+    .max_sectors = VIRTIO_BLK_MAX_BYTES / 512,
+    .max_segments = VIRTIO_BLK_MAX_SEGMENTS,
+    .submit = virtio_blk_submit,
+    .poll = virtio_blk_poll,
+    .abort = virtio_blk_abort,
+    .kick = virtio_blk_kick,
+    .priv = &virtio_blk,
+};
+
+// Finds a virtio-blk device and sets up its request queue. Returns 1 if
+// virtio_blkdev is usable. Needs idt_init().
+int virtio_blk_init(void)
+{
+  pci_device_t pci;
+  virtio_blk_t *vb = &virtio_blk;
+
+  if (!pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &pci))
+    return 0;
+
+  uint32_t bar0 = pci_read32(&pci, PCI_BAR0);
+  if (!(bar0 & 1))
+    return 0; // legacy interface lives in I/O space
+
+  pci_enable_bus_master(&pci);
+  vb->io = bar0 & 0xFFFC;
+
+  // Reset, then acknowledge the device and negotiate features
+  outb(vb->io + VIRTIO_REG_STATUS, 0);
+  outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK);
+  outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+  uint32_t features = inl(vb->io + VIRTIO_REG_DEVICE_FEATURES);
+  features &= VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE |
+              VIRTIO_BLK_F_TOPOLOGY | VIRTIO_BLK_F_FLUSH |
+              VIRTIO_RING_F_EVENT_IDX;
+  outl(vb->io + VIRTIO_REG_GUEST_FEATURES, features);
+
+  vb->event_idx = (features & VIRTIO_RING_F_EVENT_IDX) != 0;
+  vb->read_only = (features & VIRTIO_BLK_F_RO) != 0;
+
+  // A device offering FLUSH caches writes (QEMU's default writeback mode)
+  virtio_blkdev.write_cache = (features & VIRTIO_BLK_F_FLUSH) != 0;
+
+  outw(vb->io + VIRTIO_REG_QUEUE_SELECT, 0);
+  uint16_t size = inw(vb->io + VIRTIO_REG_QUEUE_SIZE);
+  if (size == 0 || size > VIRTIO_BLK_QUEUE_MAX)
+  {
+    DebugWriteString("virtio-blk: unsupported queue size\n");
+    outb(vb->io + VIRTIO_REG_STATUS, VIRTIO_STATUS_FAILED);
+    return 0;
+  }
+
+  // Ring layout for `size` entries
+  uint32_t avail_offset = size * sizeof(vring_desc_t);
+  uint32_t used_offset = (avail_offset + 6 + 2 * size + 4095) & ~4095u;
+
+  memset(virtio_blk_ring, 0, sizeof(virtio_blk_ring));
+  vb->size = size;
+  vb->desc = (vring_desc_t *)virtio_blk_ring;
+  vb->avail = (vring_avail_t *)(virtio_blk_ring + avail_offset);
+  vb->used = (vring_used_t *)(virtio_blk_ring + used_offset);
+  vb->used_event = &vb->avail->ring[size];
+  vb->avail_event = (volatile uint16_t *)&vb->used->ring[size];
+
+  for (uint16_t i = 0; i < size; i++)
+    vb->desc[i].next = i + 1;
+  vb->free_head = 0;
+  vb->num_free = size;
+
+  outl(vb->io + VIRTIO_REG_QUEUE_PFN, (uint32_t)virtio_blk_ring >> 12);
+
+  uint32_t cfg = vb->io + VIRTIO_REG_CONFIG;
+  uint64_t capacity = ((uint64_t)inl(cfg + VIRTIO_BLK_CFG_CAPACITY + 4) << 32) |
+                      inl(cfg + VIRTIO_BLK_CFG_CAPACITY);
+
+  // Capacity and request sectors are always counted in 512 bytes; a
+  // larger logical block only changes what one LBA of ours covers
+  vb->sector_shift = 0;
+  if (features & VIRTIO_BLK_F_BLK_SIZE)
+  {
+    uint32_t blk_size = inl(cfg + VIRTIO_BLK_CFG_BLK_SIZE);
+    while (vb->sector_shift < 3 && (512u << vb->sector_shift) < blk_size &&
+           (512u << (vb->sector_shift + 1)) <= VIRTIO_BLK_MAX_BLOCK)
+      vb->sector_shift++;
+  }
+  virtio_blkdev.sector_size = 512u << vb->sector_shift;
+  virtio_blkdev.sectors = capacity >> vb->sector_shift;
+  virtio_blkdev.max_sectors = VIRTIO_BLK_MAX_BYTES / virtio_blkdev.sector_size;
+
+  if (features & VIRTIO_BLK_F_TOPOLOGY)
+  {
+    virtio_blkdev.phys_sectors = 1u << (inb(cfg + VIRTIO_BLK_CFG_PHYS_EXP) & 0x0F);
+    virtio_blkdev.phys_offset = inb(cfg + VIRTIO_BLK_CFG_ALIGN);
+  }
+
+  // A request takes a header and a status descriptor besides its buffers
+  uint32_t segments = size - 2;
+  if (features & VIRTIO_BLK_F_SEG_MAX)
+  {
+    uint32_t seg_max = inl(cfg + VIRTIO_BLK_CFG_SEG_MAX);
+    if (seg_max && seg_max < segments)
+      segments = seg_max;
+  }
+  if (segments > VIRTIO_BLK_MAX_SEGMENTS)
+    segments = VIRTIO_BLK_MAX_SEGMENTS;
+  virtio_blkdev.max_segments = segments;
+
+  vb->dev = &virtio_blkdev;
+
+  // Keep the ring full: every descriptor chain needs at least three slots
+  iosched_attach(&virtio_blkdev, &virtio_blk_iosched, size / 3);
+
+  if (pci.irq_line > 0 && pci.irq_line < 16 && !irq_install(pci.irq_line, virtio_blk_irq))
+    vb->irq = pci.irq_line;
+
+  outb(vb->io + VIRTIO_REG_STATUS,
+       VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+  DebugWriteString(vb->event_idx ? "virtio-blk: ready, EVENT_IDX\n"
+                                 : "virtio-blk: ready\n");
+  return 1;
+}